@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+import sys
+
+
+def gen_mt_bench(num_funcs: int, num_cases: int) -> str:
+    # Every thread walks all blocks of all functions, starting from a
+    # different function, so the threads discover new blocks at the same time.
+    lines = []
+    lines.append("#include <stdio.h>")
+    lines.append("#include <stdlib.h>")
+    lines.append("")
+    lines.append("#include <chrono>")
+    lines.append("#include <thread>")
+    lines.append("#include <vector>")
+    lines.append("")
+    lines.append("static thread_local int sink = 0;")
+    lines.append("")
+
+    for func_idx in range(num_funcs):
+        lines.append(f"void bench_f{func_idx}(int x) {{")
+        lines.append("  switch (x) {")
+        for case_idx in range(num_cases):
+            lines.append(f"    case {case_idx}:")
+            lines.append(f"      sink += {case_idx + func_idx};")
+            lines.append("      break;")
+        lines.append("    default:")
+        lines.append("      sink--;")
+        lines.append("  }")
+        lines.append("}")
+        lines.append("")
+
+    lines.append("typedef void (*bench_func)(int);")
+    lines.append("static const bench_func bench_funcs[] = {")
+    for func_idx in range(num_funcs):
+        lines.append(f"    bench_f{func_idx},")
+    lines.append("};")
+    lines.append("")
+    lines.append(f"static const int num_funcs = {num_funcs};")
+    lines.append(f"static const int num_cases = {num_cases};")
+    lines.append(
+        """
+static void run_thread(int thread_idx, int num_threads, int num_rounds) {
+  const int start = (num_funcs / num_threads) * thread_idx;
+  for (int round = 0; round < num_rounds; round++) {
+    for (int idx = 0; idx < num_funcs; idx++) {
+      bench_func func = bench_funcs[(start + idx) % num_funcs];
+      for (int x = 0; x <= num_cases; x++) {
+        func(x);
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    printf("Usage : %s <num_threads> [num_rounds]\\n", argv[0]);
+    return 1;
+  }
+
+  const int num_threads = atoi(argv[1]);
+  const int num_rounds = (argc > 2) ? atoi(argv[2]) : 1;
+
+  auto start_time = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> threads;
+  for (int idx = 0; idx < num_threads; idx++) {
+    threads.emplace_back(run_thread, idx, num_threads, num_rounds);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  auto end_time = std::chrono::steady_clock::now();
+  double elapsed =
+      std::chrono::duration<double, std::milli>(end_time - start_time).count();
+  printf("threads %d elapsed_ms %.3f\\n", num_threads, elapsed);
+  return 0;
+}"""
+    )
+    return "\n".join(lines) + "\n"
+
+
+def main(argv):
+    if len(argv) < 2:
+        print(f"Usage: {argv[0]} <out.cc> [num_funcs] [num_cases]")
+        print("  It generates a multi-threaded program for first-hit benchmarks.")
+        return 1
+
+    out_fn = argv[1]
+    num_funcs = int(argv[2]) if len(argv) >= 3 else 2000
+    num_cases = int(argv[3]) if len(argv) >= 4 else 64
+
+    with open(out_fn, "w") as outf:
+        outf.write(gen_mt_bench(num_funcs, num_cases))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+import sys
+
+
+def gen_func(lines, func_idx: int, num_cases: int, sp_id: int):
+    # Unnamed basic blocks with debug locations, like clang's output, so the
+    # pass names them by line ranges. %0 is the argument and %1 the entry.
+    line = func_idx * (num_cases + 8) + 1
+
+    def loc(offset: int) -> str:
+        return f"!DILocation(line: {line + offset}, scope: !{sp_id})"
+
+    def_label = 5 + 2 * num_cases
+    out_label = def_label + 1
+    ret_val = out_label + 1
+
+    lines.append(f"define i32 @bench_f{func_idx}(i32 %0) !dbg !{sp_id} {{")
+    lines.append(f"  %2 = icmp slt i32 %0, 0, !dbg {loc(1)}")
+    lines.append(f"  br i1 %2, label %3, label %4, !dbg {loc(1)}")
+    lines.append("3:")
+    lines.append(f"  br label %{out_label}, !dbg {loc(2)}")
+    lines.append("4:")
+    cases = " ".join(
+        f"i32 {case_idx}, label %{5 + 2 * case_idx}"
+        for case_idx in range(num_cases)
+    )
+    lines.append(f"  switch i32 %0, label %{def_label} [ {cases} ], !dbg {loc(3)}")
+    phis = ["[ 0, %3 ]"]
+    for case_idx in range(num_cases):
+        label = 5 + 2 * case_idx
+        lines.append(f"{label}:")
+        lines.append(
+            f"  %{label + 1} = add i32 %0, {case_idx + func_idx}, "
+            f"!dbg {loc(4 + case_idx)}"
+        )
+        lines.append(f"  br label %{out_label}, !dbg {loc(4 + case_idx)}")
+        phis.append(f"[ %{label + 1}, %{label} ]")
+    lines.append(f"{def_label}:")
+    lines.append(f"  br label %{out_label}, !dbg {loc(4 + num_cases)}")
+    phis.append(f"[ -1, %{def_label} ]")
+    lines.append(f"{out_label}:")
+    lines.append(f"  %{ret_val} = phi i32 {', '.join(phis)}, !dbg {loc(5 + num_cases)}")
+    lines.append(f"  ret i32 %{ret_val}, !dbg {loc(5 + num_cases)}")
+    lines.append("}")
+    lines.append("")
+
+
+def gen_pass_bench(num_funcs: int, num_cases: int, funcs_per_file: int) -> str:
+    # LLVM IR with debug info, so that generating a million functions does not
+    # depend on the time clang takes to compile them. Metadata: !0 compile
+    # unit, !1 subroutine type, !2 and !3 module flags, then one subprogram
+    # per function, main's and one file per funcs_per_file functions.
+    num_files = (num_funcs + funcs_per_file - 1) // funcs_per_file
+    main_sp_id = 4 + num_funcs
+    first_file_id = main_sp_id + 1
+
+    lines = []
+    for func_idx in range(num_funcs):
+        gen_func(lines, func_idx, num_cases, 4 + func_idx)
+
+    lines.append(f"define i32 @main(i32 %0, ptr %1) !dbg !{main_sp_id} {{")
+    lines.append(
+        "  %3 = call i32 @bench_f0(i32 %0), "
+        f"!dbg !DILocation(line: 1, scope: !{main_sp_id})"
+    )
+    lines.append(f"  ret i32 %3, !dbg !DILocation(line: 2, scope: !{main_sp_id})")
+    lines.append("}")
+    lines.append("")
+
+    lines.append("!llvm.dbg.cu = !{!0}")
+    lines.append("!llvm.module.flags = !{!2, !3}")
+    lines.append(
+        f"!0 = distinct !DICompileUnit(language: DW_LANG_C99, file: "
+        f"!{first_file_id}, producer: \"gen_pass_bench.py\", isOptimized: "
+        "false, runtimeVersion: 0, emissionKind: FullDebug)"
+    )
+    lines.append("!1 = !DISubroutineType(types: !{})")
+    lines.append('!2 = !{i32 7, !"Dwarf Version", i32 5}')
+    lines.append('!3 = !{i32 2, !"Debug Info Version", i32 3}')
+    for func_idx in range(num_funcs):
+        file_id = first_file_id + func_idx // funcs_per_file
+        line = func_idx * (num_cases + 8) + 1
+        lines.append(
+            f"!{4 + func_idx} = distinct !DISubprogram(name: "
+            f"\"bench_f{func_idx}\", scope: !{file_id}, file: !{file_id}, "
+            f"line: {line}, type: !1, scopeLine: {line}, spFlags: "
+            "DISPFlagDefinition, unit: !0)"
+        )
+    lines.append(
+        f"!{main_sp_id} = distinct !DISubprogram(name: \"main\", scope: "
+        f"!{first_file_id}, file: !{first_file_id}, line: 1, type: !1, "
+        "scopeLine: 1, spFlags: DISPFlagDefinition, unit: !0)"
+    )
+    for file_idx in range(num_files):
+        lines.append(
+            f"!{first_file_id + file_idx} = !DIFile(filename: "
+            f"\"pass_bench_{file_idx}.c\", directory: \"/bench\")"
+        )
+    return "\n".join(lines) + "\n"
+
+
+def main(argv):
+    if len(argv) < 2:
+        print(f"Usage: {argv[0]} <out.ll> [num_funcs] [num_cases] [funcs_per_file]")
+        print("  It generates a large module for compile-time benchmarks.")
+        return 1
+
+    out_fn = argv[1]
+    num_funcs = int(argv[2]) if len(argv) >= 3 else 10000
+    num_cases = int(argv[3]) if len(argv) >= 4 else 8
+    funcs_per_file = int(argv[4]) if len(argv) >= 5 else 100
+
+    with open(out_fn, "w") as outf:
+        outf.write(gen_pass_bench(num_funcs, num_cases, funcs_per_file))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,61 @@
+// CPU-bound kernels: a matrix multiplication and a sieve, few basic blocks
+// executed many times.
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+static double matmul(int size) {
+  std::vector<double> a(size * size), b(size * size), c(size * size, 0);
+  for (int idx = 0; idx < size * size; idx++) {
+    a[idx] = (idx % 7) * 0.5;
+    b[idx] = (idx % 5) * 0.25;
+  }
+
+  for (int row = 0; row < size; row++) {
+    for (int k = 0; k < size; k++) {
+      const double a_val = a[row * size + k];
+      for (int col = 0; col < size; col++) {
+        c[row * size + col] += a_val * b[k * size + col];
+      }
+    }
+  }
+
+  double sum = 0;
+  for (double val : c) {
+    sum += val;
+  }
+  return sum;
+}
+
+static int sieve(int limit) {
+  std::vector<char> is_composite(limit + 1, 0);
+  int num_primes = 0;
+  for (int num = 2; num <= limit; num++) {
+    if (is_composite[num]) {
+      continue;
+    }
+    num_primes++;
+    for (long multiple = (long)num * num; multiple <= limit; multiple += num) {
+      is_composite[multiple] = 1;
+    }
+  }
+  return num_primes;
+}
+
+int main(int argc, char *argv[]) {
+  // scale 0 only starts up, for the startup time
+  const int scale = (argc > 1) ? atoi(argv[1]) : 1;
+  if (scale == 0) {
+    return 0;
+  }
+
+  double sum = 0;
+  int num_primes = 0;
+  for (int round = 0; round < scale; round++) {
+    sum += matmul(200);
+    num_primes += sieve(2000000);
+  }
+  printf("cpu_kernel %f %d\n", sum, num_primes);
+  return 0;
+}
@@ -0,0 +1,144 @@
+// Parser-like branchy workload: a tokenizer and a recursive descent parser
+// of arithmetic expressions, with many basic blocks and unpredictable
+// branches.
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+
+struct Parser {
+  const std::string &text;
+  size_t pos;
+
+  void skip_spaces() {
+    while (pos < text.size() && isspace((unsigned char)text[pos])) {
+      pos++;
+    }
+  }
+
+  long parse_number() {
+    long val = 0;
+    while (pos < text.size() && isdigit((unsigned char)text[pos])) {
+      val = val * 10 + (text[pos] - '0');
+      pos++;
+    }
+    return val;
+  }
+
+  long parse_primary() {
+    skip_spaces();
+    if (pos >= text.size()) {
+      return 0;
+    }
+
+    switch (text[pos]) {
+    case '(': {
+      pos++;
+      const long val = parse_expr();
+      skip_spaces();
+      if (pos < text.size() && text[pos] == ')') {
+        pos++;
+      }
+      return val;
+    }
+    case '-':
+      pos++;
+      return -parse_primary();
+    default:
+      return parse_number();
+    }
+  }
+
+  long parse_term() {
+    long val = parse_primary();
+    while (true) {
+      skip_spaces();
+      if (pos >= text.size()) {
+        return val;
+      }
+      const char op = text[pos];
+      if (op == '*') {
+        pos++;
+        val = (val * parse_primary()) % 1000003;
+      } else if (op == '/') {
+        pos++;
+        const long divisor = parse_primary();
+        val = (divisor == 0) ? 0 : val / divisor;
+      } else if (op == '%') {
+        pos++;
+        const long divisor = parse_primary();
+        val = (divisor == 0) ? 0 : val % divisor;
+      } else {
+        return val;
+      }
+    }
+  }
+
+  long parse_expr() {
+    long val = parse_term();
+    while (true) {
+      skip_spaces();
+      if (pos >= text.size()) {
+        return val;
+      }
+      const char op = text[pos];
+      if (op == '+') {
+        pos++;
+        val = (val + parse_term()) % 1000003;
+      } else if (op == '-') {
+        pos++;
+        val = (val - parse_term()) % 1000003;
+      } else {
+        return val;
+      }
+    }
+  }
+};
+
+// pseudo random expression, the same on every run
+static void gen_expr(std::string &out, unsigned &seed, int depth) {
+  seed = seed * 1103515245 + 12345;
+  const unsigned choice = (seed >> 16) % 8;
+  if (depth == 0 || choice < 3) {
+    out += std::to_string((seed >> 8) % 1000);
+    return;
+  }
+
+  static const char ops[] = {'+', '-', '*', '/', '%'};
+  if (choice == 3) {
+    out += "(";
+    gen_expr(out, seed, depth - 1);
+    out += ")";
+    return;
+  }
+  if (choice == 4) {
+    out += "-";
+    gen_expr(out, seed, depth - 1);
+    return;
+  }
+  gen_expr(out, seed, depth - 1);
+  out += " ";
+  out += ops[(seed >> 4) % 5];
+  out += " ";
+  gen_expr(out, seed, depth - 1);
+}
+
+int main(int argc, char *argv[]) {
+  // scale 0 only starts up, for the startup time
+  const int scale = (argc > 1) ? atoi(argv[1]) : 1;
+  if (scale == 0) {
+    return 0;
+  }
+
+  unsigned seed = 1;
+  long sum = 0;
+  for (int round = 0; round < scale * 100000; round++) {
+    std::string text;
+    gen_expr(text, seed, 12);
+    Parser parser = {text, 0};
+    sum += parser.parse_expr();
+  }
+  printf("parser %ld\n", sum);
+  return 0;
+}
@@ -0,0 +1,45 @@
+// Deep recursion workload: function entries dominate, and the call depth
+// reaches tens of thousands of frames.
+#include <stdio.h>
+#include <stdlib.h>
+
+static long ackermann(long m, long n) {
+  if (m == 0) {
+    return n + 1;
+  }
+  if (n == 0) {
+    return ackermann(m - 1, 1);
+  }
+  return ackermann(m - 1, ackermann(m, n - 1));
+}
+
+static long fib(int n) {
+  if (n < 2) {
+    return n;
+  }
+  return fib(n - 1) + fib(n - 2);
+}
+
+static long depth_sum(long depth) {
+  if (depth == 0) {
+    return 0;
+  }
+  return depth + depth_sum(depth - 1);
+}
+
+int main(int argc, char *argv[]) {
+  // scale 0 only starts up, for the startup time
+  const int scale = (argc > 1) ? atoi(argv[1]) : 1;
+  if (scale == 0) {
+    return 0;
+  }
+
+  long sum = 0;
+  for (int round = 0; round < scale; round++) {
+    sum += ackermann(2, 2000);
+    sum += fib(30);
+    sum += depth_sum(50000);
+  }
+  printf("recursion %ld\n", sum);
+  return 0;
+}
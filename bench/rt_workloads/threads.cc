@@ -0,0 +1,59 @@
+// Multi-threaded workload: threads hash their own ranges of a shared
+// buffer, and add their results under a mutex.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static uint64_t hash_range(const std::vector<uint32_t> &data, size_t begin,
+                           size_t end) {
+  uint64_t hash = 1469598103934665603ULL;
+  for (size_t idx = begin; idx < end; idx++) {
+    uint32_t val = data[idx];
+    if (val & 1) {
+      hash ^= val;
+    } else {
+      hash += val >> 1;
+    }
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+int main(int argc, char *argv[]) {
+  // scale 0 only starts up, for the startup time
+  const int scale = (argc > 1) ? atoi(argv[1]) : 1;
+  const int num_threads = (argc > 2) ? atoi(argv[2]) : 8;
+  if (scale == 0) {
+    return 0;
+  }
+
+  std::vector<uint32_t> data(1 << 22);
+  for (size_t idx = 0; idx < data.size(); idx++) {
+    data[idx] = (uint32_t)(idx * 2654435761U);
+  }
+
+  std::mutex result_mutex;
+  uint64_t result = 0;
+  std::vector<std::thread> threads;
+  for (int thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+    threads.emplace_back([&, thread_idx]() {
+      const size_t chunk = data.size() / num_threads;
+      const size_t begin = chunk * thread_idx;
+      uint64_t local = 0;
+      for (int round = 0; round < scale * 10; round++) {
+        local += hash_range(data, begin, begin + chunk);
+      }
+      std::lock_guard<std::mutex> guard(result_mutex);
+      result += local;
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  printf("threads %llu\n", (unsigned long long)result);
+  return 0;
+}
@@ -0,0 +1,46 @@
+#!/bin/bash
+# Multi-threaded first-hit benchmark for bb_cov_rt.a and func_cov_rt.a.
+# Every thread walks the same blocks at the same time, so the time is
+# dominated by the first-hit path of __record_bb_cov / __record_func_cov.
+set -e
+
+cd "$(dirname "$0")"
+
+NUM_FUNCS=${NUM_FUNCS:-2000}
+NUM_CASES=${NUM_CASES:-64}
+THREADS=${THREADS:-"1 2 4 8 16 32 64"}
+
+mkdir -p out
+cd out
+rm -f *.bc *.cov mt_bench*
+
+python3 ../gen_mt_bench.py mt_bench.cc $NUM_FUNCS $NUM_CASES
+clang++ -g -O0 -c -emit-llvm mt_bench.cc -o mt_bench.bc
+
+opt -load-pass-plugin=../../build/bb_cov_pass.so -passes=bbcov mt_bench.bc \
+  -o mt_bench.bb.bc > /dev/null
+clang++ mt_bench.bb.bc -O0 -o mt_bench.bb -L../../build -l:bb_cov_rt.a -lpthread
+
+opt -load-pass-plugin=../../build/bb_cov_pass.so -passes=bbcov \
+  -bbcov-call-probe mt_bench.bc -o mt_bench.bbcall.bc > /dev/null
+clang++ mt_bench.bbcall.bc -O0 -o mt_bench.bbcall -L../../build \
+  -l:bb_cov_rt.a -lpthread
+
+opt -load-pass-plugin=../../build/func_cov_pass.so -passes=funccov \
+  mt_bench.bc -o mt_bench.func.bc > /dev/null
+clang++ mt_bench.func.bc -O0 -o mt_bench.func -L../../build -l:func_cov_rt.a \
+  -lpthread
+
+clang++ mt_bench.bc -O0 -o mt_bench.orig -lpthread
+
+printf "%-8s %12s %12s %12s %12s\n" threads orig_ms bbcov_ms bbcall_ms \
+  funccov_ms
+for num_threads in $THREADS; do
+  orig=$(./mt_bench.orig $num_threads | awk '{print $4}')
+  bb=$(./mt_bench.bb $num_threads bb.cov | grep elapsed_ms | awk '{print $4}')
+  bbcall=$(./mt_bench.bbcall $num_threads bbcall.cov | grep elapsed_ms |
+    awk '{print $4}')
+  func=$(./mt_bench.func $num_threads func.cov | grep elapsed_ms |
+    awk '{print $4}')
+  printf "%-8s %12s %12s %12s %12s\n" $num_threads $orig $bb $bbcall $func
+done
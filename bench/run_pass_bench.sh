@@ -0,0 +1,63 @@
+#!/bin/bash
+# Compile-time benchmark of the pass plugins. It generates modules of
+# NUM_FUNCS functions and prints the time and peak memory of opt with each
+# plugin, and the phases of bbcov (-bbcov-time-phases).
+set -e
+
+cd "$(dirname "$0")"
+
+SIZES=${SIZES:-"10000 100000"}
+NUM_CASES=${NUM_CASES:-8}
+# e.g. "-bbcov-split=8" or "-bbcov-edges", passed to the bbcov runs only
+BBCOV_FLAGS=${BBCOV_FLAGS:-""}
+
+# plugin, pass name
+PLUGINS="bb_cov_pass.so:bbcov func_cov_pass.so:funccov
+func_seq_pass.so:funcseq path_cov_pass.so:pathcov"
+
+mkdir -p out
+cd out
+
+# GNU time gives the peak memory, bash's time only the elapsed time
+run_timed() {
+  if [ -x /usr/bin/time ]; then
+    /usr/bin/time -f "%e %M" -o time.txt "$@" > /dev/null 2> /dev/null
+    cat time.txt
+  else
+    local start end
+    start=$(date +%s.%N)
+    "$@" > /dev/null 2> /dev/null
+    end=$(date +%s.%N)
+    echo "$(awk "BEGIN { print $end - $start }") -"
+  fi
+}
+
+printf "%-10s %-10s %12s %12s\n" funcs pass elapsed_s max_rss_kb
+for num_funcs in $SIZES; do
+  python3 ../gen_pass_bench.py pass_bench_$num_funcs.ll $num_funcs $NUM_CASES
+  llvm-as pass_bench_$num_funcs.ll -o pass_bench_$num_funcs.bc
+
+  for plugin in $PLUGINS; do
+    plugin_so=${plugin%%:*}
+    pass_name=${plugin##*:}
+    flags=""
+    if [ "$pass_name" = "bbcov" ]; then
+      flags=$BBCOV_FLAGS
+    fi
+
+    result=$(run_timed opt -load-pass-plugin=../../build/$plugin_so \
+      -passes=$pass_name $flags pass_bench_$num_funcs.bc \
+      -o pass_bench_$num_funcs.$pass_name.bc)
+    printf "%-10s %-10s %12s %12s\n" $num_funcs $pass_name $result
+  done
+
+  opt -load-pass-plugin=../../build/bb_cov_pass.so -passes=bbcov \
+    -bbcov-time-phases $BBCOV_FLAGS pass_bench_$num_funcs.bc -o /dev/null \
+    2> /dev/null | grep "Phase" > pass_bench_$num_funcs.phases
+done
+
+for num_funcs in $SIZES; do
+  echo ""
+  echo "bbcov phases, $num_funcs functions:"
+  cat pass_bench_$num_funcs.phases
+done
@@ -0,0 +1,87 @@
+#!/bin/bash
+# Runtime overhead benchmark. Every workload in rt_workloads/ is built
+# uninstrumented and with bbcov, funccov, pathcov and funcseq, and it prints
+# the elapsed time, the slowdown against the uninstrumented build, the binary
+# size, the startup time and the peak memory of each build.
+set -e
+
+cd "$(dirname "$0")"
+
+WORKLOADS=${WORKLOADS:-"cpu_kernel parser threads recursion"}
+# argument of the workloads, scale 0 only starts up
+SCALE=${SCALE:-5}
+# best of REPEAT runs
+REPEAT=${REPEAT:-3}
+CFLAGS=${CFLAGS:-"-g -O0"}
+# e.g. "-bbcov-hitcount", passed to the bbcov builds only
+BBCOV_FLAGS=${BBCOV_FLAGS:-""}
+BBCOV_RT=${BBCOV_RT:-bb_cov_rt.a}
+
+# mode, plugin, pass name, runtime
+MODES="bbcov:bb_cov_pass.so:bbcov:$BBCOV_RT
+funccov:func_cov_pass.so:funccov:func_cov_rt.a
+pathcov:path_cov_pass.so:pathcov:path_cov_rt.a
+funcseq:func_seq_pass.so:funcseq:func_seq_rt.a"
+
+mkdir -p out/rt
+cd out/rt
+rm -f *.bc *.cov *.out
+
+# prints "<elapsed_s> <max_rss_kb>", the best elapsed time of REPEAT runs.
+# GNU time gives the peak memory, bash's time only the elapsed time.
+run_timed() {
+  local best="" rss="-" elapsed
+  for _ in $(seq $REPEAT); do
+    if [ -x /usr/bin/time ]; then
+      /usr/bin/time -f "%e %M" -o time.txt "$@" > /dev/null 2> /dev/null
+      elapsed=$(awk '{ print $1 }' time.txt)
+      rss=$(awk '{ print $2 }' time.txt)
+    else
+      local start end
+      start=$(date +%s.%N)
+      "$@" > /dev/null 2> /dev/null
+      end=$(date +%s.%N)
+      elapsed=$(awk "BEGIN { print $end - $start }")
+    fi
+    if [ -z "$best" ] || awk "BEGIN { exit !($elapsed < $best) }"; then
+      best=$elapsed
+    fi
+  done
+  echo "$best $rss"
+}
+
+printf "%-11s %-8s %10s %9s %12s %10s %12s\n" workload mode elapsed_s \
+  slowdown size_bytes startup_s max_rss_kb
+for workload in $WORKLOADS; do
+  clang++ $CFLAGS -c -emit-llvm ../../rt_workloads/$workload.cc \
+    -o $workload.bc
+  clang++ $workload.bc $CFLAGS -o $workload.orig -lpthread
+
+  read orig_elapsed orig_rss <<< "$(run_timed ./$workload.orig $SCALE)"
+  read orig_startup _ <<< "$(run_timed ./$workload.orig 0)"
+  printf "%-11s %-8s %10s %9s %12s %10s %12s\n" $workload orig \
+    $orig_elapsed 1.00 $(stat -c %s $workload.orig) $orig_startup $orig_rss
+
+  for mode in $MODES; do
+    IFS=: read mode_name plugin_so pass_name runtime <<< "$mode"
+    flags=""
+    if [ "$mode_name" = "bbcov" ]; then
+      flags=$BBCOV_FLAGS
+    fi
+
+    opt -load-pass-plugin=../../../build/$plugin_so -passes=$pass_name \
+      $flags $workload.bc -o $workload.$mode_name.bc > /dev/null
+    clang++ $workload.$mode_name.bc $CFLAGS -o $workload.$mode_name \
+      -L../../../build -l:$runtime -lpthread
+
+    # the runtimes take the output file as the last argument
+    read elapsed rss <<< "$(run_timed ./$workload.$mode_name $SCALE \
+      $workload.$mode_name.out)"
+    read startup _ <<< "$(run_timed ./$workload.$mode_name 0 \
+      $workload.$mode_name.out)"
+    slowdown=$(awk "BEGIN { printf \"%.2f\", \
+      ($orig_elapsed > 0) ? $elapsed / $orig_elapsed : 0 }")
+    printf "%-11s %-8s %10s %9s %12s %10s %12s\n" $workload $mode_name \
+      $elapsed $slowdown $(stat -c %s $workload.$mode_name) $startup $rss
+  done
+done
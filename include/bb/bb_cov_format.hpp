@@ -0,0 +1,33 @@
+#ifndef BB_COV_FORMAT_HPP
+#define BB_COV_FORMAT_HPP
+
+#include <filesystem>
+
+#include "bb/bb_cov_module.hpp"
+
+// Output formats of the bb_cov runtimes, see OUTPUT_FORMAT: the writers, the
+// readers of the previous coverage and the report of the emergency writer.
+
+enum CovOutputFormat { COV_FORMAT_TEXT, COV_FORMAT_SPARSE, COV_FORMAT_BINARY };
+extern CovOutputFormat cov_output_format;
+
+// Reads OUTPUT_FORMAT into cov_output_format
+void __init_output_format();
+// Writes the basic block map of the binary and sparse formats to out_dir
+void __write_cov_map(const CovModule &mod, std::filesystem::path out_dir);
+// Writes the coverage of a module, merged with its previous coverage, to its
+// output file
+bool __write_cov(CovModule &mod);
+// Reads the existing output file of a module into its previous coverage
+void __cov_read_prev_cov(CovModule &mod);
+
+#ifndef WRITE_COV_PER_BB
+// Formats the report of the emergency writer once per module
+void __prepare_emergency_cov(CovModule &mod);
+// Merges the existing output file into the prepared report
+void __merge_prev_emergency_cov(CovModule &mod);
+// Patches the coverage into the prepared report. Async-signal-safe.
+void __fill_emergency_cov(CovModule &mod);
+#endif
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef BB_COV_MODULE_HPP
+#define BB_COV_MODULE_HPP
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "bb/bb_cov_rt.hpp"
+
+// Modules of the bb_cov runtimes and the merging of their -bbcov-per-tu
+// units. Compiled once per runtime variant along with bb_cov_rt.cc, the
+// variant macros change CovModule and the modes below.
+
+#ifdef BB_COV_HITCOUNT
+// cov_arr holds saturating hit counts instead of first-hit flags
+static const bool is_hitcount = true;
+#else
+static const bool is_hitcount = false;
+#endif
+
+#ifdef BB_COV_COUNTS
+// reports show the execution counts of count_arr builds
+static const bool is_counts = true;
+#else
+static const bool is_counts = false;
+#endif
+
+// AFL style hit count buckets: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+ hits
+// are bits 0 to 7. Async-signal-safe.
+static inline uint8_t __count_to_bucket(const uint8_t count) {
+  if (count <= 2) {
+    return count;
+  }
+  if (count == 3) {
+    return 1 << 2;
+  }
+  if (count < 8) {
+    return 1 << 3;
+  }
+  if (count < 16) {
+    return 1 << 4;
+  }
+  if (count < 32) {
+    return 1 << 5;
+  }
+  if (count < 128) {
+    return 1 << 6;
+  }
+  return 1 << 7;
+}
+
+// -bbcov-per-tu unit of a module, see __merge_units
+struct MergedUnit {
+  CUnitEntry *entry;
+  std::vector<uint32_t> edge_ids; // local edge id -> edge id of the module
+  uint32_t first_val;             // of its counts in count_arr
+};
+
+// Coverage of one instrumented module: the executable, or a shared library
+// whose -bbcov-per-tu units registered themselves. Every module has its own
+// basic block map and output file. Never freed, the emergency writer may run
+// during static destruction.
+struct CovModule {
+  // file name of a shared library, empty for the executable
+  std::string name;
+  // cov_output_fn, followed by "." and the name for shared libraries
+  std::string output_fn;
+  // load address of the module, and the bounds of its __bb_cov_units section
+  const void *base = nullptr;
+  CUnitEntry *units_start = nullptr;
+  CUnitEntry *units_stop = nullptr;
+  // __record_bb_cov gets bb_id + id_base, so that the bb_ids of the modules
+  // do not overlap. 0 for the executable.
+  uint32_t id_base = 0;
+
+  // Basic block map and arrays, bound by __bind_tables(): the symbols of a
+  // whole-program executable, or the tables merged from the units
+  const CBBEntry *cov_bbs = nullptr;
+  uint32_t num_bbs = 0;
+  const CFuncEntry *cov_funcs = nullptr;
+  uint32_t num_cov_funcs = 0;
+  const char *cov_strtab = nullptr;
+  uint64_t module_hash = 0;
+  const CEdgeEntry *cov_edges = nullptr;
+  uint32_t num_cov_edges = 0;
+  char *edge_arr = nullptr;
+  const uint32_t *implied_table = nullptr;
+  uint32_t implied_size = 0;
+  uint64_t *count_arr = nullptr;
+  uint32_t count_arr_size = 0;
+  const uint32_t *count_solve = nullptr;
+  uint32_t count_solve_size = 0;
+  const uint32_t *count_bbs = nullptr;
+  uint32_t count_bbs_size = 0;
+  char *cov_arr = nullptr;
+  uint32_t cov_arr_size = 0;
+
+  // Used for fast check of covered basic blocks, points to cov_arr once the
+  // module is set up and until its coverage is written
+  char *bb_cov_arr = nullptr;
+  // set once the shared library is unloaded
+  bool is_unloaded = false;
+
+  // Coverage of the existing output file, indexed by bb_id
+  std::vector<char> prev_cov;
+  // and by edge id
+  std::vector<char> prev_edge_cov;
+  // execution counts of the existing output file (bb_cov_counts_rt)
+  std::vector<uint64_t> prev_counts;
+
+  // Execution counts of this run, indexed by bb_id. Sized at startup for
+  // -bbcov-counts builds, so that the emergency writer can fill it.
+  std::vector<uint64_t> bb_counts;
+
+  // the units, and the merged tables that the bound tables point to
+  std::vector<MergedUnit> merged_units;
+  std::string merged_strtab;
+  std::vector<CFuncEntry> merged_funcs;
+  std::vector<CBBEntry> merged_bbs;
+  std::vector<CEdgeEntry> merged_edges;
+  std::vector<char> merged_edge_arr;
+  std::vector<uint32_t> merged_implied;
+  std::vector<uint64_t> merged_count_arr;
+  std::vector<uint32_t> merged_count_solve;
+  std::vector<uint32_t> merged_count_bbs;
+
+#ifdef WRITE_COV_PER_BB
+  bool sidecar_mapped = false;
+#else
+  // report prepared by __prepare_emergency_cov
+  char *emergency_buf = nullptr;
+  size_t emergency_size = 0;
+  uint32_t *emergency_digit_offs = nullptr; // text format only
+  size_t emergency_edge_bitmap_off = 0;     // binary format only
+  // Persistent worker only: pages of cov_arr with first hits through
+  // __record_bb_cov since the last reset, one byte per BB_COV_PAGE_SIZE
+  char *dirty_pages = nullptr;
+#endif
+};
+
+// id_base of the next module
+extern uint32_t next_id_base;
+
+// Assigns the bb_ids of the units of a module and merges their tables,
+// false if there is no id_base left
+bool __merge_units(CovModule &mod);
+// Binds the tables of the executable
+void __bind_tables(CovModule &mod);
+// Sizes the execution counts of a bound module
+void __init_bb_counts(CovModule &mod);
+// Marks the pruned basic blocks implied by covered ones. Async-signal-safe.
+void __apply_implied_cov(const CovModule &mod, char *cov);
+// Brings cov_arr, edge_arr and count_arr up to date. Async-signal-safe.
+void __collect_cov(CovModule &mod);
+// Clears the arrays of the units along with the merged ones
+void __reset_units(CovModule &mod);
+
+#endif
@@ -6,15 +6,76 @@
 #include <sys/time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
 #include <map>
 #include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "bb/bb_cov_unit.hpp"
 #include "bb/bb_map.hpp"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Alignment and size granularity of __bb_cov_arr, a page on most targets
+#define BB_COV_ARR_ALIGN 4096
+
+// -bbcov-sancov: section of the SanitizerCoverage inline 8-bit counters, which
+// libFuzzer reads as its feedback
+#define BB_COV_SANCOV_SECTION "__sancov_cntrs"
+
+// -bbcov-counts: edges of the flow graph of a function. Every basic block is
+// split into an in node (2 * idx) and an out node (2 * idx + 1) joined by the
+// edge of the basic block itself, and node 2 * num_bbs is the virtual exit.
+enum CountEdgeKind {
+  COUNT_EDGE_BB,     // in -> out of a basic block
+  COUNT_EDGE_CFG,    // out of a basic block -> in of its successor
+  COUNT_EDGE_RETURN, // out -> exit, the basic block leaves the function
+  COUNT_EDGE_ENTRY,  // exit -> in of the entry block, one per call
+  COUNT_EDGE_FAKE,   // out -> exit, a call of the basic block did not return
+};
+
+struct CountEdge {
+  uint32_t src;
+  uint32_t dst;
+  CountEdgeKind kind;
+  // source basic block, or the entry block for COUNT_EDGE_ENTRY
+  llvm::BasicBlock *BB;
+  // destination basic block of COUNT_EDGE_CFG
+  llvm::BasicBlock *succ;
+  // where its counter goes, NULL if the edge has to be split first
+  llvm::Instruction *insert_pt;
+  bool is_countable;
+  uint32_t loop_depth;
+  bool is_tree;
+  // index into __bb_cov_count_arr, counters first and derived counts after
+  uint32_t val_idx;
+};
+
+struct CountGraph {
+  llvm::Function *Func;
+  uint32_t num_nodes;
+  std::vector<CountEdge> edges;
+  // basic block -> index of its COUNT_EDGE_BB
+  std::map<llvm::BasicBlock *, uint32_t> bb_edges;
+  // false if uncountable edges form a cycle, every basic block is then
+  // counted on its own
+  bool is_solvable;
+};
+
+// -bbcov-time-phases: wall time and malloc'd memory of a phase of the pass,
+// and the peak resident set size at its end
+struct PhaseTime {
+  std::string name;
+  double elapsed_ms;
+  int64_t malloc_delta;
+  uint64_t max_rss_kb;
+};
 
 class BB_COV_Pass : public llvm::PassInfoMixin<BB_COV_Pass> {
 public:
@@ -22,19 +83,69 @@ public:
                               llvm::ModuleAnalysisManager &MAM);
 
 private:
+  void instrument(llvm::Module &Module);
+  void instrument_split(llvm::Module &Module);
   void instrument_main(llvm::Function &Func);
 
   uint32_t insert_bb_probes();
-  void insert_bb_probe_one_func(llvm::Function &Func,
-                                const std::string &filename);
+  void collect_bbs_one_func(llvm::Function &Func, const std::string &filename,
+                            const std::string &demangled_name);
+  const llvm::DILocation *get_bb_frame(llvm::BasicBlock &BB);
+  std::string get_frame_filename(const llvm::DILocation *frame);
+  std::string get_frame_func_name(const llvm::DILocation *frame);
+  void prune_bbs_one_func(llvm::Function &Func, size_t first_probe);
+  void build_implied_table();
+  bool may_not_return(llvm::BasicBlock &BB);
+  void insert_inline_probe(llvm::Instruction *insert_pt, uint32_t BB_id,
+                           llvm::FunctionCallee record_bb);
+  void insert_hitcount_probe(llvm::Instruction *insert_pt, uint32_t BB_id);
+  void insert_store_probe(llvm::Instruction *insert_pt, uint32_t BB_id);
+  llvm::Value *get_global_bb_id(uint32_t BB_id);
+
+  void build_count_graph(llvm::Function &Func);
+  void insert_count_probes();
+  void solve_count_graph(const CountGraph &graph);
+  void insert_counter(llvm::Instruction *insert_pt, uint32_t val_idx);
+
+  std::vector<std::pair<llvm::BasicBlock *, llvm::BasicBlock *>>
+  collect_edges();
+  void insert_edge_probes(
+      const std::vector<std::pair<llvm::BasicBlock *, llvm::BasicBlock *>>
+          &ir_edges);
+  void insert_edge_probe(llvm::Instruction *insert_pt, uint32_t edge_id);
+  void insert_cov_fini_before_exit(llvm::Function &Func);
 
   void init_bb_map_rt();
+  void init_bb_cov_arr();
+  void insert_unit_registration();
+  void insert_sancov_registration();
+  llvm::Constant *get_section_bound(const char *name);
+  llvm::Function *create_section_caller(const char *name,
+                                        const char *runtime_name,
+                                        llvm::Constant *start,
+                                        llvm::Constant *stop);
 
   std::set<llvm::Function *> get_dtor_funcs();
 
   bool is_probe_func(llvm::Function &Func);
   bool is_probe_BB(llvm::BasicBlock &BB);
 
+  void begin_phase(const std::string &name);
+  void end_phase();
+  void print_phase_times();
+
+  // -bbcov-per-tu, or a partition of -bbcov-split
+  bool is_per_tu = false;
+  // messages of a -bbcov-split partition are printed after the others
+  llvm::raw_ostream *out_os = &llvm::outs();
+  llvm::raw_ostream *err_os = &llvm::errs();
+
+  // -bbcov-time-phases
+  std::vector<PhaseTime> phase_times = {};
+  std::string phase_name = "";
+  std::chrono::steady_clock::time_point phase_start;
+  size_t phase_malloc_start = 0;
+
   llvm::Module *Mod_ptr = NULL;
   llvm::LLVMContext *Ctxt_ptr = NULL;
   llvm::IRBuilder<> *IRB = NULL;
@@ -42,25 +153,46 @@ private:
   llvm::Type *voidTy = NULL;
   llvm::Type *int8Ty = NULL;
   llvm::Type *int32Ty = NULL;
+  llvm::Type *int64Ty = NULL;
   llvm::Type *int8PtrTy = NULL;
   llvm::Type *int32PtrTy = NULL;
 
-  llvm::StructType *cfileEntryTy = NULL;
-  llvm::StructType *cfuncEntryTy = NULL;
-  llvm::StructType *cbbEntryTy = NULL;
-
-  uint32_t bb_id = 1;
-  uint32_t max_bb_id = 0;
+  // Byte per basic block, indexed by bb_id
+  llvm::GlobalVariable *bb_cov_arr_global = NULL;
+  // Byte per CFG edge, indexed by edge id
+  llvm::GlobalVariable *edge_cov_arr_global = NULL;
+  // -bbcov-per-tu: global bb_id of every local bb_id, set by the runtime
+  llvm::GlobalVariable *bb_ids_global = NULL;
+  // internal for -bbcov-per-tu, external for whole-program modules
+  llvm::GlobalValue::LinkageTypes table_linkage =
+      llvm::GlobalValue::ExternalLinkage;
 
   // Entire basic block map
-  // file -> func -> set(bb)
-  struct GFileEntry *file_bb_map[sizeof(unsigned char) * 256]{};
-
-  llvm::GlobalVariable *gen_cfile_entry(GFileEntry *file_entry);
-  llvm::GlobalVariable *gen_cfunc_entry(GFuncEntry *func_entry);
-  llvm::GlobalVariable *gen_cbb_entry(GBBEntry *bb_entry);
-
-  std::map<std::string, llvm::GlobalVariable *> new_string_globals = {};
-  llvm::GlobalVariable *gen_new_string_constant(const std::string &name);
+  // file -> func -> bb
+  GBBMap bb_map;
+
+  // Basic blocks to instrument, and their keys in bb_map
+  std::vector<std::pair<llvm::BasicBlock *, uint32_t>> bb_probes = {};
+
+  // CFG edges as (src bb_id, dst bb_id), sorted. The index is the edge id.
+  std::vector<std::pair<uint32_t, uint32_t>> edges = {};
+  std::map<std::pair<uint32_t, uint32_t>, uint32_t> edge_ids = {};
+
+  // -bbcov-prune: basic blocks without a probe -> the basic blocks whose
+  // coverage implies theirs
+  std::map<llvm::BasicBlock *, std::vector<llvm::BasicBlock *>> implied_bbs =
+      {};
+  // flat (bb_id, num_srcs, src bb_ids...) records, sources first
+  std::vector<uint32_t> implied_table = {};
+
+  // -bbcov-counts: 64-bit counters followed by the derived edge counts
+  llvm::GlobalVariable *count_arr_global = NULL;
+  uint32_t num_count_vals = 0;
+  std::vector<CountGraph> count_graphs = {};
+  // flat (val_idx, num_plus, plus val_idxs..., num_minus, minus val_idxs...)
+  // records, in evaluation order
+  std::vector<uint32_t> count_solve_table = {};
+  // flat (bb_id, val_idx) records, a basic block's count is the sum
+  std::vector<uint32_t> count_bbs_table = {};
 };
 #endif
\ No newline at end of file
@@ -1,39 +1,198 @@
+#ifndef BB_COV_RT_HPP
+#define BB_COV_RT_HPP
+
+#include <stddef.h>
 #include <stdint.h>
 
+#include "bb/bb_cov_unit.hpp"
+
 #define OUTPUT_FN "BB_COV_OUTPUT_FN"
+// number of parallel replay jobs in directory mode
+#define REPLAY_JOBS "BB_COV_JOBS"
+// In directory mode, the replay children hand their coverage to the parent
+// through shared memory, and the parent writes the union of all inputs to
+// this file and per-input statistics to <file>.inputs
+#define UNION_OUTPUT_FN "BB_COV_UNION_OUTPUT_FN"
+// "0" skips the per-input coverage files when the union is collected
+#define PER_INPUT_OUTPUT "BB_COV_PER_INPUT_OUTPUT"
+// the replay fork loop starts from __bb_cov_init_point(), see
+// utils/init_point.hpp
+#define DEFER_INIT "BB_COV_DEFER_INIT"
+// Persistent directory mode: every forked worker calls the
+// LLVMFuzzerTestOneInput of the target for up to this many inputs, resetting
+// the coverage arrays between them
+#define PERSISTENT "BB_COV_PERSISTENT"
 
-struct CBBEntry {
-  const char *bb_name;
-  struct CBBEntry *next;
-  char is_covered;
+// "text" (default), "sparse" or "binary"
+#define OUTPUT_FORMAT "BB_COV_OUTPUT_FORMAT"
+
+// Sparse coverage file: "BBCOVSPARSE <module hash>" followed by the lines of
+// the text format for covered files, functions and basic blocks only
+#define BB_COV_SPARSE_MAGIC "BBCOVSPARSE"
+
+// Binary coverage file: BBCovBinHeader followed by the payload
+//   BB_COV_BIN_BITMAP : (num_bbs + 8) / 8 bytes, bit (bb_id % 8) of byte
+//                       (bb_id / 8) is set if the basic block is covered
+//   BB_COV_BIN_SPARSE : num_covered uint32_t bb_ids in ascending order
+//   BB_COV_BIN_BYTEMAP: the header is padded to BB_COV_BYTEMAP_OFFSET bytes,
+//                       followed by the raw __bb_cov_arr (one byte per bb_id)
+//   BB_COV_BIN_BUCKETS: (num_bbs + 1) bytes, the hit count bucket bits of each
+//                       bb_id (bb_cov_hitcount_rt)
+//   BB_COV_BIN_COUNTS : (num_bbs + 1) uint64_t execution counts of each bb_id
+//                       (bb_cov_counts_rt)
+// Builds with -bbcov-edges append an edge bitmap of (num_edges + 7) / 8 bytes,
+// bit (edge_id % 8) of byte (edge_id / 8), except for BB_COV_BIN_BYTEMAP.
+// module_hash identifies the basic block map, which is written next to the
+// output as .bbcov.<module_hash>.map so that scripts/bbcov_bin_to_text.py can
+// convert the file to the text format.
+#define BB_COV_BIN_MAGIC "BBCOVBIN"
+#define BB_COV_BIN_VERSION 1
+#define BB_COV_BIN_BITMAP 0
+#define BB_COV_BIN_SPARSE 1
+#define BB_COV_BIN_BYTEMAP 2
+#define BB_COV_BIN_BUCKETS 3
+#define BB_COV_BIN_COUNTS 4
+#define BB_COV_BYTEMAP_OFFSET 4096
+
+// bb_cov_instant_rt maps __bb_cov_arr onto <output_fn>.bytemap, so that first
+// hits are plain stores that survive crashes. The sidecar is removed once the
+// output file is written at normal termination.
+#define BB_COV_SIDECAR_SUFFIX ".bytemap"
+
+// AFL++ support. With __AFL_SHM_ID set, the runtime attaches the fuzzer's
+// shared memory map and copies the coverage of every run into it at exit,
+// map[bb_id] being the __bb_cov_arr byte of the process-wide bb_id (1 if
+// covered, or the 8-bit hit count of bb_cov_hitcount_rt). If the forkserver
+// fds are open, it serves the forkserver protocol before main, so the fuzzer
+// pays one fork per input. No coverage files are written in this mode.
+#define AFL_SHM_ID_ENV "__AFL_SHM_ID"
+// set by afl-fuzz to ask for the map size, which is printed on stdout
+#define AFL_DUMP_MAP_SIZE_ENV "AFL_DUMP_MAP_SIZE"
+#define AFL_FORKSRV_READ_FD 198
+#define AFL_FORKSRV_WRITE_FD (AFL_FORKSRV_READ_FD + 1)
+// options of the first message of the forkserver
+#define AFL_FS_OPT_ENABLED 0x80000001
+#define AFL_FS_OPT_MAPSIZE 0x40000000
+#define AFL_FS_OPT_MAX_MAPSIZE ((0x00fffffeU >> 1) + 1)
+#define AFL_FS_OPT_SET_MAPSIZE(x)                                              \
+  ((x) <= 1 || (x) > AFL_FS_OPT_MAX_MAPSIZE ? 0 : (((x)-1) << 1))
+
+struct BBCovBinHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t encoding;
+  uint64_t module_hash;
+  uint32_t num_bbs;
+  uint32_t num_covered;
 };
 
+// Functions of a file are contiguous in __bb_cov_funcs, and basic blocks of a
+// function have contiguous bb_ids [first_bb, first_bb + num_bbs).
 struct CFuncEntry {
-  struct CBBEntry *bbs[sizeof(unsigned char) * 256];
-  const char *func_name;
-  const struct CFuncEntry *next;
+  uint32_t file_off;  // offsets into __bb_cov_strtab
+  uint32_t name_off;
+  uint32_t first_bb;
+  uint32_t num_bbs;
+};
+
+struct CBBEntry {
+  uint32_t func_idx;  // index into __bb_cov_funcs
+  uint32_t name_off;  // offset into __bb_cov_strtab
 };
 
-struct CFileEntry {
-  const struct CFuncEntry *funcs[sizeof(unsigned char) * 256];
-  const char *filename;
-  const struct CFileEntry *next;
+// CFG edge between two basic blocks of the same function. Edges are sorted by
+// (src_bb, dst_bb), so the edges of a function are contiguous.
+struct CEdgeEntry {
+  uint32_t src_bb;
+  uint32_t dst_bb;
 };
 
 extern "C" {
 
-// entire bb list generated at compile time
-// We use simple hashmap for fast lookup
-// The size of the map is 256 (size of unsigned char in binary).
-extern struct CFileEntry *__file_func_map[sizeof(unsigned char) * 256];
+// Whole-program module symbols below are weak, so that the runtime also links
+// with -bbcov-per-tu units, which have none of them.
+
+// entire bb list generated at compile time, indexed by bb_id. (bb_id 0 is not
+// used)
+extern const struct CBBEntry __bb_cov_bbs[] __attribute__((weak));
+extern const uint32_t __num_bbs __attribute__((weak));
 
-extern const uint32_t __num_bbs;
+extern const struct CFuncEntry __bb_cov_funcs[] __attribute__((weak));
+extern const uint32_t __num_bb_cov_funcs __attribute__((weak));
+
+// NUL-separated file, function and basic block names
+extern const char __bb_cov_strtab[] __attribute__((weak));
+
+extern const uint64_t __bb_cov_module_hash __attribute__((weak));
+
+// indexed by edge id, empty without -bbcov-edges
+extern const struct CEdgeEntry __bb_cov_edges[] __attribute__((weak));
+extern const uint32_t __num_bb_cov_edges __attribute__((weak));
+// zero-initialized, set to 1 by the inline edge probes
+extern char __bb_cov_edge_arr[] __attribute__((weak));
+
+// Basic blocks without a probe (-bbcov-prune), as flat records of
+// (bb_id, num_srcs, src bb_ids...). A basic block is covered if any of its
+// sources is, and sources come before the records that use them.
+extern const uint32_t __bb_cov_implied[] __attribute__((weak));
+extern const uint32_t __bb_cov_implied_size __attribute__((weak));
+
+// -bbcov-counts: 64-bit counters on the flow graph edges outside a spanning
+// tree, followed by the counts of the tree edges. Those are derived in order
+// by the flat records of __bb_cov_count_solve,
+// (val_idx, num_plus, plus val_idxs..., num_minus, minus val_idxs...), as the
+// sum of the plus values minus the sum of the minus values. The count of a
+// basic block is the sum of its (bb_id, val_idx) records in
+// __bb_cov_count_bbs. Both are empty without -bbcov-counts.
+extern uint64_t __bb_cov_count_arr[] __attribute__((weak));
+extern const uint32_t __bb_cov_count_arr_size __attribute__((weak));
+extern const uint32_t __bb_cov_count_solve[] __attribute__((weak));
+extern const uint32_t __bb_cov_count_solve_size __attribute__((weak));
+extern const uint32_t __bb_cov_count_bbs[] __attribute__((weak));
+extern const uint32_t __bb_cov_count_bbs_size __attribute__((weak));
+
+// zero-initialized coverage array, indexed by bb_id. It is page aligned and
+// padded to __bb_cov_arr_size bytes (>= __num_bbs + 1).
+// Inline probes check it and call __record_bb_cov only on the first hit.
+extern char __bb_cov_arr[] __attribute__((weak));
+extern const uint32_t __bb_cov_arr_size __attribute__((weak));
+
+#ifdef BB_COV_HITCOUNT
+// Emitted with -bbcov-hitcount, __bb_cov_arr then holds 8-bit saturating hit
+// counts. Reports show the union of AFL style buckets of the counts, bit 0 to
+// 7 for 1, 2, 3, 4-7, 8-15, 16-31, 32-127 and 128+ hits.
+extern const char __bb_cov_hitcount_mode;
+#endif
+
+#ifdef BB_COV_COUNTS
+// Emitted with -bbcov-counts, reports then show the execution count of every
+// basic block instead of 1.
+extern const char __bb_cov_counts_mode;
+#endif
+
+// libFuzzer style entry points of the target, used by BB_COV_PERSISTENT
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+    __attribute__((weak));
+int LLVMFuzzerInitialize(int *argc, char ***argv) __attribute__((weak));
 
 void __handle_init(int *argc_ptr, char **argv);
-void __record_bb_cov(const char *file_name, const char *func_name,
-                     const char *bb_name, const uint32_t bb_id);
+void __record_bb_cov(const uint32_t bb_id);
+
+// Called by the constructor and the destructor that every module (the
+// executable or a shared library) with -bbcov-per-tu units gets once, with
+// the bounds of its __bb_cov_units section
+void __register_bb_cov_units(struct CUnitEntry *start, struct CUnitEntry *stop);
+void __unregister_bb_cov_units(struct CUnitEntry *start,
+                               struct CUnitEntry *stop);
+
+// -bbcov-sancov: called by the constructor of every instrumented module with
+// the bounds of its __sancov_cntrs section, which holds the coverage arrays
+void __register_bb_cov_counters(char *start, char *stop);
+// libFuzzer's, it clears the counters before every input and reads them after
+void __sanitizer_cov_8bit_counters_init(char *start, char *stop)
+    __attribute__((weak));
 
-static void __cov_read_prev_cov();
-static void __write_cov();
 void __cov_fini();
-}
\ No newline at end of file
+}
+
+#endif
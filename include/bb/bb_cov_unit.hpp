@@ -0,0 +1,44 @@
+#ifndef BB_COV_UNIT_HPP
+#define BB_COV_UNIT_HPP
+
+#include <stdint.h>
+
+// -bbcov-per-tu: every translation unit puts one CUnitEntry in the
+// __bb_cov_units section. Its tables have the layout of the whole-program
+// symbols of bb_cov_rt.hpp, with bb_ids, edge ids and val_idxs local to the
+// unit. The runtime merges the units of each module (the executable or a
+// shared library) when the module registers, writes the process-wide bb_id of
+// every local bb_id to bb_ids, and copies the arrays of the units into the
+// merged ones before writing.
+//
+// The pass emits the fields in this order, bump the version when it changes.
+#define BB_COV_UNITS_SECTION "__bb_cov_units"
+#define BB_COV_UNIT_VERSION 1
+
+struct CFuncEntry;
+struct CBBEntry;
+struct CEdgeEntry;
+
+struct CUnitEntry {
+  const char *strtab;
+  const struct CFuncEntry *funcs;
+  const struct CBBEntry *bbs;
+  const struct CEdgeEntry *edges;
+  const uint32_t *implied;
+  const uint32_t *count_solve;
+  const uint32_t *count_bbs;
+  char *cov_arr;
+  char *edge_arr;
+  uint64_t *count_arr;
+  uint32_t *bb_ids;
+  uint32_t version;
+  uint32_t num_funcs;
+  uint32_t num_bbs;
+  uint32_t num_edges;
+  uint32_t implied_size;
+  uint32_t count_solve_size;
+  uint32_t count_bbs_size;
+  uint32_t count_arr_size;
+};
+
+#endif
@@ -1,34 +1,82 @@
-#include <llvm/IR/GlobalVariable.h>
+#ifndef BB_MAP_HPP
+#define BB_MAP_HPP
 
+#include <stdint.h>
+
+#include <map>
 #include <string>
+#include <utility>
+#include <vector>
 
-struct GBBEntry {
-  llvm::GlobalVariable *bb_gvar;
-  struct GBBEntry      *next;
+// Strings shared by the file, function and basic block names. The tables
+// store offsets into the string table instead of pointers, so they need no
+// relocations.
+class GStrTab {
+ public:
+  uint32_t           get_offset(const std::string &str);
+  const std::string &get_data() const;
+
+ private:
+  std::map<std::string, uint32_t> offsets = {};
+  std::string                     data = "";
 };
 
+// Same layout as CFuncEntry in bb_cov_rt.hpp
 struct GFuncEntry {
-  struct GBBEntry      *bbs[sizeof(unsigned char) * 256];
-  llvm::GlobalVariable *func_gvar;
-  struct GFuncEntry    *next;
+  uint32_t file_off;
+  uint32_t name_off;
+  uint32_t first_bb;
+  uint32_t num_bbs;
 };
 
-struct GFileEntry {
-  struct GFuncEntry    *funcs[sizeof(unsigned char) * 256];
-  llvm::GlobalVariable *file_gvar;
-  struct GFileEntry    *next;
+// Same layout as CBBEntry in bb_cov_rt.hpp
+struct GBBEntry {
+  uint32_t func_idx;
+  uint32_t name_off;
 };
 
-GFuncEntry *insert_FileFuncEntry(GFileEntry          **file_map,
-                                 const std::string    &filename,
-                                 llvm::GlobalVariable *file_gvar,
-                                 const std::string    &func_name,
-                                 llvm::GlobalVariable *func_gvar);
+// Entire basic block map, file -> func -> bb.
+// Basic blocks with the same (file, func, bb) names share one bb_id, and
+// bb_ids are assigned so that the basic blocks of a function, and the
+// functions of a file, are contiguous.
+class GBBMap {
+ public:
+  // Returns a key to look up the bb_id of the basic block after assign_ids()
+  uint32_t insert_bb(const std::string &filename, const std::string &func_name,
+                     const std::string &bb_name);
+
+  void     assign_ids();
+  uint32_t get_bb_id(uint32_t key) const;
+  uint32_t get_num_bbs() const;
 
-GFileEntry *insert_FileEntry(GFileEntry **file_map, const std::string &filename,
-                             llvm::GlobalVariable *file_gvar);
+  const GStrTab                 &get_strtab() const;
+  const std::vector<GFuncEntry> &get_funcs() const;
+  const std::vector<GBBEntry>   &get_bbs() const;
 
-GBBEntry *insert_BBEntry(GFuncEntry *func_entry, const std::string &bb_name,
-                         llvm::GlobalVariable *bb_gvar);
+ private:
+  struct FuncGroup {
+    uint32_t                     file_off;
+    uint32_t                     name_off;
+    std::vector<uint32_t>        bb_name_offs;
+    std::map<uint32_t, uint32_t> bb_indices;
+  };
 
-void free_bb_map(GFileEntry **file_map);
\ No newline at end of file
+  GStrTab strtab;
+
+  // file name offset -> indices of func_groups, in insertion order
+  std::vector<std::pair<uint32_t, std::vector<uint32_t>>> file_groups = {};
+  std::map<uint32_t, uint32_t>                            file_indices = {};
+
+  // (file name offset, func name offset) -> index of func_groups
+  std::vector<FuncGroup>                            func_groups = {};
+  std::map<std::pair<uint32_t, uint32_t>, uint32_t> func_indices = {};
+
+  // key -> (index of func_groups, index of the bb in the func group)
+  std::vector<std::pair<uint32_t, uint32_t>> keys = {};
+
+  // available after assign_ids()
+  std::vector<uint32_t>   func_first_bb = {};
+  std::vector<GFuncEntry> funcs = {};
+  std::vector<GBBEntry>   bbs = {};
+};
+#endif
@@ -1,6 +1,11 @@
 #include <stdint.h>
 
 #define OUTPUT_FN "FUNC_COV_OUTPUT_FN"
+// number of parallel replay jobs in directory mode
+#define REPLAY_JOBS "FUNC_COV_JOBS"
+// the replay fork loop starts from __bb_cov_init_point(), see
+// utils/init_point.hpp
+#define DEFER_INIT "FUNC_COV_DEFER_INIT"
 
 struct CFuncEntry {
   const char *func_name;
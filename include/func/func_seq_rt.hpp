@@ -3,6 +3,11 @@
 #include <string>
 
 #define OUTPUT_FN "FUNC_SEQ_OUTPUT_FN"
+// number of parallel replay jobs in directory mode
+#define REPLAY_JOBS "FUNC_SEQ_JOBS"
+// the replay fork loop starts from __bb_cov_init_point(), see
+// utils/init_point.hpp
+#define DEFER_INIT "FUNC_SEQ_DEFER_INIT"
 
 extern "C" {
 
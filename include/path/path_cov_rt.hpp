@@ -1,5 +1,9 @@
 #include <stdint.h>
 
+// the replay fork loop starts from __bb_cov_init_point(), see
+// utils/init_point.hpp
+#define DEFER_INIT "PATH_COV_DEFER_INIT"
+
 extern "C" {
 extern const uint32_t __num_bbs;
 extern uint32_t __path_hash_val;
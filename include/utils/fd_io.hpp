@@ -0,0 +1,6 @@
+#include <stddef.h>
+
+// Reads or writes exactly size bytes, retrying short transfers and EINTR.
+// False on EOF or error.
+bool read_all(int fd, void *buf, size_t size);
+bool write_all(int fd, const void *buf, size_t size);
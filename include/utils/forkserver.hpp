@@ -0,0 +1,24 @@
+#include <stdint.h>
+
+// Forkserver of the bbcov-run replay driver (src/run/bbcov_run.cc). The
+// driver starts the instrumented target once with FORKSRV_ENV set and its
+// pipes on FORKSRV_READ_FD / FORKSRV_WRITE_FD. The runtime answers
+// FORKSRV_HELLO from __handle_init, then forks one child per request and
+// replies the pid of the child and, once it exited, its wait status.
+//
+// A request is two uint32_t, the lengths of the input path and of the
+// coverage output path, followed by both paths without terminating NUL.
+#define FORKSRV_ENV "BBCOV_RUN_FORKSRV"
+#define FORKSRV_READ_FD 198
+#define FORKSRV_WRITE_FD (FORKSRV_READ_FD + 1)
+#define FORKSRV_HELLO 0x31524342 // "BCR1"
+#define FORKSRV_MAX_PATH 4096
+
+// True if the target was started by bbcov-run
+bool is_forkserver_requested();
+
+// Serves the requests of bbcov-run until it closes the pipe, then exits.
+// Returns the coverage output path in every child, after putting the input
+// in place of @@ in argv (or on stdin if there is no @@) and sending stdout
+// and stderr to /dev/null.
+const char *run_forkserver(int32_t argc, char **argv);
@@ -1,5 +1,12 @@
+#include <stddef.h>
 #include <stdint.h>
 #include <string>
 
 uint8_t bb_cov_simple_hash(const char *str);
-uint8_t bb_cov_simple_hash(const std::string &str);
\ No newline at end of file
+uint8_t bb_cov_simple_hash(const std::string &str);
+
+#define BB_COV_FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+
+// 64-bit FNV-1a, pass the previous hash to hash several buffers
+uint64_t bb_cov_fnv1a_hash(const void *data, size_t len,
+                           uint64_t hash = BB_COV_FNV_OFFSET_BASIS);
\ No newline at end of file
@@ -0,0 +1,34 @@
+#include <stdint.h>
+
+#include <functional>
+
+// Deferred fork point. The replay fork loops (directory mode, bbcov-run and
+// the AFL++ forkserver of bb_cov) start in __handle_init at the top of main,
+// so every child re-runs the startup of the target. With the DEFER_INIT
+// environment variable of the runtime set, they start from
+// __bb_cov_init_point() instead, which the target calls where its
+// initialization ends.
+
+// True if env_name is set to anything but "0"
+bool is_init_deferred(const char *env_name);
+
+// Runs fork_loop now, or from __bb_cov_init_point() if is_deferred.
+// fork_loop returns in the children only. When deferred, the @@ argument of
+// argv is moved to a buffer that set_placeholder() fills in every child, so
+// the pointers the target keeps from argv see the input of the child.
+void run_at_init_point(bool is_deferred, int32_t argc, char **argv,
+                       std::function<void()> fork_loop);
+
+// Puts input_path in place of the @@ argument
+void set_placeholder(char **argv, int32_t placeholder_idx,
+                     const char *input_path);
+
+// True, after printing an error, if the target exits without reaching
+// __bb_cov_init_point() while a fork loop waits for it
+bool is_init_point_missed();
+
+extern "C" {
+// Called by the target where its initialization ends, a no-op unless a fork
+// loop is deferred. Declare it weak to keep uninstrumented builds linking.
+void __bb_cov_init_point();
+}
@@ -0,0 +1,54 @@
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <functional>
+#include <set>
+#include <string>
+
+// Number of replay children kept in flight in directory mode, read from
+// env_name ("0" means one per online CPU). Defaults to 1.
+uint32_t get_replay_jobs(const char *env_name);
+
+// Index of the @@ argument of argv, or -1
+int32_t find_placeholder(int32_t argc, char **argv);
+
+// Output file of a replayed input: outputs_dir/<input name up to the first ','>
+std::string get_replay_output_path(const std::string &input_path,
+                                   const std::string &outputs_dir);
+
+// Sends stdout and stderr of a replay child to /dev/null
+void redirect_to_devnull();
+
+// Tracks the forked replay children of directory mode and the progress bar
+class ReplayPool {
+public:
+  ReplayPool(uint32_t max_jobs, uint32_t num_inputs);
+
+  // Blocks until fewer than max_jobs children are running
+  void wait_for_slot();
+  void add_child(pid_t pid) { children.insert(pid); }
+  // Called with the pid and wait status of every reaped child
+  void set_on_exit(std::function<void(pid_t, int32_t)> callback) {
+    on_exit = callback;
+  }
+  // Blocks until all children exited
+  void wait_all();
+
+  uint32_t get_num_done() const { return num_done; }
+  uint32_t get_num_failed() const { return num_failed; }
+
+private:
+  void reap_one();
+
+  uint32_t max_jobs;
+  uint32_t num_inputs;
+  // only these are reaped, the target may have children of its own from
+  // before the fork point
+  std::set<pid_t> children;
+  uint32_t num_done = 0;
+  uint32_t num_failed = 0;
+  std::chrono::steady_clock::time_point start_time;
+  std::function<void(pid_t, int32_t)> on_exit;
+};
\ No newline at end of file
@@ -0,0 +1,273 @@
+#!/usr/bin/env python3
+import os, sys, struct
+
+# must match BBCovBinHeader in include/bb/bb_cov_rt.hpp
+BIN_MAGIC = b"BBCOVBIN"
+BIN_VERSION = 1
+BIN_BITMAP = 0
+BIN_SPARSE = 1
+BIN_BYTEMAP = 2
+BIN_BUCKETS = 3
+BIN_COUNTS = 4
+BYTEMAP_OFFSET = 4096
+SPARSE_MAGIC = b"BBCOVSPARSE"
+HEADER_FMT = "<8sIIQII"
+HEADER_SIZE = struct.calcsize(HEADER_FMT)
+
+# map path -> parsed map, maps are shared by all outputs of one build
+map_cache = {}
+implied_cache = {}
+
+
+def is_bin_cov(cov_file: str) -> bool:
+    with open(cov_file, "rb") as f:
+        return f.read(len(BIN_MAGIC)) == BIN_MAGIC
+
+
+def is_sparse_cov(cov_file: str) -> bool:
+    with open(cov_file, "rb") as f:
+        return f.read(len(SPARSE_MAGIC)) == SPARSE_MAGIC
+
+
+def is_compact_cov(cov_file: str) -> bool:
+    # binary or sparse, both need the basic block map
+    return is_bin_cov(cov_file) or is_sparse_cov(cov_file)
+
+
+def get_map_file(cov_file: str, module_hash: int) -> str:
+    map_file = os.path.join(
+        os.path.dirname(os.path.abspath(cov_file)), f".bbcov.{module_hash:016x}.map"
+    )
+    if not os.path.exists(map_file):
+        raise FileNotFoundError(f"Basic block map {map_file} not found")
+    return map_file
+
+
+def read_map(map_file: str) -> list:
+    # list of (file, [(func, [(bb_id, bb_name), ...], [(edge_id, src_id, dst_id),
+    # ...]), ...])
+    if map_file in map_cache:
+        return map_cache[map_file]
+
+    files = []
+    num_edges = 0
+    with open(map_file, "r") as f:
+        header = f.readline().split()
+        if len(header) != 4 or header[0] != "BBCOVMAP":
+            raise ValueError(f"{map_file} is not a basic block map")
+
+        for line in f:
+            line = line.rstrip("\n")
+            if line.startswith("File "):
+                files.append((line[5:], []))
+            elif line.startswith("F "):
+                files[-1][1].append((line[2:], [], []))
+            elif line.startswith("B "):
+                bb_id, bb_name = line[2:].split(" ", 1)
+                files[-1][1][-1][1].append((int(bb_id), bb_name))
+            elif line.startswith("E "):
+                # edge ids follow the order of the E lines
+                src_id, dst_id = line[2:].split(" ")
+                files[-1][1][-1][2].append((num_edges, int(src_id), int(dst_id)))
+                num_edges += 1
+
+    map_cache[map_file] = files
+    return files
+
+
+def read_implied(map_file: str) -> list:
+    # list of (bb_id, [src_id, ...]) of -bbcov-prune builds, sources first
+    if map_file in implied_cache:
+        return implied_cache[map_file]
+
+    implied = []
+    with open(map_file, "r") as f:
+        for line in f:
+            if line.startswith("I "):
+                bb_id, *src_ids = map(int, line[2:].split())
+                implied.append((bb_id, src_ids))
+
+    implied_cache[map_file] = implied
+    return implied
+
+
+def num_map_edges(files: list) -> int:
+    return sum(len(edges) for _, funcs in files for _, _, edges in funcs)
+
+
+def read_bin_cov(cov_file: str, map_file: str = None):
+    # returns (map entries, bb_id -> reported value of covered bb_ids, covered
+    # edge ids)
+    with open(cov_file, "rb") as f:
+        data = f.read()
+
+    if len(data) < HEADER_SIZE:
+        raise ValueError(f"{cov_file} is truncated")
+
+    magic, version, encoding, module_hash, num_bbs, num_covered = struct.unpack_from(
+        HEADER_FMT, data
+    )
+    if magic != BIN_MAGIC or version != BIN_VERSION:
+        raise ValueError(f"{cov_file} is not a binary coverage file")
+
+    if map_file is None:
+        map_file = get_map_file(cov_file, module_hash)
+
+    payload = data[HEADER_SIZE:]
+    payload_size = None  # the edge bitmap follows the payload
+    if encoding == BIN_SPARSE:
+        covered = dict.fromkeys(struct.unpack_from(f"<{num_covered}I", payload), 1)
+        payload_size = num_covered * 4
+    elif encoding == BIN_BYTEMAP:
+        # .bytemap sidecar of bb_cov_instant_rt, possibly left by a crash
+        bytemap = data[BYTEMAP_OFFSET:]
+        covered = dict.fromkeys(
+            (bb_id for bb_id in range(1, num_bbs + 1) if bytemap[bb_id] != 0), 1
+        )
+        # basic blocks without a probe, the runtime fills them in at exit
+        for bb_id, src_ids in read_implied(map_file):
+            if any(src_id in covered for src_id in src_ids):
+                covered[bb_id] = 1
+    elif encoding == BIN_BUCKETS:
+        # hit count buckets of bb_cov_hitcount_rt
+        covered = {
+            bb_id: payload[bb_id] for bb_id in range(1, num_bbs + 1) if payload[bb_id] != 0
+        }
+        payload_size = num_bbs + 1
+    elif encoding == BIN_COUNTS:
+        # execution counts of bb_cov_counts_rt
+        counts = struct.unpack_from(f"<{num_bbs + 1}Q", payload)
+        covered = {
+            bb_id: counts[bb_id] for bb_id in range(1, num_bbs + 1) if counts[bb_id] != 0
+        }
+        payload_size = (num_bbs + 1) * 8
+    elif encoding == BIN_BITMAP:
+        covered = dict.fromkeys(
+            (
+                bb_id
+                for bb_id in range(1, num_bbs + 1)
+                if payload[bb_id // 8] >> (bb_id % 8) & 1
+            ),
+            1,
+        )
+        payload_size = (num_bbs + 8) // 8
+    else:
+        raise ValueError(f"{cov_file} has unknown encoding {encoding}")
+
+    files = read_map(map_file)
+    covered_edges = set()
+    if payload_size is not None:
+        edge_bitmap = payload[payload_size:]
+        covered_edges = {
+            edge_id
+            for edge_id in range(min(num_map_edges(files), len(edge_bitmap) * 8))
+            if edge_bitmap[edge_id // 8] >> (edge_id % 8) & 1
+        }
+
+    return files, covered, covered_edges
+
+
+def read_sparse_cov(cov_file: str, map_file: str = None):
+    # returns (map entries, bb_id -> reported value of covered bb_ids, covered
+    # edge ids)
+    covered_names = {}
+    covered_edge_names = set()
+    cur_file = None
+    cur_func = None
+
+    with open(cov_file, "r") as f:
+        header = f.readline().split()
+        if len(header) != 2 or header[0] != SPARSE_MAGIC.decode():
+            raise ValueError(f"{cov_file} is not a sparse coverage file")
+
+        for line in f:
+            line = line.rstrip("\n")
+            if line.startswith("File "):
+                cur_file = line[5:]
+            elif line.startswith("F "):
+                cur_func = line[2:].rsplit(" ", 1)[0]
+            elif line.startswith("B "):
+                bb_name, value = line[2:].rsplit(" ", 1)
+                covered_names[(cur_file, cur_func, bb_name)] = int(value)
+            elif line.startswith("E "):
+                src_name, dst_name, _ = line[2:].split(" ")
+                covered_edge_names.add((cur_file, cur_func, src_name, dst_name))
+
+    if map_file is None:
+        map_file = get_map_file(cov_file, int(header[1], 16))
+
+    files = read_map(map_file)
+    covered = {}
+    covered_edges = set()
+    for file_name, funcs in files:
+        for func_name, bbs, edges in funcs:
+            bb_names = dict(bbs)
+            for bb_id, bb_name in bbs:
+                if (file_name, func_name, bb_name) in covered_names:
+                    covered[bb_id] = covered_names[(file_name, func_name, bb_name)]
+            for edge_id, src_id, dst_id in edges:
+                edge_key = (file_name, func_name, bb_names[src_id], bb_names[dst_id])
+                if edge_key in covered_edge_names:
+                    covered_edges.add(edge_id)
+    return files, covered, covered_edges
+
+
+def compact_cov_to_text(cov_file: str, map_file: str = None) -> str:
+    if is_sparse_cov(cov_file):
+        files, covered, covered_edges = read_sparse_cov(cov_file, map_file)
+    else:
+        files, covered, covered_edges = read_bin_cov(cov_file, map_file)
+
+    lines = []
+    for file_name, funcs in files:
+        lines.append(f"File {file_name}")
+        for func_name, bbs, edges in funcs:
+            is_func_covered = any(bb_id in covered for bb_id, _ in bbs)
+            lines.append(f"F {func_name} {1 if is_func_covered else 0}")
+            bb_names = dict(bbs)
+            for bb_id, bb_name in bbs:
+                lines.append(f"B {bb_name} {covered.get(bb_id, 0)}")
+            for edge_id, src_id, dst_id in edges:
+                is_edge_covered = 1 if edge_id in covered_edges else 0
+                lines.append(f"E {bb_names[src_id]} {bb_names[dst_id]} {is_edge_covered}")
+
+    return "\n".join(lines) + "\n"
+
+
+def main(argv):
+    if len(argv) < 2:
+        print(f"Usage: {argv[0]} <cov_file> [<output_fn>] [<map_file>]")
+        print("  It converts a binary or sparse coverage file (BB_COV_OUTPUT_FORMAT=")
+        print("  binary or sparse) or a .bytemap sidecar of bb_cov_instant_rt to the")
+        print("  full text format.")
+        print(
+            "  <map_file>: (Optional) basic block map, defaults to the"
+            " .bbcov.<hash>.map next to <cov_file>"
+        )
+        return 1
+
+    cov_file = argv[1]
+    output_fn = argv[2] if len(argv) >= 3 else None
+    map_file = argv[3] if len(argv) >= 4 else None
+
+    if not os.path.exists(cov_file):
+        print(f"Coverage file {cov_file} does not exist")
+        return 1
+
+    if not is_compact_cov(cov_file):
+        print(f"{cov_file} is not a binary or sparse coverage file")
+        return 1
+
+    text = compact_cov_to_text(cov_file, map_file)
+
+    if output_fn is None:
+        sys.stdout.write(text)
+    else:
+        with open(output_fn, "w") as f:
+            f.write(text)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
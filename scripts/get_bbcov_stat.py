@@ -1,6 +1,7 @@
 #!/usr/bin/env python3
 import os, sys, glob, tqdm
 import json
+from bbcov_bin_to_text import is_compact_cov, compact_cov_to_text
 
 
 def get_bb_cov(cov_file: str) -> dict[str, dict[str, dict[str, bool]]]:
@@ -11,7 +12,11 @@ def get_bb_cov(cov_file: str) -> dict[str, dict[str, dict[str, bool]]]:
     cur_func = None
     cur_bb = None
 
-    covf = open(cov_file, "r")
+    if is_compact_cov(cov_file):
+        covf = compact_cov_to_text(cov_file).splitlines()
+    else:
+        covf = open(cov_file, "r")
+
     for line in covf:
         line = line.strip()
         if line == "":
@@ -31,11 +36,18 @@ def get_bb_cov(cov_file: str) -> dict[str, dict[str, dict[str, bool]]]:
             cov_data[cur_file][cur_func] = {}
             continue
 
+        # CFG edges of -bbcov-edges builds
+        if line[0] == "E":
+            continue
+
         cur_bb = line[1]
-        covered = line[2] == "1"
+        # hit-count mode reports bucket bits and counting mode execution
+        # counts instead of 1
+        covered = line[2] != "0"
         cov_data[cur_file][cur_func][cur_bb] = covered
 
-    covf.close()
+    if not isinstance(covf, list):
+        covf.close()
     return cov_data
 
 
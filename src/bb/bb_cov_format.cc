@@ -0,0 +1,886 @@
+#include "bb/bb_cov_format.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+#pragma clang attribute push(__attribute__((annotate("probe_function"))),      \
+                             apply_to = function)
+
+CovOutputFormat cov_output_format = COV_FORMAT_TEXT;
+
+void __init_output_format() {
+  const char *env_output_format = getenv(OUTPUT_FORMAT);
+  if (env_output_format == nullptr || strcmp(env_output_format, "text") == 0) {
+    return;
+  }
+
+  if (strcmp(env_output_format, "sparse") == 0) {
+    cov_output_format = COV_FORMAT_SPARSE;
+    return;
+  }
+
+  if (strcmp(env_output_format, "binary") == 0) {
+    cov_output_format = COV_FORMAT_BINARY;
+    return;
+  }
+
+  std::cerr << "[bb_cov] Unknown " << OUTPUT_FORMAT << " \""
+            << env_output_format << "\", using text format." << std::endl;
+}
+
+// Binary and sparse coverage files do not list every basic block, the names
+// are written once per build to <out_dir>/.bbcov.<module hash>.map
+void __write_cov_map(const CovModule &mod, fs::path out_dir) {
+#ifndef WRITE_COV_PER_BB
+  // the names are needed to convert the sidecar of the instant runtime
+  if (cov_output_format == COV_FORMAT_TEXT) {
+    return;
+  }
+#endif
+
+  if (out_dir.empty()) {
+    out_dir = ".";
+  }
+
+  char hash_str[17];
+  snprintf(hash_str, sizeof(hash_str), "%016llx",
+           (unsigned long long)mod.module_hash);
+
+  const fs::path map_path =
+      out_dir / (std::string(".bbcov.") + hash_str + ".map");
+  if (fs::exists(map_path)) {
+    return;
+  }
+
+  // write to a temporary file first, other processes may race on the map
+  const fs::path tmp_path =
+      map_path.string() + "." + std::to_string(getpid()) + ".tmp";
+  std::ofstream map_out(tmp_path, std::ios::out);
+  if (!map_out.is_open()) {
+    std::cerr << "[bb_cov] Failed to write basic block map " << map_path
+              << std::endl;
+    return;
+  }
+
+  map_out << "BBCOVMAP " << BB_COV_BIN_VERSION << " " << hash_str << " "
+          << mod.num_bbs << "\n";
+
+  const char *prev_file_name = nullptr;
+  uint32_t edge_id = 0;
+  for (uint32_t func_idx = 0; func_idx < mod.num_cov_funcs; func_idx++) {
+    const CFuncEntry &func_entry = mod.cov_funcs[func_idx];
+    const char *file_name = mod.cov_strtab + func_entry.file_off;
+
+    if (file_name != prev_file_name) {
+      map_out << "File " << file_name << "\n";
+      prev_file_name = file_name;
+    }
+
+    map_out << "F " << mod.cov_strtab + func_entry.name_off << "\n";
+
+    const uint32_t end_bb = func_entry.first_bb + func_entry.num_bbs;
+    for (uint32_t bb_id = func_entry.first_bb; bb_id < end_bb; bb_id++) {
+      map_out << "B " << bb_id << " "
+              << mod.cov_strtab + mod.cov_bbs[bb_id].name_off << "\n";
+    }
+
+    // edge ids follow the order of the E lines
+    for (; edge_id < mod.num_cov_edges &&
+           mod.cov_edges[edge_id].src_bb < end_bb;
+         edge_id++) {
+      map_out << "E " << mod.cov_edges[edge_id].src_bb << " "
+              << mod.cov_edges[edge_id].dst_bb << "\n";
+    }
+  }
+
+  // "I <bb_id> <src bb_ids...>", for the sidecar of the instant runtime
+  uint32_t idx = 0;
+  while (idx + 1 < mod.implied_size) {
+    const uint32_t num_srcs = mod.implied_table[idx + 1];
+    map_out << "I " << mod.implied_table[idx];
+    for (uint32_t src_idx = 0; src_idx < num_srcs; src_idx++) {
+      map_out << " " << mod.implied_table[idx + 2 + src_idx];
+    }
+    map_out << "\n";
+    idx += 2 + num_srcs;
+  }
+  map_out.close();
+
+  fs::rename(tmp_path, map_path);
+}
+
+// Value reported for a basic block, merged with the previous coverage: the
+// union of hit count buckets in hit-count mode, otherwise 1 if covered.
+static inline uint8_t __get_bb_value(const CovModule &mod,
+                                     const uint32_t bb_id) {
+  const uint8_t prev_value = mod.prev_cov.empty() ? 0 : mod.prev_cov[bb_id];
+
+  if (is_hitcount) {
+    return __count_to_bucket(mod.cov_arr[bb_id]) | prev_value;
+  }
+
+  return mod.cov_arr[bb_id] != 0 || prev_value != 0;
+}
+
+// Execution count reported for a basic block in counting mode, merged with
+// the previous counts. Async-signal-safe.
+static inline uint64_t __get_bb_count(const CovModule &mod,
+                                      const uint32_t bb_id) {
+  const uint64_t prev_count =
+      mod.prev_counts.empty() ? 0 : mod.prev_counts[bb_id];
+  return mod.bb_counts[bb_id] + prev_count;
+}
+
+static inline bool __is_bb_covered(const CovModule &mod, const uint32_t bb_id) {
+  return __get_bb_value(mod, bb_id) != 0;
+}
+
+static inline bool __is_edge_covered(const CovModule &mod,
+                                     const uint32_t edge_id) {
+  return mod.edge_arr[edge_id] != 0 ||
+         (!mod.prev_edge_cov.empty() && mod.prev_edge_cov[edge_id] != 0);
+}
+
+static inline const char *__get_bb_name(const CovModule &mod,
+                                        const uint32_t bb_id) {
+  return mod.cov_strtab + mod.cov_bbs[bb_id].name_off;
+}
+
+// Formats the text report. If digit_offs is given, it receives the offset of
+// the coverage digit of every function (indexed by func_idx) followed by
+// every basic block (indexed by num_cov_funcs + bb_id) and every edge
+// (indexed by num_cov_funcs + num_bbs + 1 + edge_id).
+static std::string __format_cov_text(const CovModule &mod,
+                                     std::vector<uint32_t> *digit_offs) {
+  std::string report;
+  const char *prev_file_name = nullptr;
+  const uint32_t edge_digits_begin = mod.num_cov_funcs + mod.num_bbs + 1;
+  uint32_t edge_id = 0;
+
+  if (digit_offs != nullptr) {
+    digit_offs->assign(edge_digits_begin + mod.num_cov_edges, 0);
+  }
+
+  for (uint32_t func_idx = 0; func_idx < mod.num_cov_funcs; func_idx++) {
+    const CFuncEntry &func_entry = mod.cov_funcs[func_idx];
+    const char *file_name = mod.cov_strtab + func_entry.file_off;
+    const char *func_name = mod.cov_strtab + func_entry.name_off;
+
+    // functions of a file are contiguous
+    if (file_name != prev_file_name) {
+      report.append("File ").append(file_name).append("\n");
+      prev_file_name = file_name;
+    }
+
+    const uint32_t end_bb = func_entry.first_bb + func_entry.num_bbs;
+
+    bool is_func_covered = false;
+    for (uint32_t bb_id = func_entry.first_bb; bb_id < end_bb; bb_id++) {
+      if (__is_bb_covered(mod, bb_id)) {
+        is_func_covered = true;
+        break;
+      }
+    }
+
+    report.append("F ").append(func_name).append(" ");
+    if (digit_offs != nullptr) {
+      (*digit_offs)[func_idx] = report.size();
+    }
+    report.append(is_func_covered ? "1\n" : "0\n");
+
+    for (uint32_t bb_id = func_entry.first_bb; bb_id < end_bb; bb_id++) {
+      const char *bb_name = mod.cov_strtab + mod.cov_bbs[bb_id].name_off;
+      report.append("B ").append(bb_name).append(" ");
+      if (digit_offs != nullptr) {
+        (*digit_offs)[mod.num_cov_funcs + bb_id] = report.size();
+      }
+      if (is_counts) {
+        report.append(std::to_string(__get_bb_count(mod, bb_id))).append("\n");
+      } else {
+        report.append(std::to_string(__get_bb_value(mod, bb_id))).append("\n");
+      }
+    }
+
+    // "E <src> <dst> 0|1", edges stay boolean in hit-count mode
+    for (; edge_id < mod.num_cov_edges &&
+           mod.cov_edges[edge_id].src_bb < end_bb;
+         edge_id++) {
+      const CEdgeEntry &edge = mod.cov_edges[edge_id];
+      report.append("E ")
+          .append(__get_bb_name(mod, edge.src_bb))
+          .append(" ")
+          .append(__get_bb_name(mod, edge.dst_bb))
+          .append(" ");
+      if (digit_offs != nullptr) {
+        (*digit_offs)[edge_digits_begin + edge_id] = report.size();
+      }
+      report.append(__is_edge_covered(mod, edge_id) ? "1\n" : "0\n");
+    }
+  }
+
+  return report;
+}
+
+static void __write_cov_text(const CovModule &mod,
+                             std::ofstream &cov_file_out) {
+  cov_file_out << __format_cov_text(mod, nullptr);
+}
+
+// Same lines as the text report, but only covered files, functions and basic
+// blocks. The header names the basic block map that has the rest.
+static void __write_cov_sparse(const CovModule &mod,
+                               std::ofstream &cov_file_out) {
+  char hash_str[17];
+  snprintf(hash_str, sizeof(hash_str), "%016llx",
+           (unsigned long long)mod.module_hash);
+  cov_file_out << BB_COV_SPARSE_MAGIC << " " << hash_str << "\n";
+
+  const char *prev_file_name = nullptr;
+  uint32_t edge_id = 0;
+
+  for (uint32_t func_idx = 0; func_idx < mod.num_cov_funcs; func_idx++) {
+    const CFuncEntry &func_entry = mod.cov_funcs[func_idx];
+    const uint32_t end_bb = func_entry.first_bb + func_entry.num_bbs;
+
+    bool is_func_printed = false;
+    for (uint32_t bb_id = func_entry.first_bb; bb_id < end_bb; bb_id++) {
+      const uint8_t bb_value = __get_bb_value(mod, bb_id);
+      if (bb_value == 0) {
+        continue;
+      }
+
+      if (!is_func_printed) {
+        const char *file_name = mod.cov_strtab + func_entry.file_off;
+        if (file_name != prev_file_name) {
+          cov_file_out << "File " << file_name << "\n";
+          prev_file_name = file_name;
+        }
+
+        cov_file_out << "F " << mod.cov_strtab + func_entry.name_off
+                     << " 1\n";
+        is_func_printed = true;
+      }
+
+      cov_file_out << "B " << __get_bb_name(mod, bb_id) << " ";
+      if (is_counts) {
+        cov_file_out << __get_bb_count(mod, bb_id) << "\n";
+      } else {
+        cov_file_out << (uint32_t)bb_value << "\n";
+      }
+    }
+
+    // a covered edge implies a covered source basic block
+    for (; edge_id < mod.num_cov_edges &&
+           mod.cov_edges[edge_id].src_bb < end_bb;
+         edge_id++) {
+      if (!is_func_printed || !__is_edge_covered(mod, edge_id)) {
+        continue;
+      }
+
+      const CEdgeEntry &edge = mod.cov_edges[edge_id];
+      cov_file_out << "E " << __get_bb_name(mod, edge.src_bb) << " "
+                   << __get_bb_name(mod, edge.dst_bb) << " 1\n";
+    }
+  }
+}
+
+static void __write_cov_binary(const CovModule &mod,
+                               std::ofstream &cov_file_out) {
+  std::vector<uint32_t> covered_ids;
+  for (uint32_t bb_id = 1; bb_id <= mod.num_bbs; bb_id++) {
+    if (__is_bb_covered(mod, bb_id)) {
+      covered_ids.push_back(bb_id);
+    }
+  }
+
+  BBCovBinHeader header;
+  memcpy(header.magic, BB_COV_BIN_MAGIC, sizeof(header.magic));
+  header.version = BB_COV_BIN_VERSION;
+  header.module_hash = mod.module_hash;
+  header.num_bbs = mod.num_bbs;
+  header.num_covered = covered_ids.size();
+
+  // pick whichever encoding is smaller
+  const size_t bitmap_size = (mod.num_bbs + 8) / 8;
+  const size_t sparse_size = covered_ids.size() * sizeof(uint32_t);
+  header.encoding =
+      sparse_size < bitmap_size ? BB_COV_BIN_SPARSE : BB_COV_BIN_BITMAP;
+
+  if (is_hitcount) {
+    header.encoding = BB_COV_BIN_BUCKETS;
+  } else if (is_counts) {
+    header.encoding = BB_COV_BIN_COUNTS;
+  }
+
+  cov_file_out.write((const char *)&header, sizeof(header));
+
+  if (header.encoding == BB_COV_BIN_BUCKETS) {
+    std::vector<uint8_t> buckets(mod.num_bbs + 1, 0);
+    for (const uint32_t bb_id : covered_ids) {
+      buckets[bb_id] = __get_bb_value(mod, bb_id);
+    }
+    cov_file_out.write((const char *)buckets.data(), buckets.size());
+  } else if (header.encoding == BB_COV_BIN_COUNTS) {
+    std::vector<uint64_t> counts(mod.num_bbs + 1, 0);
+    for (const uint32_t bb_id : covered_ids) {
+      counts[bb_id] = __get_bb_count(mod, bb_id);
+    }
+    cov_file_out.write((const char *)counts.data(),
+                       counts.size() * sizeof(uint64_t));
+  } else if (header.encoding == BB_COV_BIN_SPARSE) {
+    cov_file_out.write((const char *)covered_ids.data(), sparse_size);
+  } else {
+    std::vector<uint8_t> bitmap(bitmap_size, 0);
+    for (const uint32_t bb_id : covered_ids) {
+      bitmap[bb_id / 8] |= (uint8_t)(1 << (bb_id % 8));
+    }
+    cov_file_out.write((const char *)bitmap.data(), bitmap_size);
+  }
+
+  if (mod.num_cov_edges == 0) {
+    return;
+  }
+
+  std::vector<uint8_t> edge_bitmap((mod.num_cov_edges + 7) / 8, 0);
+  for (uint32_t edge_id = 0; edge_id < mod.num_cov_edges; edge_id++) {
+    if (__is_edge_covered(mod, edge_id)) {
+      edge_bitmap[edge_id / 8] |= (uint8_t)(1 << (edge_id % 8));
+    }
+  }
+  cov_file_out.write((const char *)edge_bitmap.data(), edge_bitmap.size());
+}
+
+bool __write_cov(CovModule &mod) {
+  if (mod.output_fn.empty()) {
+    std::cerr << "[bb_cov] No coverage information collected." << std::endl;
+    return false;
+  }
+
+  static std::mutex write_mutex;
+  std::lock_guard<std::mutex> guard(write_mutex);
+
+  // the instant runtime writes before __cov_fini
+  __collect_cov(mod);
+
+  std::ofstream cov_file_out(mod.output_fn, std::ios::out | std::ios::binary);
+  if (!cov_file_out.is_open()) {
+    std::cerr << "[bb_cov] Failed to open coverage output file." << std::endl;
+    return false;
+  }
+
+  if (cov_output_format == COV_FORMAT_BINARY) {
+    __write_cov_binary(mod, cov_file_out);
+  } else if (cov_output_format == COV_FORMAT_SPARSE) {
+    __write_cov_sparse(mod, cov_file_out);
+  } else {
+    __write_cov_text(mod, cov_file_out);
+  }
+
+  cov_file_out.close();
+  return !cov_file_out.fail();
+}
+
+// Edge bitmap that follows the basic block payload
+static bool __read_prev_edge_cov_binary(CovModule &mod,
+                                        std::ifstream &cov_file_in) {
+  if (mod.num_cov_edges == 0) {
+    return true;
+  }
+
+  const std::streamsize edge_bitmap_size = (mod.num_cov_edges + 7) / 8;
+  std::vector<uint8_t> edge_bitmap(edge_bitmap_size);
+  cov_file_in.read((char *)edge_bitmap.data(), edge_bitmap_size);
+  if (cov_file_in.gcount() != edge_bitmap_size) {
+    return false;
+  }
+
+  for (uint32_t edge_id = 0; edge_id < mod.num_cov_edges; edge_id++) {
+    mod.prev_edge_cov[edge_id] =
+        (edge_bitmap[edge_id / 8] >> (edge_id % 8)) & 1;
+  }
+  return true;
+}
+
+static bool __read_prev_cov_binary(CovModule &mod, std::ifstream &cov_file_in) {
+  BBCovBinHeader header;
+  cov_file_in.read((char *)&header, sizeof(header));
+  if (cov_file_in.gcount() != sizeof(header) ||
+      header.version != BB_COV_BIN_VERSION) {
+    return false;
+  }
+
+  if (header.module_hash != mod.module_hash ||
+      header.num_bbs != mod.num_bbs) {
+    std::cerr << "[bb_cov] Existing coverage file is from a different build, "
+                 "ignoring it."
+              << std::endl;
+    return true;
+  }
+
+  if (header.encoding == BB_COV_BIN_SPARSE) {
+    std::vector<uint32_t> covered_ids(header.num_covered);
+    const std::streamsize sparse_size =
+        covered_ids.size() * sizeof(uint32_t);
+    cov_file_in.read((char *)covered_ids.data(), sparse_size);
+    if (cov_file_in.gcount() != sparse_size) {
+      return false;
+    }
+
+    for (const uint32_t bb_id : covered_ids) {
+      if (bb_id == 0 || bb_id > mod.num_bbs) {
+        return false;
+      }
+      mod.prev_cov[bb_id] = 1;
+    }
+    return __read_prev_edge_cov_binary(mod, cov_file_in);
+  }
+
+  if (header.encoding == BB_COV_BIN_BUCKETS) {
+    std::vector<char> buckets(mod.num_bbs + 1);
+    cov_file_in.read(buckets.data(), buckets.size());
+    if (cov_file_in.gcount() != (std::streamsize)buckets.size()) {
+      return false;
+    }
+
+    for (uint32_t bb_id = 1; bb_id <= mod.num_bbs; bb_id++) {
+      mod.prev_cov[bb_id] = buckets[bb_id];
+    }
+    return __read_prev_edge_cov_binary(mod, cov_file_in);
+  }
+
+  if (header.encoding == BB_COV_BIN_COUNTS) {
+    std::vector<uint64_t> counts(mod.num_bbs + 1);
+    const std::streamsize counts_size = counts.size() * sizeof(uint64_t);
+    cov_file_in.read((char *)counts.data(), counts_size);
+    if (cov_file_in.gcount() != counts_size) {
+      return false;
+    }
+
+    for (uint32_t bb_id = 1; bb_id <= mod.num_bbs; bb_id++) {
+      if (counts[bb_id] == 0) {
+        continue;
+      }
+      mod.prev_cov[bb_id] =
+          is_hitcount
+              ? __count_to_bucket(std::min<uint64_t>(counts[bb_id], 255))
+              : 1;
+      if (is_counts) {
+        mod.prev_counts[bb_id] = counts[bb_id];
+      }
+    }
+    return __read_prev_edge_cov_binary(mod, cov_file_in);
+  }
+
+  if (header.encoding == BB_COV_BIN_BYTEMAP) {
+    // sidecar of the instant runtime, edges are not mapped
+    std::vector<char> bytemap(mod.num_bbs + 1);
+    cov_file_in.seekg(BB_COV_BYTEMAP_OFFSET);
+    cov_file_in.read(bytemap.data(), bytemap.size());
+    if (cov_file_in.gcount() != (std::streamsize)bytemap.size()) {
+      return false;
+    }
+
+    for (uint32_t bb_id = 1; bb_id <= mod.num_bbs; bb_id++) {
+      mod.prev_cov[bb_id] = bytemap[bb_id] != 0;
+    }
+    // the raw array of a crashed run
+    __apply_implied_cov(mod, mod.prev_cov.data());
+    return true;
+  }
+
+  if (header.encoding != BB_COV_BIN_BITMAP) {
+    return false;
+  }
+
+  const std::streamsize bitmap_size = (mod.num_bbs + 8) / 8;
+  std::vector<uint8_t> bitmap(bitmap_size);
+  cov_file_in.read((char *)bitmap.data(), bitmap_size);
+  if (cov_file_in.gcount() != bitmap_size) {
+    return false;
+  }
+
+  for (uint32_t bb_id = 1; bb_id <= mod.num_bbs; bb_id++) {
+    mod.prev_cov[bb_id] = (bitmap[bb_id / 8] >> (bb_id % 8)) & 1;
+  }
+  return __read_prev_edge_cov_binary(mod, cov_file_in);
+}
+
+static bool __read_prev_cov_text(CovModule &mod, std::ifstream &cov_file_in) {
+  // resolve names to bb_ids through the string table, names are unique in it
+  std::unordered_map<std::string_view, uint32_t> str_offsets;
+  std::unordered_map<uint64_t, uint32_t> func_indices; // file, name offsets
+  std::unordered_map<uint64_t, uint32_t> bb_ids;       // func_idx, name offset
+  std::unordered_map<uint64_t, uint32_t> edge_ids;     // src, dst bb_ids
+
+  for (uint32_t func_idx = 0; func_idx < mod.num_cov_funcs; func_idx++) {
+    const CFuncEntry &func_entry = mod.cov_funcs[func_idx];
+    str_offsets.emplace(mod.cov_strtab + func_entry.file_off,
+                        func_entry.file_off);
+    str_offsets.emplace(mod.cov_strtab + func_entry.name_off,
+                        func_entry.name_off);
+    func_indices.emplace(
+        ((uint64_t)func_entry.file_off << 32) | func_entry.name_off, func_idx);
+
+    const uint32_t end_bb = func_entry.first_bb + func_entry.num_bbs;
+    for (uint32_t bb_id = func_entry.first_bb; bb_id < end_bb; bb_id++) {
+      const uint32_t name_off = mod.cov_bbs[bb_id].name_off;
+      str_offsets.emplace(mod.cov_strtab + name_off, name_off);
+      bb_ids.emplace(((uint64_t)func_idx << 32) | name_off, bb_id);
+    }
+  }
+
+  for (uint32_t edge_id = 0; edge_id < mod.num_cov_edges; edge_id++) {
+    const CEdgeEntry &edge = mod.cov_edges[edge_id];
+    edge_ids.emplace(((uint64_t)edge.src_bb << 32) | edge.dst_bb, edge_id);
+  }
+
+  const uint32_t not_found = (uint32_t)-1;
+  auto lookup_str = [&](const std::string &str) {
+    auto search = str_offsets.find(str);
+    return search == str_offsets.end() ? not_found : search->second;
+  };
+
+  std::string type;
+  std::string name;
+  bool is_covered = false;
+  std::string line;
+
+  bool in_file = false;
+  uint32_t cur_file_off = not_found;
+  uint32_t cur_func_idx = not_found;
+
+  bool found_error = false;
+
+  while (getline(cov_file_in, line)) {
+    if (line.length() == 0) {
+      continue;
+    }
+
+    auto pos1 = line.find(" ");
+
+    if (pos1 == std::string::npos) {
+      found_error = true;
+      break;
+    }
+
+    auto pos2 = line.find_last_of(" ");
+
+    type = line.substr(0, pos1);
+    name = line.substr(pos1 + 1, pos2 - pos1 - 1);
+    const std::string value = line.substr(pos2 + 1);
+    is_covered = value != "0";
+
+    if (type == BB_COV_SPARSE_MAGIC) {
+      // sparse report, only covered entries follow
+      continue;
+    }
+
+    if (type == "File") {
+      // "File" lines have no coverage field
+      in_file = true;
+      cur_file_off = lookup_str(line.substr(pos1 + 1));
+      cur_func_idx = not_found;
+      continue;
+    }
+
+    if (type == "F") {
+      if (!in_file) {
+        found_error = true;
+        continue;
+      }
+
+      // functions that no longer exist are dropped
+      cur_func_idx = not_found;
+      const uint32_t name_off = lookup_str(name);
+      if (cur_file_off != not_found && name_off != not_found) {
+        auto search =
+            func_indices.find(((uint64_t)cur_file_off << 32) | name_off);
+        if (search != func_indices.end()) {
+          cur_func_idx = search->second;
+        }
+      }
+      continue;
+    }
+
+    if (!is_covered || cur_func_idx == not_found) {
+      continue;
+    }
+
+    if (type == "E") {
+      // "E <src> <dst> 0|1", basic block names have no spaces
+      const auto pos = name.find(" ");
+      if (pos == std::string::npos) {
+        found_error = true;
+        continue;
+      }
+
+      auto src_search = bb_ids.find(((uint64_t)cur_func_idx << 32) |
+                                    lookup_str(name.substr(0, pos)));
+      auto dst_search = bb_ids.find(((uint64_t)cur_func_idx << 32) |
+                                    lookup_str(name.substr(pos + 1)));
+      if (src_search == bb_ids.end() || dst_search == bb_ids.end()) {
+        continue;
+      }
+
+      auto edge_search = edge_ids.find(((uint64_t)src_search->second << 32) |
+                                       dst_search->second);
+      if (edge_search != edge_ids.end()) {
+        mod.prev_edge_cov[edge_search->second] = 1;
+      }
+      continue;
+    }
+
+    const uint32_t name_off = lookup_str(name);
+    if (name_off == not_found) {
+      continue;
+    }
+
+    auto search = bb_ids.find(((uint64_t)cur_func_idx << 32) | name_off);
+    if (search != bb_ids.end()) {
+      // hit count buckets, or 1 from a file without hit counts
+      const uint8_t bb_value = strtoul(value.c_str(), nullptr, 10);
+      mod.prev_cov[search->second] |= bb_value != 0 ? bb_value : 1;
+      if (is_counts) {
+        mod.prev_counts[search->second] += strtoull(value.c_str(), nullptr, 10);
+      }
+    }
+  }
+
+  return !found_error;
+}
+
+void __cov_read_prev_cov(CovModule &mod) {
+  if (mod.output_fn.empty()) {
+    return;
+  }
+
+  static std::mutex read_prev_cov_mutex;
+  std::lock_guard<std::mutex> guard(read_prev_cov_mutex);
+
+  if (mod.prev_cov.size() != 0) {
+    return;
+  }
+
+  std::ifstream cov_file_in(mod.output_fn, std::ios::in | std::ios::binary);
+  if (!cov_file_in.is_open()) {
+    return;
+  }
+
+  std::cout << "[bb_cov] Found existing coverage file, reading ...\n";
+  mod.prev_cov.assign(mod.num_bbs + 1, 0);
+  mod.prev_edge_cov.assign(mod.num_cov_edges, 0);
+  if (is_counts) {
+    mod.prev_counts.assign(mod.num_bbs + 1, 0);
+  }
+
+  // either format can be merged, regardless of the output format
+  char magic[sizeof(BBCovBinHeader::magic)];
+  cov_file_in.read(magic, sizeof(magic));
+  const bool is_binary = cov_file_in.gcount() == sizeof(magic) &&
+                         memcmp(magic, BB_COV_BIN_MAGIC, sizeof(magic)) == 0;
+  cov_file_in.clear();
+  cov_file_in.seekg(0);
+
+  const bool read_ok = is_binary ? __read_prev_cov_binary(mod, cov_file_in)
+                                 : __read_prev_cov_text(mod, cov_file_in);
+  cov_file_in.close();
+
+  // a file without counts only tells that a basic block ran at least once
+  for (uint32_t bb_id = 1; bb_id <= mod.num_bbs && is_counts; bb_id++) {
+    if (mod.prev_cov[bb_id] != 0 && mod.prev_counts[bb_id] == 0) {
+      mod.prev_counts[bb_id] = 1;
+    }
+  }
+
+  if (!read_ok) {
+    std::cout << "Error reading existing coverage file, coverage may be not "
+                 "accurate"
+              << std::endl;
+  }
+  return;
+}
+
+#ifndef WRITE_COV_PER_BB
+// Formats the report of a module before any coverage is merged in. The
+// parents of the replay and bbcov-run children prepare it once before
+// forking, the children only merge their previous coverage into it.
+void __prepare_emergency_cov(CovModule &mod) {
+  if (mod.emergency_buf != nullptr) {
+    return;
+  }
+
+  // never freed, the handlers may run during static destruction.
+  // Sparse reports can not be patched in place, they get the full text report
+  // which is read the same way. Hit count buckets and execution counts do not
+  // fit in one digit, so those modes always get a binary report.
+  if (cov_output_format == COV_FORMAT_BINARY || is_hitcount || is_counts) {
+    size_t payload_size = (mod.num_bbs + 8) / 8;
+    if (is_hitcount) {
+      payload_size = mod.num_bbs + 1;
+    } else if (is_counts) {
+      payload_size = (mod.num_bbs + 1) * sizeof(uint64_t);
+    }
+    mod.emergency_edge_bitmap_off = sizeof(BBCovBinHeader) + payload_size;
+    mod.emergency_size = mod.emergency_edge_bitmap_off;
+    if (mod.num_cov_edges != 0) {
+      mod.emergency_size += (mod.num_cov_edges + 7) / 8;
+    }
+    mod.emergency_buf = (char *)calloc(mod.emergency_size, 1);
+
+    BBCovBinHeader *header = (BBCovBinHeader *)mod.emergency_buf;
+    memcpy(header->magic, BB_COV_BIN_MAGIC, sizeof(header->magic));
+    header->version = BB_COV_BIN_VERSION;
+    header->encoding = BB_COV_BIN_BITMAP;
+    if (is_hitcount) {
+      header->encoding = BB_COV_BIN_BUCKETS;
+    } else if (is_counts) {
+      header->encoding = BB_COV_BIN_COUNTS;
+    }
+    header->module_hash = mod.module_hash;
+    header->num_bbs = mod.num_bbs;
+    return;
+  }
+
+  std::vector<uint32_t> digit_offs;
+  const std::string report = __format_cov_text(mod, &digit_offs);
+
+  mod.emergency_size = report.size();
+  mod.emergency_buf = (char *)malloc(mod.emergency_size);
+  memcpy(mod.emergency_buf, report.data(), mod.emergency_size);
+
+  const size_t offs_size = digit_offs.size() * sizeof(uint32_t);
+  mod.emergency_digit_offs = (uint32_t *)malloc(offs_size);
+  memcpy(mod.emergency_digit_offs, digit_offs.data(), offs_size);
+}
+
+// Merges the existing output file of a module into its prepared report,
+// nothing to do if there is none
+void __merge_prev_emergency_cov(CovModule &mod) {
+  __cov_read_prev_cov(mod);
+  if (mod.prev_cov.empty()) {
+    return;
+  }
+
+  // the counts are filled in by __fill_emergency_cov
+  if (cov_output_format == COV_FORMAT_BINARY || is_hitcount || is_counts) {
+    uint8_t *payload =
+        (uint8_t *)(mod.emergency_buf + sizeof(BBCovBinHeader));
+    for (uint32_t bb_id = 1; bb_id <= mod.num_bbs && !is_counts; bb_id++) {
+      if (is_hitcount) {
+        payload[bb_id] |= mod.prev_cov[bb_id];
+      } else if (mod.prev_cov[bb_id]) {
+        payload[bb_id / 8] |= (uint8_t)(1 << (bb_id % 8));
+      }
+    }
+
+    uint8_t *edge_bitmap =
+        (uint8_t *)(mod.emergency_buf + mod.emergency_edge_bitmap_off);
+    for (uint32_t edge_id = 0; edge_id < mod.num_cov_edges; edge_id++) {
+      if (mod.prev_edge_cov[edge_id]) {
+        edge_bitmap[edge_id / 8] |= (uint8_t)(1 << (edge_id % 8));
+      }
+    }
+    return;
+  }
+
+  for (uint32_t func_idx = 0; func_idx < mod.num_cov_funcs; func_idx++) {
+    const CFuncEntry &func_entry = mod.cov_funcs[func_idx];
+    const uint32_t end_bb = func_entry.first_bb + func_entry.num_bbs;
+
+    for (uint32_t bb_id = func_entry.first_bb; bb_id < end_bb; bb_id++) {
+      if (mod.prev_cov[bb_id] == 0) {
+        continue;
+      }
+
+      const uint32_t digit_idx = mod.num_cov_funcs + bb_id;
+      mod.emergency_buf[mod.emergency_digit_offs[digit_idx]] = '1';
+      mod.emergency_buf[mod.emergency_digit_offs[func_idx]] = '1';
+    }
+  }
+
+  const uint32_t edge_digits_begin = mod.num_cov_funcs + mod.num_bbs + 1;
+  for (uint32_t edge_id = 0; edge_id < mod.num_cov_edges; edge_id++) {
+    if (mod.prev_edge_cov[edge_id]) {
+      const uint32_t digit_idx = edge_digits_begin + edge_id;
+      mod.emergency_buf[mod.emergency_digit_offs[digit_idx]] = '1';
+    }
+  }
+}
+
+// Async-signal-safe
+void __fill_emergency_cov(CovModule &mod) {
+  if (cov_output_format == COV_FORMAT_BINARY || is_hitcount || is_counts) {
+    BBCovBinHeader *header = (BBCovBinHeader *)mod.emergency_buf;
+    uint8_t *payload =
+        (uint8_t *)(mod.emergency_buf + sizeof(BBCovBinHeader));
+
+    header->num_covered = 0;
+    for (uint32_t bb_id = 1; bb_id <= mod.num_bbs; bb_id++) {
+      if (is_counts) {
+        const uint64_t count = __get_bb_count(mod, bb_id);
+        memcpy(payload + bb_id * sizeof(uint64_t), &count, sizeof(count));
+        header->num_covered += count != 0;
+        continue;
+      }
+
+      if (is_hitcount) {
+        payload[bb_id] |= __count_to_bucket(mod.cov_arr[bb_id]);
+        header->num_covered += payload[bb_id] != 0;
+        continue;
+      }
+
+      if (mod.cov_arr[bb_id] != 0) {
+        payload[bb_id / 8] |= (uint8_t)(1 << (bb_id % 8));
+      }
+      header->num_covered += (payload[bb_id / 8] >> (bb_id % 8)) & 1;
+    }
+
+    uint8_t *edge_bitmap =
+        (uint8_t *)(mod.emergency_buf + mod.emergency_edge_bitmap_off);
+    for (uint32_t edge_id = 0; edge_id < mod.num_cov_edges; edge_id++) {
+      if (mod.edge_arr[edge_id] != 0) {
+        edge_bitmap[edge_id / 8] |= (uint8_t)(1 << (edge_id % 8));
+      }
+    }
+    return;
+  }
+
+  for (uint32_t func_idx = 0; func_idx < mod.num_cov_funcs; func_idx++) {
+    const CFuncEntry &func_entry = mod.cov_funcs[func_idx];
+    const uint32_t end_bb = func_entry.first_bb + func_entry.num_bbs;
+
+    for (uint32_t bb_id = func_entry.first_bb; bb_id < end_bb; bb_id++) {
+      if (mod.cov_arr[bb_id] == 0) {
+        continue;
+      }
+
+      const uint32_t digit_idx = mod.num_cov_funcs + bb_id;
+      mod.emergency_buf[mod.emergency_digit_offs[digit_idx]] = '1';
+      mod.emergency_buf[mod.emergency_digit_offs[func_idx]] = '1';
+    }
+  }
+
+  const uint32_t edge_digits_begin = mod.num_cov_funcs + mod.num_bbs + 1;
+  for (uint32_t edge_id = 0; edge_id < mod.num_cov_edges; edge_id++) {
+    if (mod.edge_arr[edge_id] != 0) {
+      const uint32_t digit_idx = edge_digits_begin + edge_id;
+      mod.emergency_buf[mod.emergency_digit_offs[digit_idx]] = '1';
+    }
+  }
+}
+#endif
+
+#pragma clang attribute pop
@@ -0,0 +1,383 @@
+#include "bb/bb_cov_module.hpp"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+
+#include "bb/bb_map.hpp"
+#include "utils/hash.hpp"
+
+#pragma clang attribute push(__attribute__((annotate("probe_function"))),      \
+                             apply_to = function)
+
+uint32_t next_id_base = 0;
+
+// Marks the basic blocks pruned at compile time that are implied by covered
+// ones, cov is indexed by bb_id. Async-signal-safe.
+void __apply_implied_cov(const CovModule &mod, char *cov) {
+  uint32_t idx = 0;
+  while (idx + 1 < mod.implied_size) {
+    const uint32_t bb_id = mod.implied_table[idx];
+    const uint32_t num_srcs = mod.implied_table[idx + 1];
+    const uint32_t *srcs = &mod.implied_table[idx + 2];
+    idx += 2 + num_srcs;
+
+    if (cov[bb_id] != 0) {
+      continue;
+    }
+
+    for (uint32_t src_idx = 0; src_idx < num_srcs; src_idx++) {
+      if (cov[srcs[src_idx]] != 0) {
+        cov[bb_id] = 1;
+        break;
+      }
+    }
+  }
+}
+
+// Derives the counts of the spanning tree edges and the basic blocks of
+// -bbcov-counts builds from the counters, and marks the counted basic blocks
+// in cov_arr. Async-signal-safe.
+static void __apply_count_table(CovModule &mod) {
+  if (mod.bb_counts.empty()) {
+    return;
+  }
+
+  uint32_t idx = 0;
+  while (idx + 1 < mod.count_solve_size) {
+    const uint32_t val_idx = mod.count_solve[idx];
+    const uint32_t num_plus = mod.count_solve[idx + 1];
+    idx += 2;
+
+    uint64_t plus_sum = 0;
+    for (uint32_t plus_idx = 0; plus_idx < num_plus; plus_idx++) {
+      plus_sum += mod.count_arr[mod.count_solve[idx + plus_idx]];
+    }
+    idx += num_plus;
+
+    const uint32_t num_minus = mod.count_solve[idx];
+    idx += 1;
+
+    uint64_t minus_sum = 0;
+    for (uint32_t minus_idx = 0; minus_idx < num_minus; minus_idx++) {
+      minus_sum += mod.count_arr[mod.count_solve[idx + minus_idx]];
+    }
+    idx += num_minus;
+
+    // lost updates of racing threads must not wrap around
+    mod.count_arr[val_idx] = plus_sum > minus_sum ? plus_sum - minus_sum : 0;
+  }
+
+  for (idx = 0; idx + 1 < mod.count_bbs_size; idx += 2) {
+    mod.bb_counts[mod.count_bbs[idx]] = 0;
+  }
+  for (idx = 0; idx + 1 < mod.count_bbs_size; idx += 2) {
+    mod.bb_counts[mod.count_bbs[idx]] += mod.count_arr[mod.count_bbs[idx + 1]];
+  }
+  for (idx = 0; idx + 1 < mod.count_bbs_size; idx += 2) {
+    if (mod.bb_counts[mod.count_bbs[idx]] != 0) {
+      mod.cov_arr[mod.count_bbs[idx]] = 1;
+    }
+  }
+}
+
+// Assigns the bb_ids of the -bbcov-per-tu units of a module and merges their
+// tables. Basic blocks with the same (file, func, bb) names share one bb_id
+// across units, like inlined copies and inline functions of headers. The
+// module then gets the next id_base, false if there is none left.
+bool __merge_units(CovModule &mod) {
+  for (CUnitEntry *entry = mod.units_start;
+       entry != nullptr && entry < mod.units_stop; entry++) {
+    if (entry->version != BB_COV_UNIT_VERSION) {
+      std::cerr << "[bb_cov] Unit built by a different version of the pass, "
+                   "ignoring it."
+                << std::endl;
+      continue;
+    }
+    mod.merged_units.push_back(MergedUnit{entry, {}, 0});
+  }
+
+  GBBMap bb_map;
+  std::vector<std::vector<uint32_t>> unit_keys(mod.merged_units.size());
+  for (size_t unit_idx = 0; unit_idx < mod.merged_units.size(); unit_idx++) {
+    const CUnitEntry *entry = mod.merged_units[unit_idx].entry;
+    for (uint32_t bb_id = 1; bb_id <= entry->num_bbs; bb_id++) {
+      const CBBEntry &bb_entry = entry->bbs[bb_id];
+      const CFuncEntry &func_entry = entry->funcs[bb_entry.func_idx];
+      unit_keys[unit_idx].push_back(
+          bb_map.insert_bb(entry->strtab + func_entry.file_off,
+                           entry->strtab + func_entry.name_off,
+                           entry->strtab + bb_entry.name_off));
+    }
+  }
+  bb_map.assign_ids();
+
+  // bb_ids of the module for now, id_base is added once it is known
+  for (size_t unit_idx = 0; unit_idx < mod.merged_units.size(); unit_idx++) {
+    CUnitEntry *entry = mod.merged_units[unit_idx].entry;
+    for (uint32_t bb_id = 1; bb_id <= entry->num_bbs; bb_id++) {
+      entry->bb_ids[bb_id] = bb_map.get_bb_id(unit_keys[unit_idx][bb_id - 1]);
+    }
+  }
+
+  mod.merged_strtab = bb_map.get_strtab().get_data();
+  for (const GFuncEntry &func_entry : bb_map.get_funcs()) {
+    mod.merged_funcs.push_back(CFuncEntry{func_entry.file_off,
+                                          func_entry.name_off,
+                                          func_entry.first_bb,
+                                          func_entry.num_bbs});
+  }
+  for (const GBBEntry &bb_entry : bb_map.get_bbs()) {
+    mod.merged_bbs.push_back(CBBEntry{bb_entry.func_idx, bb_entry.name_off});
+  }
+
+  // edges are sorted by (src_bb, dst_bb), as in a whole-program module
+  std::map<std::pair<uint32_t, uint32_t>, uint32_t> edge_ids;
+  for (const MergedUnit &unit : mod.merged_units) {
+    const CUnitEntry *entry = unit.entry;
+    for (uint32_t edge_id = 0; edge_id < entry->num_edges; edge_id++) {
+      edge_ids[{entry->bb_ids[entry->edges[edge_id].src_bb],
+                entry->bb_ids[entry->edges[edge_id].dst_bb]}] = 0;
+    }
+  }
+  for (auto &edge : edge_ids) {
+    edge.second = mod.merged_edges.size();
+    mod.merged_edges.push_back(
+        CEdgeEntry{edge.first.first, edge.first.second});
+  }
+
+  uint32_t num_vals = 0;
+  for (MergedUnit &unit : mod.merged_units) {
+    const CUnitEntry *entry = unit.entry;
+    for (uint32_t edge_id = 0; edge_id < entry->num_edges; edge_id++) {
+      unit.edge_ids.push_back(
+          edge_ids[{entry->bb_ids[entry->edges[edge_id].src_bb],
+                    entry->bb_ids[entry->edges[edge_id].dst_bb]}]);
+    }
+
+    // records of a unit only refer to the unit, so they keep their order
+    uint32_t idx = 0;
+    while (idx + 1 < entry->implied_size) {
+      const uint32_t num_srcs = entry->implied[idx + 1];
+      mod.merged_implied.push_back(entry->bb_ids[entry->implied[idx]]);
+      mod.merged_implied.push_back(num_srcs);
+      for (uint32_t src_idx = 0; src_idx < num_srcs; src_idx++) {
+        mod.merged_implied.push_back(
+            entry->bb_ids[entry->implied[idx + 2 + src_idx]]);
+      }
+      idx += 2 + num_srcs;
+    }
+
+    unit.first_val = num_vals;
+    idx = 0;
+    while (idx + 1 < entry->count_solve_size) {
+      mod.merged_count_solve.push_back(unit.first_val +
+                                       entry->count_solve[idx]);
+      const uint32_t num_plus = entry->count_solve[idx + 1];
+      mod.merged_count_solve.push_back(num_plus);
+      idx += 2;
+      for (uint32_t plus_idx = 0; plus_idx < num_plus; plus_idx++, idx++) {
+        mod.merged_count_solve.push_back(unit.first_val +
+                                         entry->count_solve[idx]);
+      }
+
+      const uint32_t num_minus = entry->count_solve[idx];
+      mod.merged_count_solve.push_back(num_minus);
+      idx += 1;
+      for (uint32_t minus_idx = 0; minus_idx < num_minus; minus_idx++, idx++) {
+        mod.merged_count_solve.push_back(unit.first_val +
+                                         entry->count_solve[idx]);
+      }
+    }
+    for (idx = 0; idx + 1 < entry->count_bbs_size; idx += 2) {
+      mod.merged_count_bbs.push_back(entry->bb_ids[entry->count_bbs[idx]]);
+      mod.merged_count_bbs.push_back(unit.first_val +
+                                     entry->count_bbs[idx + 1]);
+    }
+    num_vals += entry->count_arr_size;
+  }
+
+  mod.num_bbs = bb_map.get_num_bbs();
+  mod.cov_bbs = mod.merged_bbs.data();
+  mod.cov_funcs = mod.merged_funcs.data();
+  mod.num_cov_funcs = mod.merged_funcs.size();
+  mod.cov_strtab = mod.merged_strtab.data();
+  mod.cov_edges = mod.merged_edges.data();
+  mod.num_cov_edges = mod.merged_edges.size();
+  mod.merged_edge_arr.assign(std::max<size_t>(mod.merged_edges.size(), 1), 0);
+  mod.edge_arr = mod.merged_edge_arr.data();
+  mod.implied_table = mod.merged_implied.data();
+  mod.implied_size = mod.merged_implied.size();
+  mod.merged_count_arr.assign(std::max<uint32_t>(num_vals, 1), 0);
+  mod.count_arr = mod.merged_count_arr.data();
+  mod.count_arr_size = mod.merged_count_arr.size();
+  mod.count_solve = mod.merged_count_solve.data();
+  mod.count_solve_size = mod.merged_count_solve.size();
+  mod.count_bbs = mod.merged_count_bbs.data();
+  mod.count_bbs_size = mod.merged_count_bbs.size();
+
+  // whole pages, so that the instant runtime can map a file over it
+  const long page_size = sysconf(_SC_PAGESIZE);
+  mod.cov_arr_size = mod.num_bbs + 1;
+  if (page_size > 0) {
+    mod.cov_arr_size =
+        (mod.cov_arr_size + page_size - 1) / page_size * page_size;
+  }
+  void *mapped = mmap(nullptr, mod.cov_arr_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapped == MAP_FAILED) {
+    std::cerr << "[bb_cov] Failed to allocate the coverage array." << std::endl;
+    exit(1);
+  }
+  mod.cov_arr = (char *)mapped;
+
+  // identifies the merged map like the module hash of a whole-program module
+  mod.module_hash =
+      bb_cov_fnv1a_hash(mod.merged_strtab.data(), mod.merged_strtab.size());
+  mod.module_hash = bb_cov_fnv1a_hash(
+      mod.merged_funcs.data(), mod.merged_funcs.size() * sizeof(CFuncEntry),
+      mod.module_hash);
+  mod.module_hash = bb_cov_fnv1a_hash(
+      mod.merged_bbs.data(), mod.merged_bbs.size() * sizeof(CBBEntry),
+      mod.module_hash);
+  mod.module_hash = bb_cov_fnv1a_hash(
+      mod.merged_edges.data(), mod.merged_edges.size() * sizeof(CEdgeEntry),
+      mod.module_hash);
+  mod.module_hash = bb_cov_fnv1a_hash(
+      mod.merged_implied.data(), mod.merged_implied.size() * sizeof(uint32_t),
+      mod.module_hash);
+  mod.module_hash = bb_cov_fnv1a_hash(
+      mod.merged_count_solve.data(),
+      mod.merged_count_solve.size() * sizeof(uint32_t), mod.module_hash);
+  mod.module_hash = bb_cov_fnv1a_hash(
+      mod.merged_count_bbs.data(),
+      mod.merged_count_bbs.size() * sizeof(uint32_t), mod.module_hash);
+
+  if ((uint64_t)next_id_base + mod.num_bbs + 1 > UINT32_MAX) {
+    std::cerr << "[bb_cov] Too many basic blocks in the loaded modules, "
+                 "ignoring "
+              << mod.name << "." << std::endl;
+    for (const MergedUnit &unit : mod.merged_units) {
+      memset(unit.entry->bb_ids, 0,
+             (unit.entry->num_bbs + 1) * sizeof(uint32_t));
+    }
+    return false;
+  }
+
+  mod.id_base = next_id_base;
+  next_id_base += mod.num_bbs + 1;
+  for (const MergedUnit &unit : mod.merged_units) {
+    CUnitEntry *entry = unit.entry;
+    for (uint32_t bb_id = 1; bb_id <= entry->num_bbs; bb_id++) {
+      entry->bb_ids[bb_id] += mod.id_base;
+    }
+  }
+  return true;
+}
+
+// Binds the tables of the executable
+void __bind_tables(CovModule &mod) {
+  if (&__num_bbs == nullptr) {
+    __merge_units(mod);
+    return;
+  }
+
+  if (mod.units_start != mod.units_stop) {
+    std::cerr << "[bb_cov] Found -bbcov-per-tu units next to a whole-program "
+                 "module, ignoring the units."
+              << std::endl;
+  }
+
+  mod.cov_bbs = __bb_cov_bbs;
+  mod.num_bbs = __num_bbs;
+  mod.cov_funcs = __bb_cov_funcs;
+  mod.num_cov_funcs = __num_bb_cov_funcs;
+  mod.cov_strtab = __bb_cov_strtab;
+  mod.module_hash = __bb_cov_module_hash;
+  mod.cov_edges = __bb_cov_edges;
+  mod.num_cov_edges = __num_bb_cov_edges;
+  mod.edge_arr = __bb_cov_edge_arr;
+  mod.implied_table = __bb_cov_implied;
+  mod.implied_size = __bb_cov_implied_size;
+  mod.count_arr = __bb_cov_count_arr;
+  mod.count_arr_size = __bb_cov_count_arr_size;
+  mod.count_solve = __bb_cov_count_solve;
+  mod.count_solve_size = __bb_cov_count_solve_size;
+  mod.count_bbs = __bb_cov_count_bbs;
+  mod.count_bbs_size = __bb_cov_count_bbs_size;
+  mod.cov_arr = __bb_cov_arr;
+  mod.cov_arr_size = __bb_cov_arr_size;
+  next_id_base = mod.num_bbs + 1;
+}
+
+// Copies the arrays of the -bbcov-per-tu units into the merged ones. Hit
+// counts of units sharing a bb_id are added up, saturating.
+// Async-signal-safe.
+static void __gather_units(CovModule &mod) {
+  for (const MergedUnit &unit : mod.merged_units) {
+    const CUnitEntry *entry = unit.entry;
+    for (uint32_t bb_id = 1; bb_id <= entry->num_bbs && is_hitcount; bb_id++) {
+      mod.cov_arr[entry->bb_ids[bb_id] - mod.id_base] = 0;
+    }
+  }
+
+  for (const MergedUnit &unit : mod.merged_units) {
+    const CUnitEntry *entry = unit.entry;
+    for (uint32_t bb_id = 1; bb_id <= entry->num_bbs; bb_id++) {
+      const uint8_t value = entry->cov_arr[bb_id];
+      if (value == 0) {
+        continue;
+      }
+
+      // first hits through __record_bb_cov are in cov_arr already
+      uint8_t &merged_value =
+          (uint8_t &)mod.cov_arr[entry->bb_ids[bb_id] - mod.id_base];
+      if (is_hitcount) {
+        merged_value = std::min<uint32_t>(merged_value + value, 255);
+      } else {
+        merged_value = 1;
+      }
+    }
+
+    for (uint32_t edge_id = 0; edge_id < entry->num_edges; edge_id++) {
+      if (entry->edge_arr[edge_id] != 0) {
+        mod.edge_arr[unit.edge_ids[edge_id]] = 1;
+      }
+    }
+
+    memcpy(mod.count_arr + unit.first_val, entry->count_arr,
+           entry->count_arr_size * sizeof(uint64_t));
+  }
+}
+
+// Clears the arrays of the -bbcov-per-tu units along with the merged ones
+void __reset_units(CovModule &mod) {
+  for (const MergedUnit &unit : mod.merged_units) {
+    const CUnitEntry *entry = unit.entry;
+    memset(entry->cov_arr, 0, entry->num_bbs + 1);
+    memset(entry->edge_arr, 0, std::max<uint32_t>(entry->num_edges, 1));
+    memset(entry->count_arr, 0, entry->count_arr_size * sizeof(uint64_t));
+  }
+}
+
+// Brings cov_arr, edge_arr and count_arr up to date before writing.
+// Async-signal-safe.
+void __collect_cov(CovModule &mod) {
+  __gather_units(mod);
+  __apply_count_table(mod);
+  __apply_implied_cov(mod, mod.cov_arr);
+}
+
+// Sizes the execution counts of a bound module, any runtime derives the
+// coverage of -bbcov-counts builds
+void __init_bb_counts(CovModule &mod) {
+  if (is_counts || mod.count_bbs_size != 0) {
+    mod.bb_counts.assign(mod.num_bbs + 1, 0);
+  }
+}
+
+#pragma clang attribute pop
@@ -1,22 +1,153 @@
 
 #include "bb/bb_cov_pass.hpp"
 
+#include <sys/resource.h>
+
+#include <thread>
+
 #include "utils/hash.hpp"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/Demangle/Demangle.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Linker/Linker.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
 
+#include "llvm/Support/Alignment.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Process.h"
 
 static llvm::cl::opt<bool>
     is_verbose_mode("verbose", llvm::cl::desc("enable verbose output"),
                     llvm::cl::init(false));
 
+static llvm::cl::opt<bool> use_call_probe(
+    "bbcov-call-probe",
+    llvm::cl::desc("call __record_bb_cov on every execution of a basic block "
+                   "instead of the inline first-hit check"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> use_store_probe(
+    "bbcov-store-probe",
+    llvm::cl::desc("mark a basic block covered with a plain store on every "
+                   "execution instead of the inline first-hit check, so the "
+                   "optimizer can hoist or vectorize around it (overrides "
+                   "-bbcov-call-probe)"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> use_hitcount(
+    "bbcov-hitcount",
+    llvm::cl::desc("keep an 8-bit saturating hit count per basic block, "
+                   "link with bb_cov_hitcount_rt.a (overrides "
+                   "-bbcov-call-probe)"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> use_edges(
+    "bbcov-edges",
+    llvm::cl::desc("also record the CFG edges between instrumented basic "
+                   "blocks, critical edges are split"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> use_prune(
+    "bbcov-prune",
+    llvm::cl::desc("skip the probes of basic blocks whose coverage is implied "
+                   "by other basic blocks (dominator and post-dominator "
+                   "pruning), ignored with -bbcov-hitcount"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> use_per_tu(
+    "bbcov-per-tu",
+    llvm::cl::desc("instrument a single translation unit: its tables are "
+                   "registered in the __bb_cov_units section and the runtime "
+                   "assigns the global bb_ids at startup. Also instruments "
+                   "the default pipelines, e.g. with clang -fpass-plugin"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> use_counts(
+    "bbcov-counts",
+    llvm::cl::desc("keep exact 64-bit execution counts with counters on the "
+                   "CFG edges outside a spanning tree, link with "
+                   "bb_cov_counts_rt.a (overrides -bbcov-hitcount, "
+                   "-bbcov-call-probe and -bbcov-prune)"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> use_sancov(
+    "bbcov-sancov",
+    llvm::cl::desc("put the coverage arrays in the __sancov_cntrs section and "
+                   "register them as SanitizerCoverage inline 8-bit counters, "
+                   "so that libFuzzer uses the probes as its feedback "
+                   "(ignored with -bbcov-counts, overrides -bbcov-call-probe)"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<unsigned> num_split(
+    "bbcov-split",
+    llvm::cl::desc("split a whole-program module into N partitions that are "
+                   "instrumented in parallel as -bbcov-per-tu units and "
+                   "linked back, for huge modules"),
+    llvm::cl::init(0));
+
+static llvm::cl::opt<bool> use_time_phases(
+    "bbcov-time-phases",
+    llvm::cl::desc("report the wall time and memory of each phase of the "
+                   "instrumentation"),
+    llvm::cl::init(false));
+
 llvm::PreservedAnalyses BB_COV_Pass::run(llvm::Module &Module,
                                          llvm::ModuleAnalysisManager &MAM) {
+  // e.g. bbcov-O2 with -bbcov-per-tu, whose pipeline instruments already
+  if (Module.getNamedGlobal("__bb_cov_arr") != NULL) {
+    return llvm::PreservedAnalyses::all();
+  }
+
+  if (Module.getFunction("main") == NULL && !use_per_tu) {
+    llvm::errs()
+        << "[bb_cov] main function not found, skipping instrumentation.\n";
+    return llvm::PreservedAnalyses::all();
+  }
+
+  if (use_prune && (use_hitcount || use_counts)) {
+    llvm::errs() << "[bb_cov] Warning: -bbcov-prune is ignored with "
+                    "-bbcov-hitcount and -bbcov-counts, every basic block "
+                    "needs its own count.\n";
+  }
+  if (use_hitcount && use_counts) {
+    llvm::errs() << "[bb_cov] Warning: -bbcov-hitcount is ignored with "
+                    "-bbcov-counts.\n";
+  }
+  if (use_sancov && use_counts) {
+    llvm::errs() << "[bb_cov] Warning: -bbcov-sancov is ignored with "
+                    "-bbcov-counts, which has no probe per basic block.\n";
+  }
+  if (use_sancov && use_call_probe && !use_counts) {
+    llvm::errs() << "[bb_cov] Warning: -bbcov-call-probe is ignored with "
+                    "-bbcov-sancov, the probes have to write the counters.\n";
+  }
+
+  if (num_split > 1 && !use_per_tu) {
+    instrument_split(Module);
+  } else {
+    is_per_tu = use_per_tu;
+    instrument(Module);
+  }
+
+  return llvm::PreservedAnalyses::all();
+}
+
+void BB_COV_Pass::instrument(llvm::Module &Module) {
   Mod_ptr = &Module;
   llvm::LLVMContext &Ctx = Module.getContext();
   Ctxt_ptr = &Ctx;
@@ -24,48 +155,267 @@ llvm::PreservedAnalyses BB_COV_Pass::run(llvm::Module &Module,
   voidTy = llvm::Type::getVoidTy(Ctx);
   int8Ty = llvm::Type::getInt8Ty(Ctx);
   int32Ty = llvm::Type::getInt32Ty(Ctx);
+  int64Ty = llvm::Type::getInt64Ty(Ctx);
   int8PtrTy = llvm::PointerType::get(int8Ty, 0);
   int32PtrTy = llvm::PointerType::get(int32Ty, 0);
 
-  IRB = new llvm::IRBuilder<>(Ctx);
+  // the tables of a translation unit are only reachable through its
+  // __bb_cov_units entry
+  table_linkage = is_per_tu ? llvm::GlobalValue::InternalLinkage
+                            : llvm::GlobalValue::ExternalLinkage;
 
-  llvm::Function *main_func = Module.getFunction("main");
-  if (main_func == NULL) {
-    llvm::errs()
-        << "[bb_cov] main function not found, skipping instrumentation.\n";
-    return llvm::PreservedAnalyses::all();
-  }
+  IRB = new llvm::IRBuilder<>(Ctx);
 
+  begin_phase("collect");
   uint32_t num_instrumented_funcs = insert_bb_probes();
 
-  instrument_main(*main_func);
+  llvm::Function *main_func = Module.getFunction("main");
+  if (main_func != NULL && !main_func->isDeclaration()) {
+    instrument_main(*main_func);
+  }
 
+  begin_phase("tables");
   init_bb_map_rt();
 
-  llvm::GlobalVariable *num_bbs_global = new llvm::GlobalVariable(
-      *Mod_ptr, int32Ty, true, llvm::GlobalValue::ExternalLinkage,
-      llvm::ConstantInt::get(int32Ty, max_bb_id), "__num_bbs");
-
   if (is_verbose_mode) {
-    llvm::outs() << "[bb_cov] Instrumented " << num_instrumented_funcs
-                 << " functions.\n";
+    *out_os << "[bb_cov] Instrumented " << num_instrumented_funcs
+            << " functions.\n";
   }
 
   delete IRB;
-  free_bb_map(file_bb_map);
 
+  begin_phase("verify");
   std::string out;
   llvm::raw_string_ostream output(out);
   bool has_error = llvm::verifyModule(*Mod_ptr, &output);
 
   if (has_error) {
-    llvm::errs() << "IR errors : \n";
-    llvm::errs() << out;
+    *err_os << "IR errors : \n";
+    *err_os << out;
     // Mod_ptr->print(llvm::errs(), nullptr);
     // llvm::errs() << "\n";
   }
+  end_phase();
+  print_phase_times();
+}
 
-  return llvm::PreservedAnalyses::all();
+// Removes everything the partitions of -bbcov-split define from the module
+// they were split from, so that they can be linked back into it
+static void clear_module(llvm::Module &Module) {
+  for (llvm::GlobalValue &GV : Module.global_values()) {
+    GV.dropAllReferences();
+  }
+
+  std::vector<llvm::GlobalValue *> global_values = {};
+  for (llvm::GlobalValue &GV : Module.global_values()) {
+    global_values.push_back(&GV);
+  }
+  for (llvm::GlobalValue *GV : global_values) {
+    GV->removeDeadConstantUsers();
+    GV->eraseFromParent();
+  }
+
+  // the partitions bring their own copies of llvm.dbg.cu, llvm.ident, ...
+  std::vector<llvm::NamedMDNode *> named_mds = {};
+  for (llvm::NamedMDNode &NMD : Module.named_metadata()) {
+    named_mds.push_back(&NMD);
+  }
+  for (llvm::NamedMDNode *NMD : named_mds) {
+    NMD->eraseFromParent();
+  }
+}
+
+// Every partition appends the same entries of the unit registration to
+// llvm.global_ctors and llvm.global_dtors, keep one of each
+static void dedup_global_array(llvm::Module &Module, llvm::StringRef name) {
+  llvm::GlobalVariable *array = Module.getNamedGlobal(name);
+  if (array == NULL || !array->hasInitializer()) {
+    return;
+  }
+
+  llvm::ConstantArray *init =
+      llvm::dyn_cast<llvm::ConstantArray>(array->getInitializer());
+  if (init == NULL) {
+    return;
+  }
+
+  std::vector<llvm::Constant *> entries = {};
+  std::set<llvm::Constant *> seen = {};
+  for (llvm::Use &entry : init->operands()) {
+    llvm::Constant *entry_const = llvm::cast<llvm::Constant>(entry.get());
+    if (seen.insert(entry_const).second) {
+      entries.push_back(entry_const);
+    }
+  }
+  if (entries.size() == init->getNumOperands()) {
+    return;
+  }
+
+  llvm::ArrayType *array_ty =
+      llvm::ArrayType::get(init->getType()->getElementType(), entries.size());
+  llvm::GlobalVariable *new_array = new llvm::GlobalVariable(
+      Module, array_ty, array->isConstant(), array->getLinkage(),
+      llvm::ConstantArray::get(array_ty, entries), "", array);
+  new_array->takeName(array);
+  array->eraseFromParent();
+}
+
+// -bbcov-split: SplitModule externalizes the local symbols so that the
+// partitions can refer to each other's, and each partition is instrumented
+// in its own LLVMContext on its own thread as a -bbcov-per-tu unit. The
+// runtime assigns the bb_ids of the units at startup, so the partitions need
+// no id ranges up front. The instrumented partitions are linked back into
+// the module and its local symbols are made local again.
+void BB_COV_Pass::instrument_split(llvm::Module &Module) {
+  // SplitModule changes the module in place: the local symbols become
+  // hidden external ones and the unnamed symbols get names
+  std::vector<std::pair<llvm::GlobalValue *, llvm::GlobalValue::LinkageTypes>>
+      locals = {};
+  std::vector<llvm::GlobalValue *> unnamed = {};
+  for (llvm::GlobalValue &GV : Module.global_values()) {
+    if (GV.hasLocalLinkage()) {
+      locals.push_back({&GV, GV.getLinkage()});
+    }
+    if (!GV.hasName()) {
+      unnamed.push_back(&GV);
+    }
+  }
+
+  begin_phase("split");
+  std::vector<llvm::SmallVector<char, 0>> part_bitcodes = {};
+  llvm::SplitModule(Module, num_split,
+                    [&](std::unique_ptr<llvm::Module> part) {
+                      part_bitcodes.emplace_back();
+                      llvm::raw_svector_ostream part_os(part_bitcodes.back());
+                      llvm::WriteBitcodeToFile(*part, part_os);
+                    });
+
+  // the partitions keep the names given by SplitModule
+  std::map<std::string, llvm::GlobalValue::LinkageTypes> local_linkages = {};
+  for (const auto &local : locals) {
+    local_linkages[local.first->getName().str()] = local.second;
+  }
+
+  begin_phase("partitions");
+  const size_t num_parts = part_bitcodes.size();
+  std::vector<std::string> part_logs(num_parts);
+  std::vector<char> part_failed(num_parts, 0);
+  std::vector<std::thread> workers = {};
+  for (size_t part_idx = 0; part_idx < num_parts; part_idx++) {
+    workers.emplace_back([&, part_idx]() {
+      llvm::LLVMContext part_ctx;
+      llvm::raw_string_ostream part_log(part_logs[part_idx]);
+      llvm::SmallVector<char, 0> &bitcode = part_bitcodes[part_idx];
+
+      llvm::Expected<std::unique_ptr<llvm::Module>> part =
+          llvm::parseBitcodeFile(
+              llvm::MemoryBufferRef(
+                  llvm::StringRef(bitcode.data(), bitcode.size()),
+                  "bbcov-split"),
+              part_ctx);
+      if (!part) {
+        part_log << "[bb_cov] Failed to read partition " << part_idx << ": "
+                 << llvm::toString(part.takeError()) << "\n";
+        part_failed[part_idx] = 1;
+        return;
+      }
+
+      BB_COV_Pass part_pass;
+      part_pass.is_per_tu = true;
+      part_pass.out_os = &part_log;
+      part_pass.err_os = &part_log;
+      part_pass.instrument(**part);
+
+      bitcode.clear();
+      llvm::raw_svector_ostream part_os(bitcode);
+      llvm::WriteBitcodeToFile(**part, part_os);
+    });
+  }
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+
+  for (size_t part_idx = 0; part_idx < num_parts; part_idx++) {
+    if (part_logs[part_idx] != "") {
+      llvm::errs() << "[bb_cov] Partition " << part_idx << ":\n"
+                   << part_logs[part_idx];
+    }
+  }
+
+  // The module is not cleared until every partition is back, a partition
+  // that is missing would drop its definitions from the output
+  std::vector<std::unique_ptr<llvm::Module>> parts = {};
+  for (size_t part_idx = 0; part_idx < num_parts && !part_failed[part_idx];
+       part_idx++) {
+    const llvm::SmallVector<char, 0> &bitcode = part_bitcodes[part_idx];
+    llvm::Expected<std::unique_ptr<llvm::Module>> part =
+        llvm::parseBitcodeFile(
+            llvm::MemoryBufferRef(
+                llvm::StringRef(bitcode.data(), bitcode.size()),
+                "bbcov-split"),
+            Module.getContext());
+    if (!part) {
+      llvm::errs() << "[bb_cov] Failed to read partition " << part_idx
+                   << ": " << llvm::toString(part.takeError()) << "\n";
+      part_failed[part_idx] = 1;
+      break;
+    }
+    parts.push_back(std::move(*part));
+  }
+
+  if (parts.size() != num_parts) {
+    llvm::errs() << "[bb_cov] Warning: a partition failed, instrumenting the "
+                    "module as a whole.\n";
+    parts.clear();
+    for (const auto &local : locals) {
+      local.first->setVisibility(llvm::GlobalValue::DefaultVisibility);
+      local.first->setLinkage(local.second);
+    }
+    for (llvm::GlobalValue *GV : unnamed) {
+      GV->setName("");
+    }
+    instrument(Module);
+    return;
+  }
+
+  begin_phase("link");
+  clear_module(Module);
+
+  llvm::Linker linker(Module);
+  for (size_t part_idx = 0; part_idx < num_parts; part_idx++) {
+    if (linker.linkInModule(std::move(parts[part_idx]))) {
+      llvm::report_fatal_error("[bb_cov] Failed to link partition " +
+                               llvm::Twine(part_idx) +
+                               " back, the module is incomplete.");
+    }
+  }
+
+  dedup_global_array(Module, "llvm.global_ctors");
+  dedup_global_array(Module, "llvm.global_dtors");
+
+  for (const auto &local_linkage : local_linkages) {
+    llvm::GlobalValue *GV = Module.getNamedValue(local_linkage.first);
+    if (GV == NULL || GV->isDeclaration()) {
+      continue;
+    }
+    GV->setVisibility(llvm::GlobalValue::DefaultVisibility);
+    GV->setLinkage(local_linkage.second);
+  }
+
+  if (is_verbose_mode) {
+    llvm::outs() << "[bb_cov] Instrumented " << num_parts
+                 << " partitions in parallel.\n";
+  }
+
+  begin_phase("verify");
+  std::string out;
+  llvm::raw_string_ostream output(out);
+  if (llvm::verifyModule(Module, &output)) {
+    llvm::errs() << "IR errors : \n";
+    llvm::errs() << out;
+  }
+  end_phase();
+  print_phase_times();
 }
 
 void BB_COV_Pass::instrument_main(llvm::Function &Func) {
@@ -130,12 +480,12 @@ void BB_COV_Pass::instrument_main(llvm::Function &Func) {
 
 uint32_t BB_COV_Pass::insert_bb_probes() {
   uint32_t num_instrumented_funcs = 0;
+  std::vector<llvm::Function *> instrumented_funcs = {};
 
   std::set<llvm::Function *> dtor_funcs = get_dtor_funcs();
   const uint32_t num_dtor_funcs = dtor_funcs.size();
   if ((num_dtor_funcs > 0) && is_verbose_mode) {
-    llvm::outs() << "[bb_cov] Found " << dtor_funcs.size()
-                 << " dtor functions.\n";
+    *out_os << "[bb_cov] Found " << dtor_funcs.size() << " dtor functions.\n";
   }
 
   uint32_t num_func = 0;
@@ -144,8 +494,8 @@ uint32_t BB_COV_Pass::insert_bb_probes() {
   for (llvm::Function &Func : Mod_ptr->functions()) {
     if (dtor_funcs.find(&Func) != dtor_funcs.end()) {
       if (is_verbose_mode) {
-        llvm::outs() << "[bb_cov] Skipping dtor function: " << Func.getName()
-                     << "\n";
+        *out_os << "[bb_cov] Skipping dtor function: " << Func.getName()
+                << "\n";
       }
       continue;
     }
@@ -191,12 +541,86 @@ uint32_t BB_COV_Pass::insert_bb_probes() {
     }
 
     // normal functions under test
-    insert_bb_probe_one_func(Func, filename);
+    const size_t first_probe = bb_probes.size();
+    collect_bbs_one_func(Func, filename, func_name);
+    if (use_prune && !use_hitcount && !use_counts) {
+      prune_bbs_one_func(Func, first_probe);
+    }
+    instrumented_funcs.push_back(&Func);
     num_instrumented_funcs++;
   }
 
+  // bb_ids are assigned after all basic blocks are named, so the basic blocks
+  // of a function get contiguous bb_ids.
+  bb_map.assign_ids();
+
+  build_implied_table();
+
+  begin_phase("probes");
+  std::vector<std::pair<llvm::BasicBlock *, llvm::BasicBlock *>> ir_edges =
+      {};
+  if (use_edges) {
+    ir_edges = collect_edges();
+  }
+
+  init_bb_cov_arr();
+  if (use_sancov && !use_counts) {
+    insert_sancov_registration();
+  }
+
+  // before the block probes, which split blocks
+  if (use_edges) {
+    insert_edge_probes(ir_edges);
+  }
+
+  // after the edge probes, the flow graph includes the blocks they add
+  if (use_counts) {
+    for (llvm::Function *Func : instrumented_funcs) {
+      build_count_graph(*Func);
+    }
+  }
+  insert_count_probes();
+
+  llvm::FunctionCallee record_bb =
+      Mod_ptr->getOrInsertFunction("__record_bb_cov", voidTy, int32Ty);
+  // it never unwinds, so calls to it need no landing pads
+  llvm::Function *record_bb_func =
+      llvm::dyn_cast<llvm::Function>(record_bb.getCallee());
+  if (record_bb_func != NULL) {
+    record_bb_func->addFnAttr(llvm::Attribute::NoUnwind);
+  }
+
+  for (const auto &bb_probe : bb_probes) {
+    llvm::BasicBlock *BB = bb_probe.first;
+    const uint32_t BB_id = bb_map.get_bb_id(bb_probe.second);
+
+    // covered through __bb_cov_implied, or counted through __bb_cov_count_arr
+    if (use_counts || implied_bbs.find(BB) != implied_bbs.end()) {
+      continue;
+    }
+
+    auto first_inst = BB->getFirstNonPHIOrDbgOrLifetime();
+    llvm::Instruction *first_instr =
+        llvm::dyn_cast<llvm::Instruction>(first_inst);
+
+    if (use_hitcount) {
+      insert_hitcount_probe(first_instr, BB_id);
+    } else if (use_store_probe) {
+      insert_store_probe(first_instr, BB_id);
+    } else if (use_call_probe && !use_sancov) {
+      IRB->SetInsertPoint(first_instr);
+      IRB->CreateCall(record_bb, {get_global_bb_id(BB_id)});
+    } else {
+      insert_inline_probe(first_instr, BB_id, record_bb);
+    }
+  }
+
+  for (llvm::Function *Func : instrumented_funcs) {
+    insert_cov_fini_before_exit(*Func);
+  }
+
   if ((num_no_subprogram / (float)num_func) > 0.7) {
-    llvm::errs()
+    *err_os
         << "[bb_cov] Warning: " << num_no_subprogram << " / " << num_func
         << " (" << (num_no_subprogram / (float)num_func) * 100
         << "%) of functions have no debug info. "
@@ -206,23 +630,19 @@ uint32_t BB_COV_Pass::insert_bb_probes() {
   return num_instrumented_funcs;
 }
 
-void BB_COV_Pass::insert_bb_probe_one_func(llvm::Function &Func,
-                                           const std::string &filename) {
-  std::string func_name = llvm::demangle(Func.getName().str());
+void BB_COV_Pass::collect_bbs_one_func(llvm::Function &Func,
+                                       const std::string &filename,
+                                       const std::string &demangled_name) {
+  std::string func_name = demangled_name;
   if (func_name.find(".") != std::string::npos) {
     func_name = func_name.substr(0, func_name.find("."));
   }
 
-  llvm::GlobalVariable *filename_const = gen_new_string_constant(filename);
-  llvm::GlobalVariable *func_name_const = gen_new_string_constant(func_name);
-
-  GFuncEntry *func_entry = insert_FileFuncEntry(
-      file_bb_map, filename, filename_const, func_name, func_name_const);
-
-  std::map<std::string, uint32_t> bb_name_count = {};
-
-  llvm::FunctionCallee record_bb = Mod_ptr->getOrInsertFunction(
-      "__record_bb_cov", voidTy, int8PtrTy, int8PtrTy, int8PtrTy, int32Ty);
+  // Names are counted per inlined frame, so every inlined copy of a source
+  // basic block gets the same name and shares its bb_id.
+  std::map<std::pair<llvm::DISubprogram *, llvm::DILocation *>,
+           std::map<std::string, uint32_t>>
+      frame_name_counts = {};
 
   for (llvm::BasicBlock &BB : Func) {
     auto first_inst = BB.getFirstNonPHIOrDbgOrLifetime();
@@ -237,51 +657,53 @@ void BB_COV_Pass::insert_bb_probe_one_func(llvm::Function &Func,
       continue;
     }
 
+    std::string BB_filename = filename;
+    std::string BB_func_name = func_name;
     std::string BB_name = BB.getName().str();
-    uint32_t BB_id = 0;
 
-    // groovy assigns unique *numeric* BB names; when present, reuse the number
-    // directly as the BB id. Otherwise (empty or textual name such as "entry")
-    // assign a fresh id from the running counter. Calling std::stoi on a
-    // non-numeric name throws std::invalid_argument, so guard it explicitly.
-    const bool is_numeric_name =
-        !BB_name.empty() &&
-        BB_name.find_first_not_of("0123456789") == std::string::npos;
+    if (BB_name == "") {
+      // No name in the IR: derive a readable name from line numbers, under
+      // the source function the basic block comes from.
+      const llvm::DILocation *frame = get_bb_frame(BB);
+      std::pair<llvm::DISubprogram *, llvm::DILocation *> frame_key = {
+          Func.getSubprogram(), NULL};
+      if (frame != NULL) {
+        frame_key = {frame->getScope()->getSubprogram(),
+                     frame->getInlinedAt()};
+      }
 
-    if (is_numeric_name) {
-      BB_id = std::stoi(BB_name);
-    }
+      if (frame_key.first != Func.getSubprogram() ||
+          frame_key.second != NULL) {
+        BB_filename = get_frame_filename(frame);
+        BB_func_name = get_frame_func_name(frame);
+      }
+
+      std::map<std::string, uint32_t> &bb_name_count =
+          frame_name_counts[frame_key];
 
-    if (BB_name == "") {
-      // No name in the IR: derive a readable name from line numbers.
       uint32_t begin_line_num = -1;
       uint32_t end_line_num = 0;
       for (llvm::Instruction &IN : BB) {
-        const llvm::DebugLoc &debugInfo = IN.getDebugLoc();
-        if (!debugInfo) {
-          continue;
+        if (frame == NULL) {
+          break;
         }
 
-        llvm::MDNode *scope = debugInfo.getScope();
-        if (scope == NULL) {
+        if (llvm::isa<llvm::DbgInfoIntrinsic>(IN)) {
           continue;
         }
 
-        llvm::DISubprogram *subprogram =
-            llvm::dyn_cast<llvm::DISubprogram>(scope);
-        if (subprogram == NULL) {
-          continue;
+        // code inlined into the frame counts as the line of its call site
+        const llvm::DILocation *loc = IN.getDebugLoc().get();
+        while (loc != NULL &&
+               (loc->getScope()->getSubprogram() != frame_key.first ||
+                loc->getInlinedAt() != frame_key.second)) {
+          loc = loc->getInlinedAt();
         }
-
-        if (subprogram->getTargetFuncName() != func_name) {
-          llvm::errs() << "[bb_cov] Warning: Debug info function name ("
-                       << subprogram->getTargetFuncName().str()
-                       << ") does not match actual function name (" << func_name
-                       << "). The bitcode seems built with optimization.\n";
+        if (loc == NULL) {
           continue;
         }
 
-        const uint32_t line_num = debugInfo.getLine();
+        const uint32_t line_num = loc->getLine();
         if (line_num == 0) {
           continue;
         }
@@ -310,20 +732,255 @@ void BB_COV_Pass::insert_bb_probe_one_func(llvm::Function &Func,
       }
     }
 
-    BB_id = bb_id++;
+    const uint32_t key = bb_map.insert_bb(BB_filename, BB_func_name, BB_name);
+    bb_probes.push_back(std::make_pair(&BB, key));
+  }
+  return;
+}
+
+// Picks the inlined frame a basic block is reported under: the innermost
+// frame of its first instruction with a line number, or the closest caller
+// outside of /usr if that is library code. NULL if no instruction has one.
+const llvm::DILocation *BB_COV_Pass::get_bb_frame(llvm::BasicBlock &BB) {
+  for (llvm::Instruction &IN : BB) {
+    if (llvm::isa<llvm::DbgInfoIntrinsic>(IN)) {
+      continue;
+    }
+
+    const llvm::DILocation *loc = IN.getDebugLoc().get();
+    if (loc == NULL || loc->getLine() == 0) {
+      continue;
+    }
+
+    while (loc->getInlinedAt() != NULL &&
+           get_frame_filename(loc).find("/usr") != std::string::npos) {
+      loc = loc->getInlinedAt();
+    }
+    return loc;
+  }
+  return NULL;
+}
+
+std::string BB_COV_Pass::get_frame_filename(const llvm::DILocation *frame) {
+  const llvm::DISubprogram *subp = frame->getScope()->getSubprogram();
+  const llvm::StringRef dirname = subp->getDirectory();
+  std::string filename = subp->getFilename().str();
+
+  if (dirname != "") {
+    filename = std::string(dirname) + "/" + filename;
+  }
+  return filename;
+}
+
+// Same name as the function would get if it was not inlined
+std::string BB_COV_Pass::get_frame_func_name(const llvm::DILocation *frame) {
+  const llvm::DISubprogram *subp = frame->getScope()->getSubprogram();
+  llvm::StringRef name = subp->getLinkageName();
+  if (name == "") {
+    name = subp->getName();
+  }
+
+  std::string func_name = llvm::demangle(name.str());
+  if (func_name.find(".") != std::string::npos) {
+    func_name = func_name.substr(0, func_name.find("."));
+  }
+  return func_name;
+}
+
+// Calls may exit, longjmp or unwind, so a basic block with one can be left
+// before its terminator
+bool BB_COV_Pass::may_not_return(llvm::BasicBlock &BB) {
+  for (llvm::Instruction &IN : BB) {
+    llvm::CallBase *call = llvm::dyn_cast<llvm::CallBase>(&IN);
+    if (call == NULL) {
+      continue;
+    }
+
+    if (call->doesNotReturn()) {
+      return true;
+    }
+
+    if (llvm::isa<llvm::IntrinsicInst>(call) ||
+        call->hasFnAttr(llvm::Attribute::WillReturn)) {
+      continue;
+    }
+    return true;
+  }
+  return false;
+}
+
+// Picks the basic blocks of Func that need no probe, as SanitizerCoverage
+// does:
+//  - a full dominator (it dominates all of its successors) is covered if any
+//    of its successors is, as long as it can not be left before its
+//    terminator.
+//  - a full post-dominator with multiple predecessors is covered if any of
+//    its predecessors is, as long as no basic block of Func can be left
+//    before its terminator.
+// The entry block always keeps its probe.
+void BB_COV_Pass::prune_bbs_one_func(llvm::Function &Func,
+                                     size_t first_probe) {
+  std::set<llvm::BasicBlock *> func_bbs = {};
+  bool func_may_not_return = false;
+  for (size_t idx = first_probe; idx < bb_probes.size(); idx++) {
+    func_bbs.insert(bb_probes[idx].first);
+    func_may_not_return |= may_not_return(*bb_probes[idx].first);
+  }
+
+  llvm::DominatorTree DT(Func);
+  llvm::PostDominatorTree PDT(Func);
+
+  // implied basic block -> basic blocks it is inferred from
+  std::map<llvm::BasicBlock *, std::vector<llvm::BasicBlock *>> func_implied =
+      {};
+
+  // whether the coverage of from is inferred from to, directly or not
+  auto is_inferred_from = [&](llvm::BasicBlock *from, llvm::BasicBlock *to) {
+    std::vector<llvm::BasicBlock *> stack = {from};
+    std::set<llvm::BasicBlock *> visited = {};
+    while (!stack.empty()) {
+      llvm::BasicBlock *cur = stack.back();
+      stack.pop_back();
+      if (cur == to) {
+        return true;
+      }
+
+      auto search = func_implied.find(cur);
+      if (search == func_implied.end() || !visited.insert(cur).second) {
+        continue;
+      }
+      stack.insert(stack.end(), search->second.begin(), search->second.end());
+    }
+    return false;
+  };
+
+  for (size_t idx = first_probe; idx < bb_probes.size(); idx++) {
+    llvm::BasicBlock *BB = bb_probes[idx].first;
+    if (BB == &Func.getEntryBlock() || may_not_return(*BB)) {
+      continue;
+    }
+
+    // in CFG order, the table must not depend on pointer values
+    std::vector<llvm::BasicBlock *> succs = {};
+    for (llvm::BasicBlock *succ : llvm::successors(BB)) {
+      if (std::find(succs.begin(), succs.end(), succ) == succs.end()) {
+        succs.push_back(succ);
+      }
+    }
+    bool is_full_dominator = !succs.empty();
+    for (llvm::BasicBlock *succ : succs) {
+      if (succ == BB || func_bbs.find(succ) == func_bbs.end() ||
+          !DT.dominates(BB, succ)) {
+        is_full_dominator = false;
+        break;
+      }
+    }
+
+    std::vector<llvm::BasicBlock *> preds = {};
+    for (llvm::BasicBlock *pred : llvm::predecessors(BB)) {
+      if (std::find(preds.begin(), preds.end(), pred) == preds.end()) {
+        preds.push_back(pred);
+      }
+    }
+    bool is_full_post_dominator =
+        !func_may_not_return && BB->getSinglePredecessor() == NULL &&
+        !preds.empty();
+    for (llvm::BasicBlock *pred : preds) {
+      if (pred == BB || func_bbs.find(pred) == func_bbs.end() ||
+          !PDT.dominates(BB, pred)) {
+        is_full_post_dominator = false;
+        break;
+      }
+    }
+
+    std::vector<llvm::BasicBlock *> srcs = {};
+    if (is_full_dominator) {
+      srcs.assign(succs.begin(), succs.end());
+    } else if (is_full_post_dominator) {
+      srcs.assign(preds.begin(), preds.end());
+    } else {
+      continue;
+    }
+
+    // basic blocks pruned earlier may be inferred from this one
+    bool has_cycle = false;
+    for (llvm::BasicBlock *src : srcs) {
+      has_cycle |= is_inferred_from(src, BB);
+    }
+    if (has_cycle) {
+      continue;
+    }
+
+    func_implied[BB] = srcs;
+  }
 
-    IRB->SetInsertPoint(first_instr);
-    llvm::GlobalVariable *bb_name_const = gen_new_string_constant(BB_name);
-    IRB->CreateCall(record_bb, {filename_const, func_name_const, bb_name_const,
-                                llvm::ConstantInt::get(int32Ty, BB_id)});
+  implied_bbs.insert(func_implied.begin(), func_implied.end());
+  return;
+}
 
-    if (max_bb_id < BB_id) {
-      max_bb_id = BB_id;
+void BB_COV_Pass::build_implied_table() {
+  std::map<llvm::BasicBlock *, uint32_t> bb_ids = {};
+  std::map<uint32_t, uint32_t> id_counts = {};
+  for (const auto &bb_probe : bb_probes) {
+    const uint32_t BB_id = bb_map.get_bb_id(bb_probe.second);
+    bb_ids[bb_probe.first] = BB_id;
+    id_counts[BB_id]++;
+  }
+
+  // Basic blocks sharing a bb_id (e.g. f and f.part) are covered by each
+  // other, so neither the implied basic block nor its sources may share one.
+  for (auto it = implied_bbs.begin(); it != implied_bbs.end();) {
+    bool is_shared = id_counts[bb_ids[it->first]] > 1;
+    for (llvm::BasicBlock *src : it->second) {
+      is_shared |= id_counts[bb_ids[src]] > 1;
     }
+    it = is_shared ? implied_bbs.erase(it) : std::next(it);
+  }
+
+  // sources before the basic blocks inferred from them
+  std::set<llvm::BasicBlock *> emitted = {};
+  for (const auto &bb_probe : bb_probes) {
+    std::vector<std::pair<llvm::BasicBlock *, bool>> stack = {
+        {bb_probe.first, false}};
+    while (!stack.empty()) {
+      auto [BB, is_expanded] = stack.back();
+      stack.pop_back();
+
+      if (emitted.find(BB) != emitted.end()) {
+        continue;
+      }
+
+      auto search = implied_bbs.find(BB);
+      if (search == implied_bbs.end()) {
+        continue;
+      }
 
-    insert_BBEntry(func_entry, BB_name, bb_name_const);
+      if (!is_expanded) {
+        stack.push_back({BB, true});
+        for (auto src = search->second.rbegin(); src != search->second.rend();
+             src++) {
+          stack.push_back({*src, false});
+        }
+        continue;
+      }
+
+      emitted.insert(BB);
+      implied_table.push_back(bb_ids[BB]);
+      implied_table.push_back(search->second.size());
+      for (llvm::BasicBlock *src : search->second) {
+        implied_table.push_back(bb_ids[src]);
+      }
+    }
   }
 
+  if (is_verbose_mode && use_prune) {
+    *out_os << "[bb_cov] Pruned the probes of " << implied_bbs.size()
+            << " of " << bb_probes.size() << " basic blocks.\n";
+  }
+  return;
+}
+
+void BB_COV_Pass::insert_cov_fini_before_exit(llvm::Function &Func) {
   llvm::FunctionCallee cov_fini =
       Mod_ptr->getOrInsertFunction("__cov_fini", voidTy);
 
@@ -340,8 +997,11 @@ void BB_COV_Pass::insert_bb_probe_one_func(llvm::Function &Func,
         continue;
       }
 
+      // abort, quick_exit and fatal signals are left to the runtime's
+      // emergency writer
       std::string called_func_name = called_func->getName().str();
-      if (called_func_name != "exit") {
+      if (called_func_name != "exit" && called_func_name != "_exit" &&
+          called_func_name != "_Exit") {
         continue;
       }
       IRB->SetInsertPoint(call_inst);
@@ -351,204 +1011,893 @@ void BB_COV_Pass::insert_bb_probe_one_func(llvm::Function &Func,
   return;
 }
 
-llvm::GlobalVariable *BB_COV_Pass::gen_cfile_entry(GFileEntry *file_entry) {
-  const uint32_t hash_map_size = sizeof(unsigned char) * 256;
-  llvm::PointerType *cfileEntryPtrTy = llvm::PointerType::get(cfileEntryTy, 0);
-  llvm::Constant *cfileEntry_null =
-      llvm::ConstantPointerNull::get(cfileEntryPtrTy);
+void BB_COV_Pass::insert_inline_probe(llvm::Instruction *insert_pt,
+                                      uint32_t BB_id,
+                                      llvm::FunctionCallee record_bb) {
+  // if (__bb_cov_arr[BB_id] == 0) __record_bb_cov(BB_id);
+  IRB->SetInsertPoint(insert_pt);
+  llvm::Value *cov_ptr =
+      IRB->CreateConstInBoundsGEP1_32(int8Ty, bb_cov_arr_global, BB_id);
+  llvm::Value *cov_val = IRB->CreateLoad(int8Ty, cov_ptr);
+  llvm::Value *is_first_hit =
+      IRB->CreateICmpEQ(cov_val, llvm::ConstantInt::get(int8Ty, 0));
+
+  llvm::MDBuilder MDB(*Ctxt_ptr);
+  llvm::Instruction *then_term = llvm::SplitBlockAndInsertIfThen(
+      is_first_hit, insert_pt, false, MDB.createBranchWeights(1, 1 << 20));
+
+  // taken once per basic block, keep it out of the hot path
+  IRB->SetInsertPoint(then_term);
+  if (is_per_tu || use_sancov) {
+    // __record_bb_cov marks the global bb_id, not the byte of the unit. With
+    // -bbcov-sancov, libFuzzer reads the byte even when the runtime was never
+    // set up by __handle_init.
+    IRB->CreateStore(llvm::ConstantInt::get(int8Ty, 1), cov_ptr);
+  }
+  llvm::CallInst *call = IRB->CreateCall(record_bb, {get_global_bb_id(BB_id)});
+  call->addFnAttr(llvm::Attribute::Cold);
+  then_term->setMetadata("is_probe", llvm::MDNode::get(*Ctxt_ptr, {}));
+  return;
+}
+
+// bb_id for __record_bb_cov. Units of -bbcov-per-tu get theirs from the
+// runtime at startup.
+llvm::Value *BB_COV_Pass::get_global_bb_id(uint32_t BB_id) {
+  if (!is_per_tu) {
+    return llvm::ConstantInt::get(int32Ty, BB_id);
+  }
 
-  llvm::PointerType *cfuncEntryPtrTy = llvm::PointerType::get(cfuncEntryTy, 0);
-  llvm::Constant *cfuncEntry_null =
-      llvm::ConstantPointerNull::get(cfuncEntryPtrTy);
+  llvm::Value *id_ptr =
+      IRB->CreateConstInBoundsGEP1_32(int32Ty, bb_ids_global, BB_id);
+  return IRB->CreateLoad(int32Ty, id_ptr);
+}
 
-  llvm::ArrayType *cfuncEntryPtrArrayTy =
-      llvm::ArrayType::get(cfuncEntryPtrTy, hash_map_size);
+void BB_COV_Pass::insert_store_probe(llvm::Instruction *insert_pt,
+                                     uint32_t BB_id) {
+  // __bb_cov_arr[BB_id] = 1;
+  IRB->SetInsertPoint(insert_pt);
+  llvm::Value *cov_ptr =
+      IRB->CreateConstInBoundsGEP1_32(int8Ty, bb_cov_arr_global, BB_id);
+  IRB->CreateStore(llvm::ConstantInt::get(int8Ty, 1), cov_ptr);
+  return;
+}
 
-  std::vector<GFileEntry *> cur_file_entries = {};
-  while (file_entry != NULL) {
-    cur_file_entries.push_back(file_entry);
-    file_entry = file_entry->next;
+std::vector<std::pair<llvm::BasicBlock *, llvm::BasicBlock *>>
+BB_COV_Pass::collect_edges() {
+  std::map<llvm::BasicBlock *, uint32_t> bb_ids = {};
+  for (const auto &bb_probe : bb_probes) {
+    bb_ids[bb_probe.first] = bb_map.get_bb_id(bb_probe.second);
   }
 
-  std::reverse(cur_file_entries.begin(), cur_file_entries.end());
+  std::vector<std::pair<llvm::BasicBlock *, llvm::BasicBlock *>> ir_edges =
+      {};
+  std::set<std::pair<uint32_t, uint32_t>> edge_set = {};
 
-  llvm::GlobalVariable *prev_file_entry = NULL;
-  for (GFileEntry *file_entry : cur_file_entries) {
-    std::vector<llvm::Constant *> cfunc_entries = {};
+  for (const auto &bb_probe : bb_probes) {
+    llvm::BasicBlock *BB = bb_probe.first;
 
-    for (size_t func_idx = 0; func_idx < hash_map_size; func_idx++) {
-      GFuncEntry *func_entry = file_entry->funcs[func_idx];
-      if (func_entry == NULL) {
-        cfunc_entries.push_back(cfuncEntry_null);
+    // identical edges, e.g. switch cases with the same destination, are one
+    std::set<llvm::BasicBlock *> succs = {};
+    for (llvm::BasicBlock *succ : llvm::successors(BB)) {
+      if (!succs.insert(succ).second) {
         continue;
       }
-      llvm::GlobalVariable *new_cfunc_entry = gen_cfunc_entry(func_entry);
-      cfunc_entries.push_back(new_cfunc_entry);
+
+      // landing pads are not instrumented
+      auto search = bb_ids.find(succ);
+      if (search == bb_ids.end()) {
+        continue;
+      }
+
+      // the basic blocks of inlined code may be reported under another
+      // function, and edges are listed per function
+      const std::vector<GBBEntry> &bbs = bb_map.get_bbs();
+      if (bbs[bb_ids[BB]].func_idx != bbs[search->second].func_idx) {
+        continue;
+      }
+
+      ir_edges.push_back({BB, succ});
+      edge_set.insert({bb_ids[BB], search->second});
     }
+  }
+
+  // sorted by src bb_id, so the edges of a function are contiguous. Edges of
+  // basic blocks sharing bb_ids share edge ids too.
+  edges.assign(edge_set.begin(), edge_set.end());
+  for (uint32_t edge_id = 0; edge_id < edges.size(); edge_id++) {
+    edge_ids[edges[edge_id]] = edge_id;
+  }
+
+  return ir_edges;
+}
+
+void BB_COV_Pass::insert_edge_probes(
+    const std::vector<std::pair<llvm::BasicBlock *, llvm::BasicBlock *>>
+        &ir_edges) {
+  std::map<llvm::BasicBlock *, uint32_t> bb_ids = {};
+  for (const auto &bb_probe : bb_probes) {
+    bb_ids[bb_probe.first] = bb_map.get_bb_id(bb_probe.second);
+  }
+
+  // All critical edges are split before any probe splits a block, then the
+  // probes at the end of blocks go in before the probes at the start.
+  std::vector<std::pair<llvm::Instruction *, uint32_t>> end_probes = {};
+  std::vector<std::pair<llvm::BasicBlock *, uint32_t>> start_probes = {};
+  uint32_t num_unsplittable = 0;
 
-    llvm::Constant *cfuncs_val =
-        llvm::ConstantArray::get(cfuncEntryPtrArrayTy, cfunc_entries);
+  for (const auto &ir_edge : ir_edges) {
+    llvm::BasicBlock *src = ir_edge.first;
+    llvm::BasicBlock *dst = ir_edge.second;
+    const uint32_t edge_id = edge_ids[{bb_ids[src], bb_ids[dst]}];
 
-    llvm::Constant *prev_val = cfileEntry_null;
-    if (prev_file_entry != NULL) {
-      prev_val = prev_file_entry;
+    if (src->getUniqueSuccessor() == dst) {
+      end_probes.push_back({src->getTerminator(), edge_id});
+      continue;
     }
 
-    llvm::Constant *new_cfile_val = llvm::ConstantStruct::get(
-        cfileEntryTy, {cfuncs_val, file_entry->file_gvar, prev_val});
+    if (dst->getUniquePredecessor() == src) {
+      start_probes.push_back({dst, edge_id});
+      continue;
+    }
 
-    llvm::GlobalVariable *new_cfile_entry = new llvm::GlobalVariable(
-        *Mod_ptr, cfileEntryTy, false, llvm::GlobalValue::PrivateLinkage,
-        new_cfile_val);
-    prev_file_entry = new_cfile_entry;
+    llvm::Instruction *term = src->getTerminator();
+    uint32_t succ_idx = 0;
+    while (term->getSuccessor(succ_idx) != dst) {
+      succ_idx++;
+    }
+
+    llvm::BasicBlock *edge_BB = llvm::SplitCriticalEdge(
+        term, succ_idx,
+        llvm::CriticalEdgeSplittingOptions().setMergeIdenticalEdges());
+    if (edge_BB == NULL) {
+      // e.g. indirectbr, the edge stays without a probe
+      num_unsplittable++;
+      continue;
+    }
+
+    edge_BB->getTerminator()->setMetadata("is_probe",
+                                          llvm::MDNode::get(*Ctxt_ptr, {}));
+    end_probes.push_back({edge_BB->getTerminator(), edge_id});
+  }
+
+  for (const auto &end_probe : end_probes) {
+    insert_edge_probe(end_probe.first, end_probe.second);
+  }
+
+  for (const auto &start_probe : start_probes) {
+    auto first_inst = start_probe.first->getFirstNonPHIOrDbgOrLifetime();
+    insert_edge_probe(llvm::dyn_cast<llvm::Instruction>(first_inst),
+                      start_probe.second);
+  }
+
+  if (num_unsplittable != 0) {
+    *err_os << "[bb_cov] Warning: " << num_unsplittable
+            << " critical edges can not be split and are not recorded.\n";
   }
-  return prev_file_entry;
 }
 
-llvm::GlobalVariable *BB_COV_Pass::gen_cfunc_entry(GFuncEntry *func_entry) {
-  const uint32_t hash_map_size = sizeof(unsigned char) * 256;
+void BB_COV_Pass::insert_edge_probe(llvm::Instruction *insert_pt,
+                                    uint32_t edge_id) {
+  // if (__bb_cov_edge_arr[edge_id] == 0) __bb_cov_edge_arr[edge_id] = 1;
+  IRB->SetInsertPoint(insert_pt);
+  llvm::Value *cov_ptr =
+      IRB->CreateConstInBoundsGEP1_32(int8Ty, edge_cov_arr_global, edge_id);
+  llvm::Value *cov_val = IRB->CreateLoad(int8Ty, cov_ptr);
+  llvm::Value *is_first_hit =
+      IRB->CreateICmpEQ(cov_val, llvm::ConstantInt::get(int8Ty, 0));
+
+  llvm::MDBuilder MDB(*Ctxt_ptr);
+  llvm::Instruction *then_term = llvm::SplitBlockAndInsertIfThen(
+      is_first_hit, insert_pt, false, MDB.createBranchWeights(1, 1 << 20));
+
+  IRB->SetInsertPoint(then_term);
+  IRB->CreateStore(llvm::ConstantInt::get(int8Ty, 1), cov_ptr);
+  then_term->setMetadata("is_probe", llvm::MDNode::get(*Ctxt_ptr, {}));
+  return;
+}
 
-  llvm::PointerType *cfuncEntryPtrTy = llvm::PointerType::get(cfuncEntryTy, 0);
-  llvm::Constant *cfuncEntry_null =
-      llvm::ConstantPointerNull::get(cfuncEntryPtrTy);
+void BB_COV_Pass::insert_hitcount_probe(llvm::Instruction *insert_pt,
+                                        uint32_t BB_id) {
+  // __bb_cov_arr[BB_id] += (__bb_cov_arr[BB_id] != 255);
+  IRB->SetInsertPoint(insert_pt);
+  llvm::Value *cov_ptr =
+      IRB->CreateConstInBoundsGEP1_32(int8Ty, bb_cov_arr_global, BB_id);
+  llvm::Value *cov_val = IRB->CreateLoad(int8Ty, cov_ptr);
+  llvm::Value *not_saturated =
+      IRB->CreateICmpNE(cov_val, llvm::ConstantInt::get(int8Ty, 255));
+  llvm::Value *new_val =
+      IRB->CreateAdd(cov_val, IRB->CreateZExt(not_saturated, int8Ty));
+  IRB->CreateStore(new_val, cov_ptr);
+  return;
+}
+
+// Builds the flow graph of Func and picks a maximum spanning tree of it
+// (Knuth, Ball and Larus): only the edges outside the tree get a counter, and
+// the counts of the tree edges follow from flow conservation at every node.
+// Edges in deeper loops are preferred for the tree, since they run more
+// often, and so are edges that would have to be split for a counter.
+void BB_COV_Pass::build_count_graph(llvm::Function &Func) {
+  CountGraph graph;
+  graph.Func = &Func;
+  graph.is_solvable = true;
+
+  std::map<llvm::BasicBlock *, uint32_t> bb_indices = {};
+  for (llvm::BasicBlock &BB : Func) {
+    const uint32_t idx = bb_indices.size();
+    bb_indices[&BB] = idx;
+  }
+  const uint32_t exit_node = bb_indices.size() * 2;
+  graph.num_nodes = exit_node + 1;
+
+  llvm::DominatorTree DT(Func);
+  llvm::LoopInfo LI(DT);
+
+  auto first_insert_pt = [](llvm::BasicBlock *BB) -> llvm::Instruction * {
+    // after the PHIs and landingpad, NULL for e.g. catchswitch blocks
+    auto insert_pt = BB->getFirstInsertionPt();
+    return insert_pt == BB->end() ? NULL : &*insert_pt;
+  };
+
+  auto add_edge = [&](uint32_t src, uint32_t dst, CountEdgeKind kind,
+                      llvm::BasicBlock *BB, llvm::BasicBlock *succ,
+                      llvm::Instruction *insert_pt, bool is_countable,
+                      uint32_t loop_depth) {
+    graph.edges.push_back({src, dst, kind, BB, succ, insert_pt, is_countable,
+                           loop_depth, false, 0});
+  };
+
+  llvm::BasicBlock *entry_BB = &Func.getEntryBlock();
+  llvm::Instruction *entry_pt = first_insert_pt(entry_BB);
+  add_edge(exit_node, bb_indices[entry_BB] * 2, COUNT_EDGE_ENTRY, entry_BB,
+           NULL, entry_pt, entry_pt != NULL, 0);
+
+  for (llvm::BasicBlock &BB : Func) {
+    const uint32_t in_node = bb_indices[&BB] * 2;
+    const uint32_t out_node = in_node + 1;
+    const uint32_t depth = LI.getLoopDepth(&BB);
+    llvm::Instruction *term = BB.getTerminator();
+
+    graph.bb_edges[&BB] = graph.edges.size();
+    llvm::Instruction *bb_pt = first_insert_pt(&BB);
+    add_edge(in_node, out_node, COUNT_EDGE_BB, &BB, NULL, bb_pt,
+             bb_pt != NULL, depth);
+
+    // identical edges, e.g. switch cases with the same destination, are one
+    std::set<llvm::BasicBlock *> succs = {};
+    for (llvm::BasicBlock *succ : llvm::successors(&BB)) {
+      if (!succs.insert(succ).second) {
+        continue;
+      }
 
-  llvm::PointerType *cbbEntryPtrTy = llvm::PointerType::get(cbbEntryTy, 0);
-  llvm::Constant *cbbEntry_null = llvm::ConstantPointerNull::get(cbbEntryPtrTy);
+      const uint32_t edge_depth = std::min(depth, LI.getLoopDepth(succ));
+      const uint32_t succ_node = bb_indices[succ] * 2;
 
-  llvm::ArrayType *cbbEntryPtrArrayTy =
-      llvm::ArrayType::get(cbbEntryPtrTy, hash_map_size);
+      if (BB.getUniqueSuccessor() == succ) {
+        add_edge(out_node, succ_node, COUNT_EDGE_CFG, &BB, succ, term, true,
+                 edge_depth);
+      } else if (succ->getUniquePredecessor() == &BB &&
+                 first_insert_pt(succ) != NULL) {
+        add_edge(out_node, succ_node, COUNT_EDGE_CFG, &BB, succ,
+                 first_insert_pt(succ), true, edge_depth);
+      } else {
+        // critical edge, landing pads and indirectbr can not be split
+        const bool is_splittable =
+            !succ->isEHPad() &&
+            (llvm::isa<llvm::BranchInst>(term) ||
+             llvm::isa<llvm::SwitchInst>(term) ||
+             llvm::isa<llvm::InvokeInst>(term));
+        add_edge(out_node, succ_node, COUNT_EDGE_CFG, &BB, succ, NULL,
+                 is_splittable, edge_depth);
+      }
+    }
 
-  std::vector<GFuncEntry *> cur_func_entries = {};
-  while (func_entry != NULL) {
-    cur_func_entries.push_back(func_entry);
-    func_entry = func_entry->next;
+    // ret and resume leave the function, unreachable is never reached
+    if (succs.empty() && !llvm::isa<llvm::UnreachableInst>(term)) {
+      const bool is_countable = BB.getTerminatingMustTailCall() == NULL;
+      add_edge(out_node, exit_node, COUNT_EDGE_RETURN, &BB, NULL, term,
+               is_countable, depth);
+    }
+
+    if (may_not_return(BB)) {
+      add_edge(out_node, exit_node, COUNT_EDGE_FAKE, &BB, NULL, NULL, false,
+               depth);
+    }
+  }
+
+  std::vector<uint32_t> parents(graph.num_nodes);
+  for (uint32_t node = 0; node < graph.num_nodes; node++) {
+    parents[node] = node;
+  }
+  auto find_root = [&](uint32_t node) {
+    while (parents[node] != node) {
+      parents[node] = parents[parents[node]];
+      node = parents[node];
+    }
+    return node;
+  };
+  auto add_to_tree = [&](CountEdge &edge) {
+    const uint32_t src_root = find_root(edge.src);
+    const uint32_t dst_root = find_root(edge.dst);
+    if (src_root == dst_root) {
+      return false;
+    }
+    parents[src_root] = dst_root;
+    edge.is_tree = true;
+    return true;
+  };
+
+  // Edges without a counter must be in the tree. A fake edge that can not be
+  // is left out of the flow graph (neither in the tree nor countable), counts
+  // are then off only if its call did not return.
+  for (CountEdge &edge : graph.edges) {
+    if (!edge.is_countable && edge.kind != COUNT_EDGE_FAKE &&
+        !add_to_tree(edge)) {
+      graph.is_solvable = false;
+    }
+  }
+  for (CountEdge &edge : graph.edges) {
+    if (edge.kind == COUNT_EDGE_FAKE) {
+      add_to_tree(edge);
+    }
+  }
+
+  std::vector<CountEdge *> countable_edges = {};
+  for (CountEdge &edge : graph.edges) {
+    if (edge.is_countable) {
+      countable_edges.push_back(&edge);
+    }
+  }
+  std::stable_sort(countable_edges.begin(), countable_edges.end(),
+                   [](const CountEdge *lhs, const CountEdge *rhs) {
+                     if (lhs->loop_depth != rhs->loop_depth) {
+                       return lhs->loop_depth > rhs->loop_depth;
+                     }
+                     return lhs->insert_pt == NULL && rhs->insert_pt != NULL;
+                   });
+  for (CountEdge *edge : countable_edges) {
+    add_to_tree(*edge);
   }
-  std::reverse(cur_func_entries.begin(), cur_func_entries.end());
 
-  llvm::GlobalVariable *prev_func_entry = NULL;
-  for (GFuncEntry *func_entry : cur_func_entries) {
-    std::vector<llvm::Constant *> cbb_entries = {};
-    for (size_t bb_idx = 0; bb_idx < hash_map_size; bb_idx++) {
-      GBBEntry *bb_entry = func_entry->bbs[bb_idx];
-      if (bb_entry == NULL) {
-        cbb_entries.push_back(cbbEntry_null);
+  count_graphs.push_back(graph);
+  return;
+}
+
+void BB_COV_Pass::insert_count_probes() {
+  // without a solvable flow graph every basic block gets its own counter
+  auto has_counter = [](const CountGraph &graph, const CountEdge &edge) {
+    if (!graph.is_solvable) {
+      return edge.kind == COUNT_EDGE_BB && edge.is_countable;
+    }
+    return !edge.is_tree && edge.is_countable;
+  };
+
+  // counters first, so the probes touch as few cache lines as possible, then
+  // the counts of the tree edges that the runtime derives
+  uint32_t num_counters = 0;
+  for (CountGraph &graph : count_graphs) {
+    for (CountEdge &edge : graph.edges) {
+      if (has_counter(graph, edge)) {
+        edge.val_idx = num_counters++;
+      }
+    }
+  }
+  num_count_vals = num_counters;
+  for (CountGraph &graph : count_graphs) {
+    for (CountEdge &edge : graph.edges) {
+      if (graph.is_solvable && edge.is_tree) {
+        edge.val_idx = num_count_vals++;
+      }
+    }
+  }
+
+  // Zero-initialized, emitted in every mode (with a single unused counter
+  // without -bbcov-counts) so the runtime can refer to it.
+  llvm::ArrayType *count_arr_ty =
+      llvm::ArrayType::get(int64Ty, std::max<uint32_t>(num_count_vals, 1));
+  count_arr_global = new llvm::GlobalVariable(
+      *Mod_ptr, count_arr_ty, false, table_linkage,
+      llvm::ConstantAggregateZero::get(count_arr_ty), "__bb_cov_count_arr");
+
+  uint32_t num_unsolvable = 0;
+  uint32_t num_unsplittable = 0;
+  std::map<llvm::Function *, const CountGraph *> func_graphs = {};
+
+  for (CountGraph &graph : count_graphs) {
+    func_graphs[graph.Func] = &graph;
+    num_unsolvable += !graph.is_solvable;
+
+    for (CountEdge &edge : graph.edges) {
+      if (!has_counter(graph, edge)) {
         continue;
       }
-      llvm::GlobalVariable *new_cbb_entry = gen_cbb_entry(bb_entry);
-      cbb_entries.push_back(new_cbb_entry);
+
+      llvm::Instruction *insert_pt = edge.insert_pt;
+      if (insert_pt == NULL) {
+        llvm::Instruction *term = edge.BB->getTerminator();
+        uint32_t succ_idx = 0;
+        while (term->getSuccessor(succ_idx) != edge.succ) {
+          succ_idx++;
+        }
+
+        llvm::BasicBlock *edge_BB = llvm::SplitCriticalEdge(
+            term, succ_idx,
+            llvm::CriticalEdgeSplittingOptions().setMergeIdenticalEdges());
+        if (edge_BB == NULL) {
+          num_unsplittable++;
+          continue;
+        }
+
+        edge_BB->getTerminator()->setMetadata(
+            "is_probe", llvm::MDNode::get(*Ctxt_ptr, {}));
+        insert_pt = edge_BB->getTerminator();
+      }
+
+      insert_counter(insert_pt, edge.val_idx);
     }
 
-    llvm::Constant *cbb_val =
-        llvm::ConstantArray::get(cbbEntryPtrArrayTy, cbb_entries);
+    if (graph.is_solvable) {
+      solve_count_graph(graph);
+    }
+  }
+
+  // in bb_probes order, the table must not depend on pointer values
+  for (const auto &bb_probe : bb_probes) {
+    llvm::BasicBlock *BB = bb_probe.first;
+    auto search = func_graphs.find(BB->getParent());
+    if (search == func_graphs.end()) {
+      continue;
+    }
 
-    llvm::Constant *prev_val = cfuncEntry_null;
-    if (prev_func_entry != NULL) {
-      prev_val = prev_func_entry;
+    const CountGraph &graph = *search->second;
+    const CountEdge &edge = graph.edges[graph.bb_edges.at(BB)];
+    if (!graph.is_solvable && !edge.is_countable) {
+      continue;
     }
-    llvm::Constant *new_cfunc_val = llvm::ConstantStruct::get(
-        cfuncEntryTy, {cbb_val, func_entry->func_gvar, prev_val});
-    llvm::GlobalVariable *new_cfunc_entry = new llvm::GlobalVariable(
-        *Mod_ptr, cfuncEntryTy, false, llvm::GlobalValue::PrivateLinkage,
-        new_cfunc_val);
-    prev_func_entry = new_cfunc_entry;
+
+    count_bbs_table.push_back(bb_map.get_bb_id(bb_probe.second));
+    count_bbs_table.push_back(edge.val_idx);
+  }
+
+  if (num_unsplittable != 0) {
+    *err_os << "[bb_cov] Warning: " << num_unsplittable
+            << " critical edges can not be split, the counts around "
+               "them are not exact.\n";
   }
 
-  return prev_func_entry;
+  if (is_verbose_mode && use_counts) {
+    uint32_t num_edges = 0;
+    for (const CountGraph &graph : count_graphs) {
+      num_edges += graph.edges.size();
+    }
+    *out_os << "[bb_cov] Placed " << num_counters << " counters on "
+            << num_edges << " flow graph edges of "
+            << count_graphs.size() << " functions, " << num_unsolvable
+            << " functions count every basic block.\n";
+  }
+  return;
 }
 
-llvm::GlobalVariable *BB_COV_Pass::gen_cbb_entry(GBBEntry *bb_entry) {
-  llvm::PointerType *cbbEntryPtrTy = llvm::PointerType::get(cbbEntryTy, 0);
-  llvm::Constant *cbbEntry_null = llvm::ConstantPointerNull::get(cbbEntryPtrTy);
-  llvm::Constant *zero_val = llvm::ConstantInt::get(int8Ty, 0);
+// Derives the tree edges from the leaves inwards: at a node with a single
+// unknown edge, the edge makes the inflow equal to the outflow.
+void BB_COV_Pass::solve_count_graph(const CountGraph &graph) {
+  std::vector<std::vector<uint32_t>> node_edges(graph.num_nodes);
+  std::vector<uint32_t> num_unknown(graph.num_nodes, 0);
+  std::vector<bool> is_known(graph.edges.size(), true);
+
+  for (uint32_t edge_idx = 0; edge_idx < graph.edges.size(); edge_idx++) {
+    const CountEdge &edge = graph.edges[edge_idx];
+    // fake edges left out of the flow graph
+    if (!edge.is_tree && !edge.is_countable) {
+      continue;
+    }
+
+    node_edges[edge.src].push_back(edge_idx);
+    node_edges[edge.dst].push_back(edge_idx);
+    if (edge.is_tree) {
+      is_known[edge_idx] = false;
+      num_unknown[edge.src]++;
+      num_unknown[edge.dst]++;
+    }
+  }
 
-  std::vector<GBBEntry *> cur_bb_entries = {};
-  while (bb_entry != NULL) {
-    cur_bb_entries.push_back(bb_entry);
-    bb_entry = bb_entry->next;
+  std::vector<uint32_t> leaves = {};
+  for (uint32_t node = graph.num_nodes; node-- > 0;) {
+    if (num_unknown[node] == 1) {
+      leaves.push_back(node);
+    }
   }
 
-  std::reverse(cur_bb_entries.begin(), cur_bb_entries.end());
-  llvm::GlobalVariable *prev_bb_entry = NULL;
-  for (GBBEntry *bb_entry : cur_bb_entries) {
-    llvm::Constant *prev_val = cbbEntry_null;
-    if (prev_bb_entry != NULL) {
-      prev_val = prev_bb_entry;
+  while (!leaves.empty()) {
+    const uint32_t node = leaves.back();
+    leaves.pop_back();
+    if (num_unknown[node] != 1) {
+      continue;
+    }
+
+    uint32_t unknown_idx = 0;
+    for (const uint32_t edge_idx : node_edges[node]) {
+      if (!is_known[edge_idx]) {
+        unknown_idx = edge_idx;
+        break;
+      }
+    }
+
+    // an unknown outgoing edge is the inflow minus the other outgoing edges,
+    // an unknown incoming edge the outflow minus the other incoming edges
+    const CountEdge &unknown = graph.edges[unknown_idx];
+    const bool is_out = unknown.src == node;
+    std::vector<uint32_t> plus = {};
+    std::vector<uint32_t> minus = {};
+    for (const uint32_t edge_idx : node_edges[node]) {
+      if (edge_idx == unknown_idx) {
+        continue;
+      }
+      const bool is_in = graph.edges[edge_idx].dst == node;
+      (is_in == is_out ? plus : minus).push_back(graph.edges[edge_idx].val_idx);
+    }
+
+    count_solve_table.push_back(unknown.val_idx);
+    count_solve_table.push_back(plus.size());
+    count_solve_table.insert(count_solve_table.end(), plus.begin(), plus.end());
+    count_solve_table.push_back(minus.size());
+    count_solve_table.insert(count_solve_table.end(), minus.begin(),
+                             minus.end());
+
+    is_known[unknown_idx] = true;
+    num_unknown[unknown.src]--;
+    num_unknown[unknown.dst]--;
+    const uint32_t other = is_out ? unknown.dst : unknown.src;
+    if (num_unknown[other] == 1) {
+      leaves.push_back(other);
     }
-    llvm::Constant *new_cbb_val = llvm::ConstantStruct::get(
-        cbbEntryTy, {bb_entry->bb_gvar, prev_val, zero_val});
-    llvm::GlobalVariable *new_cbb_entry = new llvm::GlobalVariable(
-        *Mod_ptr, cbbEntryTy, false, llvm::GlobalValue::PrivateLinkage,
-        new_cbb_val);
-    prev_bb_entry = new_cbb_entry;
+  }
+  return;
+}
+
+void BB_COV_Pass::insert_counter(llvm::Instruction *insert_pt,
+                                 uint32_t val_idx) {
+  // __bb_cov_count_arr[val_idx]++;
+  IRB->SetInsertPoint(insert_pt);
+  llvm::Value *count_ptr =
+      IRB->CreateConstInBoundsGEP1_32(int64Ty, count_arr_global, val_idx);
+  llvm::Value *count_val = IRB->CreateLoad(int64Ty, count_ptr);
+  llvm::Value *new_val =
+      IRB->CreateAdd(count_val, llvm::ConstantInt::get(int64Ty, 1));
+  IRB->CreateStore(new_val, count_ptr);
+  return;
+}
+
+void BB_COV_Pass::init_bb_cov_arr() {
+  // Zero-initialized, so it is placed in .bss. The array owns whole pages, so
+  // that the instant runtime can map a file over it. The runtime maps the
+  // merged array of -bbcov-per-tu units instead.
+  uint32_t arr_size = bb_map.get_num_bbs() + 1;
+  if (!is_per_tu) {
+    arr_size = llvm::alignTo(arr_size, BB_COV_ARR_ALIGN);
+  }
+
+  llvm::ArrayType *cov_arr_ty = llvm::ArrayType::get(int8Ty, arr_size);
+  bb_cov_arr_global = new llvm::GlobalVariable(
+      *Mod_ptr, cov_arr_ty, false, table_linkage,
+      llvm::ConstantAggregateZero::get(cov_arr_ty), "__bb_cov_arr");
+  if (!is_per_tu) {
+    bb_cov_arr_global->setAlignment(llvm::Align(BB_COV_ARR_ALIGN));
+  }
+
+  new llvm::GlobalVariable(*Mod_ptr, int32Ty, true, table_linkage,
+                           llvm::ConstantInt::get(int32Ty, arr_size),
+                           "__bb_cov_arr_size");
+
+  // Byte per CFG edge, indexed by edge id. Emitted in every mode (with a
+  // single unused byte without -bbcov-edges) so the runtime can refer to it.
+  llvm::ArrayType *edge_arr_ty =
+      llvm::ArrayType::get(int8Ty, std::max<size_t>(edges.size(), 1));
+  edge_cov_arr_global = new llvm::GlobalVariable(
+      *Mod_ptr, edge_arr_ty, false, table_linkage,
+      llvm::ConstantAggregateZero::get(edge_arr_ty), "__bb_cov_edge_arr");
+
+  // local bb_id -> global bb_id, filled in by the runtime at startup
+  if (is_per_tu) {
+    llvm::ArrayType *bb_ids_ty =
+        llvm::ArrayType::get(int32Ty, bb_map.get_num_bbs() + 1);
+    bb_ids_global = new llvm::GlobalVariable(
+        *Mod_ptr, bb_ids_ty, false, llvm::GlobalValue::InternalLinkage,
+        llvm::ConstantAggregateZero::get(bb_ids_ty), "__bb_cov_bb_ids");
+  }
+
+  // Every unit of -bbcov-per-tu has its own copy of the markers
+  const llvm::GlobalValue::LinkageTypes marker_linkage =
+      is_per_tu ? llvm::GlobalValue::LinkOnceODRLinkage
+                : llvm::GlobalValue::ExternalLinkage;
+
+  llvm::GlobalVariable *marker = NULL;
+  // bb_cov_hitcount_rt.a refers to it, so that a mismatched runtime fails to
+  // link
+  if (use_hitcount && !use_counts) {
+    marker = new llvm::GlobalVariable(*Mod_ptr, int8Ty, true, marker_linkage,
+                                      llvm::ConstantInt::get(int8Ty, 1),
+                                      "__bb_cov_hitcount_mode");
+  }
+
+  // same for bb_cov_counts_rt.a
+  if (use_counts) {
+    marker = new llvm::GlobalVariable(*Mod_ptr, int8Ty, true, marker_linkage,
+                                      llvm::ConstantInt::get(int8Ty, 1),
+                                      "__bb_cov_counts_mode");
   }
 
-  return prev_bb_entry;
+  // nothing refers to it in the unit, and the IR linker drops unreferenced
+  // linkonce_odr globals, e.g. when -bbcov-split links the partitions back
+  if (marker != NULL && is_per_tu) {
+    llvm::appendToCompilerUsed(*Mod_ptr, {marker});
+  }
+  return;
 }
 
 void BB_COV_Pass::init_bb_map_rt() {
   llvm::LLVMContext &Ctx = *Ctxt_ptr;
 
-  llvm::Type *int8PtrPtrTy = llvm::PointerType::get(int8PtrTy, 0);
+  const std::string &strtab = bb_map.get_strtab().get_data();
+  llvm::Constant *strtab_val =
+      llvm::ConstantDataArray::getString(Ctx, strtab, false);
+  llvm::GlobalVariable *strtab_global = new llvm::GlobalVariable(
+      *Mod_ptr, strtab_val->getType(), true, table_linkage, strtab_val,
+      "__bb_cov_strtab");
+
+  // The entries are emitted as flat i32 arrays, which have the same layout as
+  // CFuncEntry and CBBEntry arrays and are much cheaper to build than arrays
+  // of structs.
+  std::vector<uint32_t> funcs_data = {};
+  for (const GFuncEntry &func_entry : bb_map.get_funcs()) {
+    funcs_data.push_back(func_entry.file_off);
+    funcs_data.push_back(func_entry.name_off);
+    funcs_data.push_back(func_entry.first_bb);
+    funcs_data.push_back(func_entry.num_bbs);
+  }
 
-  const uint32_t hash_map_size = sizeof(unsigned char) * 256;
+  llvm::Constant *funcs_val = llvm::ConstantDataArray::get(Ctx, funcs_data);
+  llvm::GlobalVariable *funcs_global = new llvm::GlobalVariable(
+      *Mod_ptr, funcs_val->getType(), true, table_linkage, funcs_val,
+      "__bb_cov_funcs");
 
-  cbbEntryTy = llvm::StructType::create(Ctx, "struct.CBBEntry");
-  llvm::PointerType *cbbEntryPtrTy = llvm::PointerType::get(cbbEntryTy, 0);
+  new llvm::GlobalVariable(
+      *Mod_ptr, int32Ty, true, table_linkage,
+      llvm::ConstantInt::get(int32Ty, bb_map.get_funcs().size()),
+      "__num_bb_cov_funcs");
 
-  cbbEntryTy->setBody({int8PtrTy, cbbEntryPtrTy, int8Ty});
+  std::vector<uint32_t> bbs_data = {};
+  for (const GBBEntry &bb_entry : bb_map.get_bbs()) {
+    bbs_data.push_back(bb_entry.func_idx);
+    bbs_data.push_back(bb_entry.name_off);
+  }
 
-  cfuncEntryTy = llvm::StructType::create(Ctx, "struct.CFuncEntry");
-  llvm::PointerType *cfuncEntryPtrTy = llvm::PointerType::get(cfuncEntryTy, 0);
+  llvm::Constant *bbs_val = llvm::ConstantDataArray::get(Ctx, bbs_data);
+  llvm::GlobalVariable *bbs_global = new llvm::GlobalVariable(
+      *Mod_ptr, bbs_val->getType(), true, table_linkage, bbs_val,
+      "__bb_cov_bbs");
 
-  cfuncEntryTy->setBody({llvm::ArrayType::get(cbbEntryPtrTy, hash_map_size),
-                         int8PtrTy, cfuncEntryPtrTy});
+  new llvm::GlobalVariable(
+      *Mod_ptr, int32Ty, true, table_linkage,
+      llvm::ConstantInt::get(int32Ty, bb_map.get_num_bbs()), "__num_bbs");
 
-  cfileEntryTy = llvm::StructType::create(Ctx, "struct.CFileEntry");
-  llvm::PointerType *cfileEntryPtrTy = llvm::PointerType::get(cfileEntryTy, 0);
+  std::vector<uint32_t> edges_data = {};
+  for (const auto &edge : edges) {
+    edges_data.push_back(edge.first);
+    edges_data.push_back(edge.second);
+  }
 
-  cfileEntryTy->setBody({llvm::ArrayType::get(cfuncEntryPtrTy, hash_map_size),
-                         int8PtrTy, cfileEntryPtrTy});
+  llvm::Constant *edges_val = llvm::ConstantDataArray::get(Ctx, edges_data);
+  llvm::GlobalVariable *edges_global = new llvm::GlobalVariable(
+      *Mod_ptr, edges_val->getType(), true, table_linkage, edges_val,
+      "__bb_cov_edges");
+
+  new llvm::GlobalVariable(*Mod_ptr, int32Ty, true, table_linkage,
+                           llvm::ConstantInt::get(int32Ty, edges.size()),
+                           "__num_bb_cov_edges");
+
+  // (bb_id, num_srcs, src bb_ids...) records, empty without -bbcov-prune
+  llvm::Constant *implied_val =
+      llvm::ConstantDataArray::get(Ctx, implied_table);
+  llvm::GlobalVariable *implied_global = new llvm::GlobalVariable(
+      *Mod_ptr, implied_val->getType(), true, table_linkage, implied_val,
+      "__bb_cov_implied");
+
+  new llvm::GlobalVariable(
+      *Mod_ptr, int32Ty, true, table_linkage,
+      llvm::ConstantInt::get(int32Ty, implied_table.size()),
+      "__bb_cov_implied_size");
+
+  // (val_idx, plus..., minus...) and (bb_id, val_idx) records, empty without
+  // -bbcov-counts
+  llvm::Constant *count_solve_val =
+      llvm::ConstantDataArray::get(Ctx, count_solve_table);
+  llvm::GlobalVariable *count_solve_global = new llvm::GlobalVariable(
+      *Mod_ptr, count_solve_val->getType(), true, table_linkage,
+      count_solve_val, "__bb_cov_count_solve");
+
+  new llvm::GlobalVariable(
+      *Mod_ptr, int32Ty, true, table_linkage,
+      llvm::ConstantInt::get(int32Ty, count_solve_table.size()),
+      "__bb_cov_count_solve_size");
+
+  llvm::Constant *count_bbs_val =
+      llvm::ConstantDataArray::get(Ctx, count_bbs_table);
+  llvm::GlobalVariable *count_bbs_global = new llvm::GlobalVariable(
+      *Mod_ptr, count_bbs_val->getType(), true, table_linkage, count_bbs_val,
+      "__bb_cov_count_bbs");
+
+  new llvm::GlobalVariable(
+      *Mod_ptr, int32Ty, true, table_linkage,
+      llvm::ConstantInt::get(int32Ty, count_bbs_table.size()),
+      "__bb_cov_count_bbs_size");
+
+  new llvm::GlobalVariable(
+      *Mod_ptr, int32Ty, true, table_linkage,
+      llvm::ConstantInt::get(int32Ty, std::max<uint32_t>(num_count_vals, 1)),
+      "__bb_cov_count_arr_size");
+
+  // Identifies the basic block map in binary coverage files
+  uint64_t module_hash = bb_cov_fnv1a_hash(strtab.data(), strtab.size());
+  module_hash = bb_cov_fnv1a_hash(
+      funcs_data.data(), funcs_data.size() * sizeof(uint32_t), module_hash);
+  module_hash = bb_cov_fnv1a_hash(
+      bbs_data.data(), bbs_data.size() * sizeof(uint32_t), module_hash);
+  module_hash = bb_cov_fnv1a_hash(
+      edges_data.data(), edges_data.size() * sizeof(uint32_t), module_hash);
+  module_hash = bb_cov_fnv1a_hash(implied_table.data(),
+                                  implied_table.size() * sizeof(uint32_t),
+                                  module_hash);
+  module_hash = bb_cov_fnv1a_hash(count_solve_table.data(),
+                                  count_solve_table.size() * sizeof(uint32_t),
+                                  module_hash);
+  module_hash = bb_cov_fnv1a_hash(count_bbs_table.data(),
+                                  count_bbs_table.size() * sizeof(uint32_t),
+                                  module_hash);
+
+  new llvm::GlobalVariable(
+      *Mod_ptr, int64Ty, true, table_linkage,
+      llvm::ConstantInt::get(int64Ty, module_hash), "__bb_cov_module_hash");
+
+  if (!is_per_tu) {
+    return;
+  }
 
-  llvm::Constant *null_cfile_entry =
-      llvm::ConstantPointerNull::get(cfileEntryPtrTy);
+  // CUnitEntry in bb_cov_unit.hpp, the runtime finds it between
+  // __start___bb_cov_units and __stop___bb_cov_units
+  auto as_ptr = [this](llvm::GlobalVariable *global) {
+    return llvm::ConstantExpr::getPointerCast(global, int8PtrTy);
+  };
+  auto as_i32 = [this](uint32_t value) {
+    return llvm::ConstantInt::get(int32Ty, value);
+  };
+
+  std::vector<llvm::Constant *> fields = {
+      as_ptr(strtab_global),
+      as_ptr(funcs_global),
+      as_ptr(bbs_global),
+      as_ptr(edges_global),
+      as_ptr(implied_global),
+      as_ptr(count_solve_global),
+      as_ptr(count_bbs_global),
+      as_ptr(bb_cov_arr_global),
+      as_ptr(edge_cov_arr_global),
+      as_ptr(count_arr_global),
+      as_ptr(bb_ids_global),
+      as_i32(BB_COV_UNIT_VERSION),
+      as_i32(bb_map.get_funcs().size()),
+      as_i32(bb_map.get_num_bbs()),
+      as_i32(edges.size()),
+      as_i32(implied_table.size()),
+      as_i32(count_solve_table.size()),
+      as_i32(count_bbs_table.size()),
+      as_i32(std::max<uint32_t>(num_count_vals, 1))};
+
+  llvm::Constant *unit_val = llvm::ConstantStruct::getAnon(Ctx, fields);
+  llvm::GlobalVariable *unit_global = new llvm::GlobalVariable(
+      *Mod_ptr, unit_val->getType(), false, llvm::GlobalValue::InternalLinkage,
+      unit_val, "__bb_cov_unit");
+  unit_global->setSection(BB_COV_UNITS_SECTION);
+  unit_global->setAlignment(llvm::Align(8));
+  llvm::appendToCompilerUsed(*Mod_ptr, {unit_global});
+
+  insert_unit_registration();
+  return;
+}
 
-  std::vector<llvm::Constant *> file_map_entries = {};
+// Linker-defined bound of a section, hidden so that the linker resolves it in
+// the module itself
+llvm::Constant *BB_COV_Pass::get_section_bound(const char *name) {
+  llvm::GlobalVariable *bound = Mod_ptr->getNamedGlobal(name);
+  if (bound == NULL) {
+    bound = new llvm::GlobalVariable(*Mod_ptr, int8Ty, false,
+                                     llvm::GlobalValue::ExternalLinkage, NULL,
+                                     name);
+    bound->setVisibility(llvm::GlobalValue::HiddenVisibility);
+  }
+  return llvm::ConstantExpr::getPointerCast(bound, int8PtrTy);
+}
 
-  for (uint32_t file_idx = 0; file_idx < hash_map_size; file_idx++) {
-    GFileEntry *file_entry = file_bb_map[file_idx];
-    if (file_entry == NULL) {
-      file_map_entries.push_back(null_cfile_entry);
-      continue;
-    }
+// Function that passes the bounds of a section to runtime_name, if the
+// runtime is linked. It is in a comdat, so each module runs it once.
+llvm::Function *BB_COV_Pass::create_section_caller(const char *name,
+                                                   const char *runtime_name,
+                                                   llvm::Constant *start,
+                                                   llvm::Constant *stop) {
+  llvm::LLVMContext &Ctx = *Ctxt_ptr;
 
-    llvm::GlobalVariable *new_cfile_entry = gen_cfile_entry(file_entry);
-    file_map_entries.push_back(new_cfile_entry);
+  llvm::Function *caller = Mod_ptr->getFunction(name);
+  if (caller != NULL) {
+    return caller;
   }
 
-  llvm::ArrayType *cfileptr_array_ty =
-      llvm::ArrayType::get(cfileEntryPtrTy, hash_map_size);
-  llvm::Constant *cfileptr_arr_val =
-      llvm::ConstantArray::get(cfileptr_array_ty, file_map_entries);
-
-  llvm::GlobalVariable *__file_func_map_global = new llvm::GlobalVariable(
-      *Mod_ptr, cfileptr_array_ty, false, llvm::GlobalValue::ExternalLinkage,
-      cfileptr_arr_val, "__file_func_map");
+  llvm::FunctionType *register_ty =
+      llvm::FunctionType::get(voidTy, {int8PtrTy, int8PtrTy}, false);
+  llvm::FunctionType *ctor_ty = llvm::FunctionType::get(voidTy, false);
+
+  caller = llvm::Function::Create(
+      ctor_ty, llvm::GlobalValue::LinkOnceODRLinkage, name, Mod_ptr);
+  caller->setVisibility(llvm::GlobalValue::HiddenVisibility);
+  caller->setComdat(Mod_ptr->getOrInsertComdat(name));
+
+  // weak, so that a shared library also loads into a process without the
+  // runtime
+  llvm::Function *runtime_func = Mod_ptr->getFunction(runtime_name);
+  if (runtime_func == NULL) {
+    runtime_func = llvm::Function::Create(
+        register_ty, llvm::GlobalValue::ExternalWeakLinkage, runtime_name,
+        Mod_ptr);
+  }
 
-  return;
+  llvm::BasicBlock *entry = llvm::BasicBlock::Create(Ctx, "entry", caller);
+  llvm::BasicBlock *call_bb = llvm::BasicBlock::Create(Ctx, "call", caller);
+  llvm::BasicBlock *ret_bb = llvm::BasicBlock::Create(Ctx, "ret", caller);
+
+  IRB->SetInsertPoint(entry);
+  IRB->CreateCondBr(IRB->CreateIsNotNull(runtime_func), call_bb, ret_bb);
+  IRB->SetInsertPoint(call_bb);
+  IRB->CreateCall(runtime_func, {start, stop});
+  IRB->CreateBr(ret_bb);
+  IRB->SetInsertPoint(ret_bb);
+  IRB->CreateRetVoid();
+  return caller;
 }
 
-llvm::GlobalVariable *
-BB_COV_Pass::gen_new_string_constant(const std::string &name) {
-  auto search = new_string_globals.find(name);
+// -bbcov-per-tu: every module the units are linked into (the executable or a
+// shared library) registers the bounds of its __bb_cov_units section with the
+// runtime from a constructor, and unregisters them from a destructor for
+// dlclose.
+void BB_COV_Pass::insert_unit_registration() {
+  llvm::Constant *start = get_section_bound("__start_" BB_COV_UNITS_SECTION);
+  llvm::Constant *stop = get_section_bound("__stop_" BB_COV_UNITS_SECTION);
+
+  llvm::Function *ctor = create_section_caller(
+      "__bb_cov_module_ctor", "__register_bb_cov_units", start, stop);
+  llvm::Function *dtor = create_section_caller(
+      "__bb_cov_module_dtor", "__unregister_bb_cov_units", start, stop);
+
+  // the entries go with the comdat of their function. The destructor runs
+  // after those of the other priorities.
+  llvm::appendToGlobalCtors(*Mod_ptr, ctor, 1, ctor);
+  llvm::appendToGlobalDtors(*Mod_ptr, dtor, 1, dtor);
+}
 
-  if (search == new_string_globals.end()) {
-    llvm::GlobalVariable *new_global =
-        IRB->CreateGlobalString(name, "", 0, Mod_ptr);
-    new_string_globals.insert(make_pair(name, new_global));
-    return new_global;
+// -bbcov-sancov: the byte arrays the probes write go to the __sancov_cntrs
+// section, like the counters of -fsanitize-coverage=inline-8bit-counters, and
+// the runtime hands the section of every module to libFuzzer. libFuzzer clears
+// them before each input and takes the non-zero bytes as features after it.
+void BB_COV_Pass::insert_sancov_registration() {
+  bb_cov_arr_global->setSection(BB_COV_SANCOV_SECTION);
+  if (use_edges) {
+    edge_cov_arr_global->setSection(BB_COV_SANCOV_SECTION);
   }
 
-  return search->second;
+  llvm::Constant *start = get_section_bound("__start_" BB_COV_SANCOV_SECTION);
+  llvm::Constant *stop = get_section_bound("__stop_" BB_COV_SANCOV_SECTION);
+
+  // before the constructors of the target, which may run instrumented code
+  llvm::Function *ctor = create_section_caller(
+      "__bb_cov_sancov_ctor", "__register_bb_cov_counters", start, stop);
+  llvm::appendToGlobalCtors(*Mod_ptr, ctor, 1, ctor);
 }
 
 std::set<llvm::Function *> BB_COV_Pass::get_dtor_funcs() {
@@ -607,6 +1956,56 @@ bool BB_COV_Pass::is_probe_BB(llvm::BasicBlock &BB) {
   return (Node != nullptr);
 }
 
+// Ends the current phase, if any, and starts the next one
+void BB_COV_Pass::begin_phase(const std::string &name) {
+  if (!use_time_phases) {
+    return;
+  }
+
+  end_phase();
+  phase_name = name;
+  phase_start = std::chrono::steady_clock::now();
+  phase_malloc_start = llvm::sys::Process::GetMallocUsage();
+}
+
+void BB_COV_Pass::end_phase() {
+  if (!use_time_phases || phase_name == "") {
+    return;
+  }
+
+  PhaseTime phase_time;
+  phase_time.name = phase_name;
+  phase_time.elapsed_ms = std::chrono::duration<double, std::milli>(
+                              std::chrono::steady_clock::now() - phase_start)
+                              .count();
+  phase_time.malloc_delta =
+      (int64_t)llvm::sys::Process::GetMallocUsage() - phase_malloc_start;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  phase_time.max_rss_kb = usage.ru_maxrss;
+
+  phase_times.push_back(phase_time);
+  phase_name = "";
+}
+
+void BB_COV_Pass::print_phase_times() {
+  if (!use_time_phases) {
+    return;
+  }
+
+  double total_ms = 0;
+  for (const PhaseTime &phase_time : phase_times) {
+    *out_os << llvm::format("[bb_cov] Phase %-10s %12.3f ms %+12lld KB "
+                            "malloc %10llu KB max RSS\n",
+                            phase_time.name.c_str(), phase_time.elapsed_ms,
+                            (long long)(phase_time.malloc_delta / 1024),
+                            (unsigned long long)phase_time.max_rss_kb);
+    total_ms += phase_time.elapsed_ms;
+  }
+  *out_os << llvm::format("[bb_cov] Phase total      %12.3f ms\n", total_ms);
+}
+
 extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
   return {LLVM_PLUGIN_API_VERSION, // Plugin API version
           "BBCovPassPlugin",       // Plugin name
@@ -614,13 +2013,38 @@ extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
           [](llvm::PassBuilder &PB) {
             // Register module-level pass
             PB.registerPipelineParsingCallback(
-                [](llvm::StringRef Name, llvm::ModulePassManager &MPM,
-                   llvm::ArrayRef<llvm::PassBuilder::PipelineElement>) {
+                [&PB](llvm::StringRef Name, llvm::ModulePassManager &MPM,
+                      llvm::ArrayRef<llvm::PassBuilder::PipelineElement>) {
                   if (Name == "bbcov") {
                     MPM.addPass(BB_COV_Pass());
                     return true;
                   }
+
+                  // bbcov-O1/2/3: the default pipeline, then the
+                  // instrumentation, so the probes do not get in the way of
+                  // the optimizations
+                  const std::map<llvm::StringRef, llvm::OptimizationLevel>
+                      levels = {{"bbcov-O1", llvm::OptimizationLevel::O1},
+                                {"bbcov-O2", llvm::OptimizationLevel::O2},
+                                {"bbcov-O3", llvm::OptimizationLevel::O3}};
+                  auto search = levels.find(Name);
+                  if (search != levels.end()) {
+                    MPM.addPass(
+                        PB.buildPerModuleDefaultPipeline(search->second));
+                    MPM.addPass(BB_COV_Pass());
+                    return true;
+                  }
                   return false;
                 });
+
+            // -bbcov-per-tu: instrument every module the default pipelines
+            // build, e.g. each translation unit of clang -fpass-plugin. The
+            // phase argument was added in LLVM 20.
+            PB.registerOptimizerLastEPCallback(
+                [](llvm::ModulePassManager &MPM, auto...) {
+                  if (use_per_tu) {
+                    MPM.addPass(BB_COV_Pass());
+                  }
+                });
           }};
 }
\ No newline at end of file
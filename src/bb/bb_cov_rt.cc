@@ -1,153 +1,1141 @@
 #include "bb/bb_cov_rt.hpp"
 
+#include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <map>
 #include <mutex>
-#include <set>
-#include <sstream>
-
-#include "utils/hash.hpp"
+#include <unordered_map>
+#include <vector>
+
+#include "bb/bb_cov_format.hpp"
+#include "bb/bb_cov_module.hpp"
+#include "utils/fd_io.hpp"
+#include "utils/forkserver.hpp"
+#include "utils/init_point.hpp"
 #include "utils/progress_bar.hpp"
+#include "utils/replay.hpp"
 
 static const char *cov_output_fn = nullptr;
 
-// Used for fast check of covered basic blocks
-static char *bb_cov_arr = nullptr;
-
 namespace fs = std::filesystem;
 
-static std::map<std::string, std::map<std::string, std::set<std::string>>>
-    prev_cov;
+// Replay child only: slot of the parent's shared region that receives the
+// coverage at exit. Byte 0 (bb_id 0 is unused) marks the slot as written.
+static char *replay_slot = nullptr;
+// false if the replay child only reports to the parent
+static bool write_cov_file = true;
+// set once by whichever of __cov_fini and the emergency writer runs first
+static int cov_flushed = 0;
+// AFL++ shared memory map, indexed by process-wide bb_id, see AFL_SHM_ID_ENV
+static uint8_t *afl_area = nullptr;
+static uint32_t afl_area_size = 0;
+
+#define BB_COV_MAX_MODULES 256
+
+// Set up modules, cov_modules[0] is the executable and the rest are in
+// id_base order. A module is stored before num_cov_modules is published, so
+// __record_bb_cov and the emergency writer read them without modules_mutex.
+static CovModule *cov_modules[BB_COV_MAX_MODULES];
+static uint32_t num_cov_modules = 0;
+static std::mutex modules_mutex;
+// modules that registered before __handle_init. The constructors of the
+// modules run before the dynamic initializers of the runtime, so these are
+// constant initialized.
+static CovModule *pending_modules[BB_COV_MAX_MODULES];
+static uint32_t num_pending_modules = 0;
 
 #pragma clang attribute push(__attribute__((annotate("probe_function"))),      \
                              apply_to = function)
 
 extern "C" {
-void __handle_init(int32_t *argc_ptr, char **argv) {
-  const char *env_output_fn = getenv(OUTPUT_FN);
+#ifndef WRITE_COV_PER_BB
+static void __install_emergency_writer();
+#endif
 
-  if (env_output_fn != nullptr) {
-    cov_output_fn = env_output_fn;
+// Module of a bb_id given to __record_bb_cov, or nullptr. Async-signal-safe.
+static inline CovModule *__find_module(const uint32_t bb_id) {
+  const uint32_t num_modules =
+      __atomic_load_n(&num_cov_modules, __ATOMIC_ACQUIRE);
+  if (num_modules == 0) {
+    return nullptr;
+  }
 
-    std::cout << "[bb_cov] Found environment variable " << OUTPUT_FN
-              << ", setting coverage output file to " << cov_output_fn
+  uint32_t low = 0;
+  uint32_t high = num_modules;
+  while (high - low > 1) {
+    const uint32_t mid = (low + high) / 2;
+    if (cov_modules[mid]->id_base <= bb_id) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+
+  CovModule *mod = cov_modules[low];
+  return bb_id - mod->id_base <= mod->num_bbs ? mod : nullptr;
+}
+
+// Appends a set up module to cov_modules, under modules_mutex
+static void __publish_module(CovModule *mod) {
+  const uint32_t num_modules = num_cov_modules;
+
+  // output files are named after the shared libraries, a library loaded
+  // again after dlclose keeps its file
+  for (uint32_t mod_idx = 1; mod_idx < num_modules; mod_idx++) {
+    if (!cov_modules[mod_idx]->is_unloaded &&
+        cov_modules[mod_idx]->name == mod->name) {
+      mod->name += "." + std::to_string(num_modules);
+      break;
+    }
+  }
+
+  cov_modules[num_modules] = mod;
+  __atomic_store_n(&num_cov_modules, num_modules + 1, __ATOMIC_RELEASE);
+}
+
+// Output files of the modules for the current cov_output_fn
+static void __set_output_fns() {
+  for (uint32_t mod_idx = 0; mod_idx < num_cov_modules; mod_idx++) {
+    CovModule &mod = *cov_modules[mod_idx];
+    mod.output_fn = cov_output_fn == nullptr ? "" : cov_output_fn;
+    if (mod_idx != 0) {
+      mod.output_fn += "." + mod.name;
+    }
+  }
+}
+
+static void __print_num_bbs() {
+  std::cout << "[bb_cov] Found " << cov_modules[0]->num_bbs
+            << " basic blocks to track." << std::endl;
+  for (uint32_t mod_idx = 1; mod_idx < num_cov_modules; mod_idx++) {
+    std::cout << "[bb_cov] Found " << cov_modules[mod_idx]->num_bbs
+              << " basic blocks to track in " << cov_modules[mod_idx]->name
+              << "." << std::endl;
+  }
+}
+
+#ifdef WRITE_COV_PER_BB
+static bool __is_valid_sidecar(const CovModule &mod, int fd,
+                               size_t sidecar_size) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size != sidecar_size) {
+    return false;
+  }
+
+  BBCovBinHeader header;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+    return false;
+  }
+
+  return memcmp(header.magic, BB_COV_BIN_MAGIC, sizeof(header.magic)) == 0 &&
+         header.version == BB_COV_BIN_VERSION &&
+         header.encoding == BB_COV_BIN_BYTEMAP &&
+         header.module_hash == mod.module_hash &&
+         header.num_bbs == mod.num_bbs;
+}
+
+// Maps cov_arr onto the sidecar of the output file. Coverage of a crashed
+// run is still in the sidecar and is picked up by the next run. Falls back to
+// rewriting the output file on every new basic block if it can not be mapped.
+static void __map_cov_sidecar(CovModule &mod) {
+  const long page_size = sysconf(_SC_PAGESIZE);
+  if (page_size <= 0 || (uintptr_t)mod.cov_arr % page_size != 0 ||
+      mod.cov_arr_size % page_size != 0 ||
+      BB_COV_BYTEMAP_OFFSET % page_size != 0) {
+    std::cerr << "[bb_cov] Coverage array is not page aligned, writing the "
+                 "coverage file on every new basic block."
               << std::endl;
+    __cov_read_prev_cov(mod);
+    return;
+  }
 
-    // Initialize bb_cov_arr
-    bb_cov_arr = (char *)malloc(__num_bbs);
-    if (bb_cov_arr == nullptr) {
-      std::cerr << "[bb_cov] Failed to allocate memory for coverage array."
-                << std::endl;
-      exit(1);
+  const std::string sidecar_fn = mod.output_fn + BB_COV_SIDECAR_SUFFIX;
+  const size_t sidecar_size = BB_COV_BYTEMAP_OFFSET + mod.cov_arr_size;
+
+  int fd = open(sidecar_fn.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    std::cerr << "[bb_cov] Failed to open " << sidecar_fn
+              << ", writing the coverage file on every new basic block."
+              << std::endl;
+    __cov_read_prev_cov(mod);
+    return;
+  }
+
+  if (!__is_valid_sidecar(mod, fd, sidecar_size)) {
+    // new sidecar, or one from a different build
+    BBCovBinHeader header = {};
+    memcpy(header.magic, BB_COV_BIN_MAGIC, sizeof(header.magic));
+    header.version = BB_COV_BIN_VERSION;
+    header.encoding = BB_COV_BIN_BYTEMAP;
+    header.module_hash = mod.module_hash;
+    header.num_bbs = mod.num_bbs;
+
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, sidecar_size) != 0 ||
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+      std::cerr << "[bb_cov] Failed to initialize " << sidecar_fn << std::endl;
+      close(fd);
+      __cov_read_prev_cov(mod);
+      return;
     }
+  }
 
-    memset(bb_cov_arr, 0, __num_bbs);
+  void *mapped = mmap(mod.cov_arr, mod.cov_arr_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED, fd, BB_COV_BYTEMAP_OFFSET);
+  close(fd);
 
-    std::cout << "[bb_cov] Found " << __num_bbs << " basic blocks to track."
+  if (mapped == MAP_FAILED) {
+    std::cerr << "[bb_cov] Failed to map " << sidecar_fn
+              << ", writing the coverage file on every new basic block."
               << std::endl;
+    __cov_read_prev_cov(mod);
     return;
   }
 
-  int32_t argc = *argc_ptr;
+  mod.sidecar_mapped = true;
+}
+#endif
 
-  if (argc < 2) {
-    std::cout << "[bb_cov] Usage : " << argv[0]
-              << " <args ...> [cov_output_fn] [inputs_dir] [cov_output_dir] \n";
-    std::cout << "  <args ...> : arguments for the target program\n";
-    std::cout
-        << "  if @@ placeholder is NOT in <args ...>, it is considered as a "
-           "normal execution with coverage instrumentation, and generates "
-           "coverage report output file to [cov_output_fn].\n\n";
-    std::cout << "  if @@ placeholder is in <args ...>, it is considered as "
-                 "replaying all inputs in <inputs_dir> and generating coverage "
-                 "reports to [cov_output_dir].\n";
-    exit(1);
+struct ReplayInputStat {
+  uint32_t input_idx;
+  int32_t status;
+  uint32_t num_covered; // 0 if the child did not reach __cov_fini
+  uint32_t num_new;
+};
+
+// Union coverage of a directory replay, collected from the children's slots
+struct ReplayUnion {
+  char *slots = nullptr;
+  size_t slot_size = 0;
+  std::vector<uint32_t> free_slots;
+  // pid -> (slot index, input index)
+  std::unordered_map<pid_t, std::pair<uint32_t, uint32_t>> running;
+  std::vector<uint8_t> union_cov;
+  std::vector<uint8_t> union_edge_cov;
+  std::vector<uint64_t> union_counts;
+  std::vector<ReplayInputStat> input_stats;
+};
+
+// Offset of the execution counts (bb_cov_counts_rt) in a replay slot, after
+// the flag, cov_arr[1..num_bbs] and edge_arr
+static inline size_t __replay_slot_counts_off(const CovModule &mod) {
+  return mod.num_bbs + 1 + mod.num_cov_edges;
+}
+
+// Hands the coverage of a replay child to the parent. Async-signal-safe.
+static void __write_replay_slot(const CovModule &mod) {
+  memcpy(replay_slot + 1, mod.cov_arr + 1, mod.num_bbs);
+  memcpy(replay_slot + mod.num_bbs + 1, mod.edge_arr, mod.num_cov_edges);
+  if (is_counts) {
+    memcpy(replay_slot + __replay_slot_counts_off(mod), mod.bb_counts.data(),
+           (mod.num_bbs + 1) * sizeof(uint64_t));
   }
+  __atomic_store_n(&replay_slot[0], 1, __ATOMIC_RELEASE);
+}
 
-  uint32_t placeholder_idx = -1;
-  for (uint32_t idx = 1; idx < (uint32_t)argc; idx++) {
-    if (strncmp(argv[idx], "@@", 3) == 0) {
-      placeholder_idx = idx;
+// Copies the coverage of a module into the AFL++ map, execution counts are
+// saturated to 8 bits. Async-signal-safe.
+static void __write_afl_area(const CovModule &mod) {
+  for (uint32_t bb_id = 1; bb_id <= mod.num_bbs; bb_id++) {
+    const uint64_t area_idx = (uint64_t)mod.id_base + bb_id;
+    if (area_idx >= afl_area_size) {
       break;
     }
+
+    if (is_counts) {
+      const uint64_t count = mod.bb_counts[bb_id];
+      afl_area[area_idx] = count > 255 ? 255 : (uint8_t)count;
+    } else {
+      afl_area[area_idx] = mod.cov_arr[bb_id];
+    }
   }
+}
 
-  // Initialize bb_cov_arr
-  bb_cov_arr = (char *)malloc(__num_bbs);
-  if (bb_cov_arr == nullptr) {
-    std::cerr << "[bb_cov] Failed to allocate memory for coverage array."
-              << std::endl;
-    exit(1);
+// Serves the AFL++ forkserver protocol on AFL_FORKSRV_READ_FD and
+// AFL_FORKSRV_WRITE_FD: for every 4-byte request, it forks, reports the pid
+// of the child and then its wait status. Returns in the children, and right
+// away if no fuzzer listens.
+static void __run_forkserver() {
+  const uint32_t hello = AFL_FS_OPT_ENABLED | AFL_FS_OPT_MAPSIZE |
+                         AFL_FS_OPT_SET_MAPSIZE(afl_area_size);
+  if (!write_all(AFL_FORKSRV_WRITE_FD, &hello, sizeof(hello))) {
+    return;
   }
 
-  memset(bb_cov_arr, 0, __num_bbs);
+  while (true) {
+    uint32_t was_killed = 0;
+    if (!read_all(AFL_FORKSRV_READ_FD, &was_killed, sizeof(was_killed))) {
+      _exit(0);
+    }
+
+    const pid_t pid = fork();
+    if (pid < 0) {
+      _exit(1);
+    }
+    if (pid == 0) {
+      close(AFL_FORKSRV_READ_FD);
+      close(AFL_FORKSRV_WRITE_FD);
+      return;
+    }
+
+    int32_t status = 0;
+    if (!write_all(AFL_FORKSRV_WRITE_FD, &pid, sizeof(pid)) ||
+        waitpid(pid, &status, 0) < 0 ||
+        !write_all(AFL_FORKSRV_WRITE_FD, &status, sizeof(status))) {
+      _exit(1);
+    }
+  }
+}
+
+// Attaches the AFL++ map if __AFL_SHM_ID is set, and runs the forkserver.
+// Returns false outside of a fuzzer.
+static bool __init_afl(int32_t argc, char **argv) {
+  // every module that is loaded at startup, rounded up like afl-fuzz does
+  uint32_t map_size = (next_id_base + 63) & ~63U;
+  if (map_size == 0) {
+    map_size = 64;
+  }
+
+  if (getenv(AFL_DUMP_MAP_SIZE_ENV) != nullptr) {
+    printf("%u\n", map_size);
+    exit(0);
+  }
+
+  const char *shm_id_str = getenv(AFL_SHM_ID_ENV);
+  if (shm_id_str == nullptr) {
+    return false;
+  }
+
+  const int shm_id = atoi(shm_id_str);
+  void *area = shmat(shm_id, nullptr, 0);
+  if (area == (void *)-1) {
+    std::cerr << "[bb_cov] Failed to attach the AFL shared memory "
+              << shm_id_str << ": " << strerror(errno) << std::endl;
+    _exit(1);
+  }
+
+  // never write past a map that is smaller than ours
+  struct shmid_ds shm_info;
+  afl_area_size = map_size;
+  if (shmctl(shm_id, IPC_STAT, &shm_info) == 0 &&
+      shm_info.shm_segsz < afl_area_size) {
+    afl_area_size = shm_info.shm_segsz;
+  }
+  afl_area = (uint8_t *)area;
+
+  // reports come from replaying the fuzzer's queue
+  write_cov_file = false;
+  for (uint32_t mod_idx = 0; mod_idx < num_cov_modules; mod_idx++) {
+    cov_modules[mod_idx]->bb_cov_arr = cov_modules[mod_idx]->cov_arr;
+  }
+
+  run_at_init_point(is_init_deferred(DEFER_INIT), argc, argv,
+                    __run_forkserver);
+  return true;
+}
+
+static void __merge_replay_slot(const CovModule &mod, ReplayUnion &replay_union,
+                                pid_t pid, int32_t status) {
+  auto search = replay_union.running.find(pid);
+  if (search == replay_union.running.end()) {
+    return;
+  }
+
+  const uint32_t slot_idx = search->second.first;
+  ReplayInputStat stat = {search->second.second, status, 0, 0};
+  replay_union.running.erase(search);
+  replay_union.free_slots.push_back(slot_idx);
+
+  const char *slot = replay_union.slots + slot_idx * replay_union.slot_size;
+  if (slot[0] != 0) {
+    const char *edge_slot = slot + mod.num_bbs + 1;
+    for (uint32_t edge_id = 0; edge_id < mod.num_cov_edges; edge_id++) {
+      replay_union.union_edge_cov[edge_id] |= edge_slot[edge_id] != 0;
+    }
+
+    if (is_counts) {
+      std::vector<uint64_t> counts(mod.num_bbs + 1);
+      memcpy(counts.data(), slot + __replay_slot_counts_off(mod),
+             counts.size() * sizeof(uint64_t));
+      for (uint32_t bb_id = 1; bb_id <= mod.num_bbs; bb_id++) {
+        replay_union.union_counts[bb_id] += counts[bb_id];
+      }
+    }
+
+    for (uint32_t bb_id = 1; bb_id <= mod.num_bbs; bb_id++) {
+      if (slot[bb_id] == 0) {
+        continue;
+      }
+
+      // a new hit count bucket counts as new coverage in hit-count mode
+      const uint8_t bb_value = is_hitcount ? __count_to_bucket(slot[bb_id]) : 1;
+      stat.num_covered++;
+      if ((bb_value & ~replay_union.union_cov[bb_id]) != 0) {
+        replay_union.union_cov[bb_id] |= bb_value;
+        stat.num_new++;
+      }
+    }
+  }
+
+  replay_union.input_stats.push_back(stat);
+}
+
+static void __write_replay_union(CovModule &mod, const char *union_output_fn,
+                                 const ReplayUnion &replay_union,
+                                 const std::vector<fs::path> &input_paths) {
+  uint32_t num_covered = 0;
+  for (uint32_t bb_id = 1; bb_id <= mod.num_bbs; bb_id++) {
+    num_covered += replay_union.union_cov[bb_id] != 0;
+  }
+
+  uint32_t num_novel = 0;
+  uint32_t num_no_cov = 0;
+  for (const ReplayInputStat &stat : replay_union.input_stats) {
+    num_novel += stat.num_new != 0;
+    num_no_cov += stat.num_covered == 0;
+  }
+
+  std::cout << "[bb_cov] Union coverage: " << num_covered << "/" << mod.num_bbs
+            << " basic blocks, " << num_novel
+            << " inputs found new basic blocks, " << num_no_cov
+            << " inputs reported no coverage." << std::endl;
+
+  // merges with the existing union file like a normal output file. The union
+  // holds reported values (buckets, counts), so it joins the previous
+  // coverage.
+  mod.output_fn = union_output_fn;
+  __write_cov_map(mod, fs::path(mod.output_fn).parent_path());
+  __cov_read_prev_cov(mod);
+  mod.prev_cov.resize(mod.num_bbs + 1, 0);
+  for (uint32_t bb_id = 1; bb_id <= mod.num_bbs; bb_id++) {
+    mod.prev_cov[bb_id] |= replay_union.union_cov[bb_id];
+    mod.cov_arr[bb_id] = 0;
+  }
+  mod.prev_edge_cov.resize(mod.num_cov_edges, 0);
+  for (uint32_t edge_id = 0; edge_id < mod.num_cov_edges; edge_id++) {
+    mod.prev_edge_cov[edge_id] |= replay_union.union_edge_cov[edge_id];
+    mod.edge_arr[edge_id] = 0;
+  }
+  if (is_counts) {
+    mod.prev_counts.resize(mod.num_bbs + 1, 0);
+    for (uint32_t bb_id = 1; bb_id <= mod.num_bbs; bb_id++) {
+      mod.prev_counts[bb_id] += replay_union.union_counts[bb_id];
+    }
+  }
+  memset(mod.count_arr, 0, mod.count_arr_size * sizeof(uint64_t));
+  __reset_units(mod);
+  __write_cov(mod);
+
+  // in completion order, new basic blocks are relative to earlier inputs
+  const std::string stats_fn = std::string(union_output_fn) + ".inputs";
+  std::ofstream stats_out(stats_fn, std::ios::out);
+  if (!stats_out.is_open()) {
+    std::cerr << "[bb_cov] Failed to open " << stats_fn << std::endl;
+    return;
+  }
+
+  stats_out << "# input exit_status covered_bbs new_bbs\n";
+  for (const ReplayInputStat &stat : replay_union.input_stats) {
+    stats_out << input_paths[stat.input_idx].filename().string() << " "
+              << stat.status << " " << stat.num_covered << " "
+              << stat.num_new << "\n";
+  }
+  stats_out.close();
+}
+
+// Starts recording a module into its output file
+static void __open_module(CovModule &mod) {
+  mod.bb_cov_arr = mod.cov_arr;
+  __write_cov_map(mod, fs::path(mod.output_fn).parent_path());
+  if (!write_cov_file) {
+    return;
+  }
 
-  if (placeholder_idx == -1) {
-    // normal execution with one input file
-    int32_t new_argc = argc - 1;
-    cov_output_fn = argv[new_argc];
-    argv[new_argc] = nullptr;
-    *argc_ptr = new_argc;
-    std::cout << "[bb_cov] Found " << __num_bbs << " basic blocks to track."
-              << std::endl;
-    std::cout << "[bb_cov] Coverage output file: " << cov_output_fn
-              << std::endl;
 #ifdef WRITE_COV_PER_BB
-    __cov_read_prev_cov();
+  __map_cov_sidecar(mod);
+#else
+  __prepare_emergency_cov(mod);
+  __merge_prev_emergency_cov(mod);
 #endif
+}
+
+// Binds the executable and merges the shared libraries that registered
+// before __handle_init, the executable gets id_base 0
+static void __init_modules() {
+  std::lock_guard<std::mutex> guard(modules_mutex);
+
+  // the runtime is linked into the executable
+  Dl_info exe_info;
+  const void *exe_base = nullptr;
+  if (dladdr((const void *)&__handle_init, &exe_info) != 0) {
+    exe_base = exe_info.dli_fbase;
+  }
+
+  CovModule *exe_mod = nullptr;
+  for (uint32_t mod_idx = 0; mod_idx < num_pending_modules; mod_idx++) {
+    if (pending_modules[mod_idx]->base == exe_base) {
+      exe_mod = pending_modules[mod_idx];
+      break;
+    }
+  }
+
+  // whole-program executables register no units
+  if (exe_mod == nullptr) {
+    exe_mod = new CovModule();
+  }
+  exe_mod->name.clear();
+  __bind_tables(*exe_mod);
+  __init_bb_counts(*exe_mod);
+  __publish_module(exe_mod);
+
+  for (uint32_t mod_idx = 0; mod_idx < num_pending_modules; mod_idx++) {
+    CovModule *mod = pending_modules[mod_idx];
+    if (mod == exe_mod) {
+      continue;
+    }
+
+    if (num_cov_modules == BB_COV_MAX_MODULES || !__merge_units(*mod)) {
+      std::cerr << "[bb_cov] Can not track " << mod->name << "." << std::endl;
+      continue;
+    }
+    __init_bb_counts(*mod);
+    __publish_module(mod);
+  }
+  num_pending_modules = 0;
+}
+
+void __register_bb_cov_units(CUnitEntry *start, CUnitEntry *stop) {
+  CovModule *mod = new CovModule();
+  mod->units_start = start;
+  mod->units_stop = stop;
+
+  Dl_info info;
+  if (dladdr((const void *)start, &info) != 0) {
+    mod->base = info.dli_fbase;
+    if (info.dli_fname != nullptr) {
+      mod->name = fs::path(info.dli_fname).filename().string();
+    }
+  }
+  if (mod->name.empty()) {
+    mod->name = "module";
+  }
+
+  std::lock_guard<std::mutex> guard(modules_mutex);
+
+  // before __handle_init, e.g. the executable and the libraries it links
+  if (num_cov_modules == 0) {
+    if (num_pending_modules == BB_COV_MAX_MODULES) {
+      std::cerr << "[bb_cov] Can not track " << mod->name << "." << std::endl;
+      return;
+    }
+    pending_modules[num_pending_modules++] = mod;
     return;
   }
 
-  std::cout << "[bb_cov] Replaying all inputs in directory mode." << std::endl;
+  // a shared library loaded with dlopen
+  if (num_cov_modules == BB_COV_MAX_MODULES || !__merge_units(*mod)) {
+    std::cerr << "[bb_cov] Can not track " << mod->name << "." << std::endl;
+    return;
+  }
+  __init_bb_counts(*mod);
+  __publish_module(mod);
+  __set_output_fns();
+
+  if (afl_area != nullptr) {
+    // in the map if there is room past the modules of the startup
+    mod->bb_cov_arr = mod->cov_arr;
+  } else if (cov_output_fn != nullptr) {
+    std::cout << "[bb_cov] Found " << mod->num_bbs
+              << " basic blocks to track in " << mod->name << "." << std::endl;
+    __open_module(*mod);
+  }
+}
 
-  *argc_ptr = argc - 2;
-  const char *inputs_dir = argv[argc - 2];
-  const char *outputs_dir = argv[argc - 1];
-  argv[argc - 2] = nullptr;
-  argv[argc - 1] = nullptr;
+// Writes a shared library that is unloaded with dlclose, its units go away
+// with it. Modules that are still loaded at exit are written by __cov_fini
+// first.
+void __unregister_bb_cov_units(CUnitEntry *start, CUnitEntry *stop) {
+  std::lock_guard<std::mutex> guard(modules_mutex);
+
+  for (uint32_t mod_idx = 0; mod_idx < num_pending_modules; mod_idx++) {
+    if (pending_modules[mod_idx]->units_start == start &&
+        pending_modules[mod_idx]->units_stop == stop) {
+      num_pending_modules--;
+      pending_modules[mod_idx] = pending_modules[num_pending_modules];
+      return;
+    }
+  }
 
-  fs::path dir_path(inputs_dir);
+  CovModule *mod = nullptr;
+  for (uint32_t mod_idx = 1; mod_idx < num_cov_modules; mod_idx++) {
+    if (cov_modules[mod_idx]->units_start == start &&
+        cov_modules[mod_idx]->units_stop == stop &&
+        cov_modules[mod_idx]->bb_cov_arr != nullptr) {
+      mod = cov_modules[mod_idx];
+      break;
+    }
+  }
 
-  if (!fs::exists(dir_path) || !fs::is_directory(dir_path)) {
-    std::cerr
-        << "[bb_cov] Inputs directory does not exist or is not a directory."
-        << std::endl;
+  if (mod == nullptr ||
+      __atomic_load_n(&cov_flushed, __ATOMIC_ACQUIRE) != 0) {
+    return;
+  }
+
+  __collect_cov(*mod);
+  __atomic_store_n(&mod->bb_cov_arr, nullptr, __ATOMIC_RELEASE);
+  mod->is_unloaded = true;
+  // e.g. the parent of the replay children
+  if (!write_cov_file || mod->output_fn.empty()) {
+    return;
+  }
+
+  __cov_read_prev_cov(*mod);
+  std::cout << "[bb_cov] Writing coverage info of " << mod->name
+            << " to files..." << std::endl;
+  const bool is_written = __write_cov(*mod);
+
+#ifdef WRITE_COV_PER_BB
+  if (is_written && mod->sidecar_mapped) {
+    unlink((mod->output_fn + BB_COV_SIDECAR_SUFFIX).c_str());
+  }
+#else
+  (void)is_written;
+#endif
+}
+
+// Writes the coverage at exit when main is not instrumented, e.g. libFuzzer's,
+// so __handle_init never ran. libFuzzer clears the arrays before every input,
+// they hold the last one it ran.
+static void __write_cov_at_exit() {
+  if (__atomic_load_n(&num_cov_modules, __ATOMIC_ACQUIRE) != 0) {
+    return;
+  }
+
+  __init_modules();
+  cov_output_fn = getenv(OUTPUT_FN);
+  __set_output_fns();
+  for (uint32_t mod_idx = 0; mod_idx < num_cov_modules; mod_idx++) {
+    cov_modules[mod_idx]->bb_cov_arr = cov_modules[mod_idx]->cov_arr;
+    __write_cov_map(*cov_modules[mod_idx],
+                    fs::path(cov_modules[mod_idx]->output_fn).parent_path());
+  }
+  __cov_fini();
+}
+
+void __register_bb_cov_counters(char *start, char *stop) {
+  if (__sanitizer_cov_8bit_counters_init != nullptr) {
+    __sanitizer_cov_8bit_counters_init(start, stop);
+  }
+
+  static bool is_exit_registered = false;
+  if (!is_exit_registered && getenv(OUTPUT_FN) != nullptr) {
+    is_exit_registered = true;
+    atexit(__write_cov_at_exit);
+  }
+}
+
+// Serves bbcov-run, returns in every child with its output file opened
+static void __serve_bbcov_run(int32_t argc, char **argv) {
+#ifndef WRITE_COV_PER_BB
+  for (uint32_t mod_idx = 0; mod_idx < num_cov_modules; mod_idx++) {
+    __prepare_emergency_cov(*cov_modules[mod_idx]);
+  }
+#endif
+  cov_output_fn = run_forkserver(argc, argv);
+  __set_output_fns();
+  for (uint32_t mod_idx = 0; mod_idx < num_cov_modules; mod_idx++) {
+    __open_module(*cov_modules[mod_idx]);
+  }
+#ifndef WRITE_COV_PER_BB
+  __install_emergency_writer();
+#endif
+}
+
+#ifndef WRITE_COV_PER_BB
+#define BB_COV_PAGE_SIZE 4096
+
+// Persistent worker state of a module
+struct PersistentModule {
+  // the non-zero bytes of the arrays when the worker started
+  std::vector<std::pair<char *, char>> baseline;
+  // see CovModule::dirty_pages
+  std::vector<char> dirty_pages;
+};
+
+// Starts tracking a module in the persistent worker. A module loaded during
+// an input started out with zeroed arrays.
+static void __track_module(CovModule &mod, PersistentModule &state,
+                           bool is_zero) {
+  auto add = [&state, is_zero](void *buf, size_t size) {
+    for (size_t off = 0; off < size && buf != nullptr && !is_zero; off++) {
+      if (((char *)buf)[off] != 0) {
+        state.baseline.emplace_back((char *)buf + off, ((char *)buf)[off]);
+      }
+    }
+  };
+
+  add(mod.cov_arr, mod.cov_arr_size);
+  add(mod.edge_arr, mod.num_cov_edges);
+  add(mod.count_arr, mod.count_arr_size * sizeof(uint64_t));
+  for (const MergedUnit &unit : mod.merged_units) {
+    const CUnitEntry *entry = unit.entry;
+    add(entry->cov_arr, entry->num_bbs + 1);
+    add(entry->edge_arr, std::max<uint32_t>(entry->num_edges, 1));
+    add(entry->count_arr, entry->count_arr_size * sizeof(uint64_t));
+  }
+
+  state.dirty_pages.assign(mod.cov_arr_size / BB_COV_PAGE_SIZE + 1, 0);
+  mod.dirty_pages = state.dirty_pages.data();
+}
+
+// Zeroes the non-zero words of buf, for the arrays that the probes write
+// without calling into the runtime
+static void __clear_dirty_words(void *buf, size_t size) {
+  char *bytes = (char *)buf;
+  size_t off = 0;
+  for (; off + sizeof(uint64_t) <= size; off += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes + off, sizeof(uint64_t));
+    if (word != 0) {
+      memset(bytes + off, 0, sizeof(uint64_t));
+    }
+  }
+  for (; off < size; off++) {
+    bytes[off] = 0;
+  }
+}
+
+// Brings the arrays of a module back to the baseline after an input. First
+// hits through __record_bb_cov only clear the pages they marked, and the
+// blocks __collect_cov derived are cleared through the tables it used.
+static void __reset_module(CovModule &mod, PersistentModule &state) {
+  for (uint32_t idx = 0; idx + 1 < mod.implied_size;
+       idx += 2 + mod.implied_table[idx + 1]) {
+    mod.cov_arr[mod.implied_table[idx]] = 0;
+  }
+  for (uint32_t idx = 0; idx + 1 < mod.count_bbs_size && !mod.bb_counts.empty();
+       idx += 2) {
+    mod.cov_arr[mod.count_bbs[idx]] = 0;
+  }
+
+  // inline hit count probes and store probes never call __record_bb_cov
+  bool has_first_hits = false;
+  for (size_t page = 0; page < state.dirty_pages.size(); page++) {
+    if (state.dirty_pages[page] == 0) {
+      continue;
+    }
+    const size_t off = page * BB_COV_PAGE_SIZE;
+    memset(mod.cov_arr + off, 0,
+           std::min<size_t>(BB_COV_PAGE_SIZE, mod.cov_arr_size - off));
+    state.dirty_pages[page] = 0;
+    has_first_hits = true;
+  }
+  if (!has_first_hits || is_hitcount) {
+    __clear_dirty_words(mod.cov_arr, mod.cov_arr_size);
+  }
+
+  __clear_dirty_words(mod.edge_arr, mod.num_cov_edges);
+  __clear_dirty_words(mod.count_arr, mod.count_arr_size * sizeof(uint64_t));
+  // __gather_units reads the unit arrays in full anyway
+  for (const MergedUnit &unit : mod.merged_units) {
+    const CUnitEntry *entry = unit.entry;
+    __clear_dirty_words(entry->cov_arr, entry->num_bbs + 1);
+    __clear_dirty_words(entry->edge_arr,
+                        std::max<uint32_t>(entry->num_edges, 1));
+    __clear_dirty_words(entry->count_arr,
+                        entry->count_arr_size * sizeof(uint64_t));
+  }
+
+  for (const std::pair<char *, char> &byte : state.baseline) {
+    *byte.first = byte.second;
+  }
+}
+
+static std::vector<uint8_t> __read_input(const fs::path &input) {
+  std::ifstream input_in(input, std::ios::in | std::ios::binary);
+  return std::vector<uint8_t>(std::istreambuf_iterator<char>(input_in),
+                              std::istreambuf_iterator<char>());
+}
+
+// Persistent worker: runs input_paths[first, last) through
+// LLVMFuzzerTestOneInput, writes the coverage of each input and restores the
+// arrays before the next one. *num_finished counts the written inputs, for the
+// parent to find the input that ended the worker. Never returns.
+static void __run_persistent_worker(const std::vector<fs::path> &input_paths,
+                                    uint32_t first, uint32_t last,
+                                    const char *outputs_dir,
+                                    uint32_t *num_finished) {
+  redirect_to_devnull();
+
+  // an input that exits or crashes is replayed alone, so neither __cov_fini
+  // nor dlclose write anything in the worker
+  cov_flushed = 1;
+  write_cov_file = true;
+
+  // each input writes a fresh output file, nothing to merge with
+  std::vector<PersistentModule> states(BB_COV_MAX_MODULES);
+  for (uint32_t mod_idx = 0; mod_idx < num_cov_modules; mod_idx++) {
+    CovModule &mod = *cov_modules[mod_idx];
+    mod.bb_cov_arr = mod.cov_arr;
+    mod.prev_cov.clear();
+    mod.prev_edge_cov.clear();
+    mod.prev_counts.clear();
+    __track_module(mod, states[mod_idx], false);
+  }
+  uint32_t num_tracked = num_cov_modules;
+
+  std::string output_path;
+  for (uint32_t input_idx = first; input_idx < last; input_idx++) {
+    output_path =
+        get_replay_output_path(input_paths[input_idx].string(), outputs_dir);
+    cov_output_fn = output_path.c_str();
+    __set_output_fns();
+
+    const std::vector<uint8_t> data = __read_input(input_paths[input_idx]);
+    LLVMFuzzerTestOneInput(data.data(), data.size());
+
+    const uint32_t num_modules =
+        __atomic_load_n(&num_cov_modules, __ATOMIC_ACQUIRE);
+    for (uint32_t mod_idx = 0; mod_idx < num_modules; mod_idx++) {
+      CovModule &mod = *cov_modules[mod_idx];
+      if (mod_idx == num_tracked) {
+        __track_module(mod, states[mod_idx], true);
+        num_tracked++;
+      }
+      // the units went away with the library
+      if (mod.is_unloaded) {
+        continue;
+      }
+
+      __write_cov(mod);
+      __reset_module(mod, states[mod_idx]);
+    }
+
+    __atomic_store_n(num_finished, input_idx - first + 1, __ATOMIC_RELEASE);
+  }
+
+  _exit(0);
+}
+
+// Replays one input through LLVMFuzzerTestOneInput in a fresh child, with the
+// emergency writer of directory mode. Never returns.
+static void __run_persistent_alone(const fs::path &input,
+                                   const char *outputs_dir) {
+  redirect_to_devnull();
+
+  const std::string output_path =
+      get_replay_output_path(input.string(), outputs_dir);
+  cov_output_fn = output_path.c_str();
+  write_cov_file = true;
+  __set_output_fns();
+  for (uint32_t mod_idx = 0; mod_idx < num_cov_modules; mod_idx++) {
+    __open_module(*cov_modules[mod_idx]);
+  }
+  __install_emergency_writer();
+
+  const std::vector<uint8_t> data = __read_input(input);
+  LLVMFuzzerTestOneInput(data.data(), data.size());
+
+  __cov_fini();
+  exit(0);
+}
+
+// Inputs per persistent worker, 0 replays with one fork per input
+static uint32_t __get_persistent_iters(const char *union_output_fn) {
+  const char *env_persistent = getenv(PERSISTENT);
+  if (env_persistent == nullptr || strcmp(env_persistent, "0") == 0) {
+    return 0;
+  }
+
+  char *end = nullptr;
+  const long iters = strtol(env_persistent, &end, 10);
+  if (end == env_persistent || *end != '\0' || iters < 0) {
+    std::cerr << "[bb_cov] Invalid " << PERSISTENT << " \"" << env_persistent
+              << "\", replaying with one fork per input." << std::endl;
+    return 0;
+  }
+
+  if (LLVMFuzzerTestOneInput == nullptr) {
+    std::cerr << "[bb_cov] " << PERSISTENT
+              << " needs LLVMFuzzerTestOneInput in the target, replaying "
+                 "with one fork per input."
+              << std::endl;
+    return 0;
+  }
+
+  if (union_output_fn != nullptr) {
+    std::cerr << "[bb_cov] " << PERSISTENT << " does not support "
+              << UNION_OUTPUT_FN << ", replaying with one fork per input."
+              << std::endl;
+    return 0;
+  }
+
+  return std::min<long>(iters, UINT32_MAX);
+}
+
+// Persistent directory mode: each worker replays a batch of up to
+// max_iters inputs in one process. The input that ends a worker early is
+// replayed alone, and a new worker takes the rest of the batch. Exits once
+// all inputs are done.
+static void __replay_persistent(char **argv,
+                                const std::vector<fs::path> &input_paths,
+                                const char *outputs_dir, uint32_t num_jobs,
+                                uint32_t max_iters) {
+  if (LLVMFuzzerInitialize != nullptr) {
+    int argc = 0;
+    while (argv[argc] != nullptr) {
+      argc++;
+    }
+    LLVMFuzzerInitialize(&argc, &argv);
+  }
+
+  struct Batch {
+    uint32_t first;
+    uint32_t last;
+    bool is_alone;
+  };
+
+  const uint32_t num_inputs = input_paths.size();
+  std::deque<Batch> batches;
+  for (uint32_t first = 0; first < num_inputs; first += max_iters) {
+    batches.push_back(
+        {first, (uint32_t)std::min<uint64_t>(first + max_iters, num_inputs),
+         false});
+  }
+
+  // finished inputs of the worker in each job slot
+  num_jobs = std::max<uint32_t>(num_jobs, 1);
+  void *slots = mmap(nullptr, num_jobs * sizeof(uint32_t),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (slots == MAP_FAILED) {
+    std::cerr << "[bb_cov] Failed to map shared replay slots." << std::endl;
     exit(1);
   }
+  uint32_t *num_finished = (uint32_t *)slots;
+  std::vector<uint32_t> free_slots;
+  for (uint32_t slot_idx = 0; slot_idx < num_jobs; slot_idx++) {
+    free_slots.push_back(slot_idx);
+  }
 
-  fs::path out_dir_path(outputs_dir);
-  if (!fs::exists(out_dir_path)) {
-    fs::create_directory(out_dir_path);
+  std::map<pid_t, std::pair<Batch, uint32_t>> running;
+  uint32_t num_done = 0;
+  uint32_t num_alone = 0;
+  uint32_t num_failed = 0;
+  const auto start_time = std::chrono::steady_clock::now();
+
+  while (!batches.empty() || !running.empty()) {
+    while (!batches.empty() && running.size() < num_jobs) {
+      const Batch batch = batches.front();
+      batches.pop_front();
+      const uint32_t slot_idx = free_slots.back();
+      free_slots.pop_back();
+      num_finished[slot_idx] = 0;
+
+      // do not let the children inherit unflushed output
+      std::cout.flush();
+
+      pid_t pid = fork();
+      if (pid < 0) {
+        std::cerr << "[bb_cov] Fork failed." << std::endl;
+        exit(1);
+      }
+
+      if (pid == 0) {
+        if (batch.is_alone) {
+          __run_persistent_alone(input_paths[batch.first], outputs_dir);
+        }
+        __run_persistent_worker(input_paths, batch.first, batch.last,
+                                outputs_dir, &num_finished[slot_idx]);
+      }
+
+      running[pid] = {batch, slot_idx};
+    }
+
+    int32_t status = 0;
+    const pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    auto it = running.find(pid);
+    if (it == running.end()) {
+      continue;
+    }
+    const Batch batch = it->second.first;
+    const uint32_t slot_idx = it->second.second;
+    running.erase(it);
+    free_slots.push_back(slot_idx);
+
+    if (batch.is_alone) {
+      num_done++;
+      num_alone++;
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        num_failed++;
+      }
+    } else {
+      const uint32_t finished =
+          __atomic_load_n(&num_finished[slot_idx], __ATOMIC_ACQUIRE);
+      num_done += finished;
+
+      // the input after the last finished one ended the worker
+      const uint32_t culprit = batch.first + finished;
+      if (culprit < batch.last) {
+        batches.push_front({culprit, culprit + 1, true});
+        if (culprit + 1 < batch.last) {
+          batches.push_back({culprit + 1, batch.last, false});
+        }
+      }
+    }
+
+    show_progress(num_done, num_inputs, start_time);
   }
 
-  auto dir_iter = fs::directory_iterator(dir_path);
-  const uint32_t num_inputs = std::distance(dir_iter, fs::directory_iterator{});
-  std::cout << "Found " << num_inputs << " inputs to process." << std::endl;
+  PROGRESS_BAR_END();
 
-  dir_iter = fs::directory_iterator(dir_path); // reset iterator
+  std::cout << "\n[bb_cov] All " << num_done
+            << " inputs processed in persistent mode, " << num_alone
+            << " replayed alone, " << num_failed << " of them failed."
+            << std::endl;
 
-  uint32_t input_idx = 0;
-  auto start_time = std::chrono::steady_clock::now();
+  munmap(slots, num_jobs * sizeof(uint32_t));
+  exit(0);
+}
+#endif
+
+// Directory mode: replays every input of dir_path in a forked child, which
+// returns to run the target. The parent exits once all inputs are done.
+static void __replay_inputs(char **argv, int32_t placeholder_idx,
+                            const fs::path &dir_path,
+                            const char *outputs_dir) {
+  CovModule &mod = *cov_modules[0];
+
+  fs::path out_dir_path(outputs_dir);
+  if (!fs::exists(out_dir_path)) {
+    fs::create_directory(out_dir_path);
+  }
+  for (uint32_t mod_idx = 0; mod_idx < num_cov_modules; mod_idx++) {
+    __write_cov_map(*cov_modules[mod_idx], out_dir_path);
+  }
 
-  for (const auto &entry : dir_iter) {
+  std::vector<fs::path> input_paths;
+  for (const auto &entry : fs::directory_iterator(dir_path)) {
     if (!entry.is_regular_file()) {
       continue;
     }
 
-    std::string basename = entry.path().filename().string();
-    if (basename[0] == '.') { // starts with "."
+    if (entry.path().filename().string()[0] == '.') { // starts with "."
       continue;
     }
 
+    input_paths.push_back(entry.path());
+  }
+
+  const uint32_t num_inputs = input_paths.size();
+  const uint32_t num_jobs = get_replay_jobs(REPLAY_JOBS);
+  std::cout << "Found " << num_inputs << " inputs to process with "
+            << num_jobs << " jobs." << std::endl;
+
+  const char *union_output_fn = getenv(UNION_OUTPUT_FN);
+
+#ifdef WRITE_COV_PER_BB
+  if (getenv(PERSISTENT) != nullptr) {
+    std::cerr << "[bb_cov] " << PERSISTENT
+              << " is not supported by bb_cov_instant_rt, ignoring it."
+              << std::endl;
+  }
+#else
+  const uint32_t persistent_iters = __get_persistent_iters(union_output_fn);
+  if (persistent_iters != 0) {
+    __replay_persistent(argv, input_paths, outputs_dir, num_jobs,
+                        persistent_iters);
+  }
+#endif
+
+  ReplayPool replay_pool(num_jobs, num_inputs);
+  ReplayUnion replay_union;
+
+  if (union_output_fn != nullptr) {
+    // flag, cov_arr[1..num_bbs], edge_arr and the counts
+    replay_union.slot_size = __replay_slot_counts_off(mod);
+    if (is_counts) {
+      replay_union.slot_size += (mod.num_bbs + 1) * sizeof(uint64_t);
+    }
+    void *slots = mmap(nullptr, replay_union.slot_size * num_jobs,
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+                       0);
+    if (slots == MAP_FAILED) {
+      std::cerr << "[bb_cov] Failed to map shared replay slots." << std::endl;
+      exit(1);
+    }
+
+    replay_union.slots = (char *)slots;
+    for (uint32_t slot_idx = 0; slot_idx < num_jobs; slot_idx++) {
+      replay_union.free_slots.push_back(slot_idx);
+    }
+    replay_union.union_cov.assign(mod.num_bbs + 1, 0);
+    replay_union.union_edge_cov.assign(mod.num_cov_edges, 0);
+    if (is_counts) {
+      replay_union.union_counts.assign(mod.num_bbs + 1, 0);
+    }
+
+    replay_pool.set_on_exit([&mod, &replay_union](pid_t pid, int32_t status) {
+      __merge_replay_slot(mod, replay_union, pid, status);
+    });
+  }
+
+  const char *env_per_input = getenv(PER_INPUT_OUTPUT);
+  const bool write_per_input =
+      env_per_input == nullptr || strcmp(env_per_input, "0") != 0;
+  if (!write_per_input && union_output_fn == nullptr) {
+    std::cerr << "[bb_cov] " << PER_INPUT_OUTPUT << "=0 needs "
+              << UNION_OUTPUT_FN << ", ignoring it." << std::endl;
+  }
+
+#ifndef WRITE_COV_PER_BB
+  // the children write their report from here in a crash
+  for (uint32_t mod_idx = 0; mod_idx < num_cov_modules; mod_idx++) {
+    if (write_per_input || union_output_fn == nullptr) {
+      __prepare_emergency_cov(*cov_modules[mod_idx]);
+    }
+  }
+#endif
+
+  for (uint32_t input_idx = 0; input_idx < num_inputs; input_idx++) {
+    const fs::path &input = input_paths[input_idx];
+    replay_pool.wait_for_slot();
+
+    char *slot = nullptr;
+    uint32_t slot_idx = 0;
+    if (union_output_fn != nullptr) {
+      slot_idx = replay_union.free_slots.back();
+      replay_union.free_slots.pop_back();
+      slot = replay_union.slots + slot_idx * replay_union.slot_size;
+      slot[0] = 0;
+    }
+
+    // do not let the children inherit unflushed output
+    std::cout.flush();
+
     pid_t pid = fork();
 
     if (pid < 0) {
@@ -158,306 +1146,375 @@ void __handle_init(int32_t *argc_ptr, char **argv) {
     if (pid == 0) {
       // child process
 
-      // devnull
-      int devnull_fd = open("/dev/null", O_RDWR);
-      dup2(devnull_fd, STDOUT_FILENO);
-      dup2(devnull_fd, STDERR_FILENO);
-      close(devnull_fd);
-
-      std::string input_path = entry.path().string();
-      size_t path_size = input_path.length() + 1;
-      char *input_path_cstr = new char[path_size];
-      strncpy(input_path_cstr, input_path.c_str(), path_size);
-      argv[placeholder_idx] = input_path_cstr; // memory leak ...
-
-      size_t pos = basename.find(',');
-      if (pos != std::string::npos) {
-        basename = basename.substr(0, pos);
-      }
-      std::string output_path = std::string(outputs_dir) + "/" + basename;
-      path_size = output_path.length() + 1;
+      redirect_to_devnull();
+
+      set_placeholder(argv, placeholder_idx, input.string().c_str());
+
+      std::string output_path =
+          get_replay_output_path(input.string(), outputs_dir);
+      size_t path_size = output_path.length() + 1;
 
       char *output_path_cstr = new char[path_size];
       strncpy(output_path_cstr, output_path.c_str(),
               path_size); // memory leak ...
       cov_output_fn = output_path_cstr;
 
-#ifdef WRITE_COV_PER_BB
-      __cov_read_prev_cov();
+      replay_slot = slot;
+      write_cov_file = write_per_input || union_output_fn == nullptr;
+
+      __set_output_fns();
+      for (uint32_t mod_idx = 0; mod_idx < num_cov_modules; mod_idx++) {
+        __open_module(*cov_modules[mod_idx]);
+      }
+#ifndef WRITE_COV_PER_BB
+      __install_emergency_writer();
 #endif
 
       return;
     }
 
-    int32_t status = 0;
-    waitpid(pid, &status, 0);
-
-    input_idx++;
-    show_progress(input_idx, num_inputs, start_time);
+    if (union_output_fn != nullptr) {
+      replay_union.running[pid] = {slot_idx, input_idx};
+    }
+    replay_pool.add_child(pid);
   }
 
+  replay_pool.wait_all();
+
   PROGRESS_BAR_END();
 
-  std::cout << "\n[bb_cov] All " << input_idx << " inputs processed."
-            << std::endl;
+  std::cout << "\n[bb_cov] All " << replay_pool.get_num_done()
+            << " inputs processed." << std::endl;
+
+  if (union_output_fn != nullptr) {
+    __write_replay_union(mod, union_output_fn, replay_union, input_paths);
+    munmap(replay_union.slots, replay_union.slot_size * num_jobs);
+  }
   exit(0);
 }
 
-void __record_bb_cov(const char *file_name, const char *func_name,
-                     const char *bb_name, const uint32_t bb_id) {
-  if (bb_cov_arr == nullptr) {
-    return;
+void __handle_init(int32_t *argc_ptr, char **argv) {
+  __init_modules();
+
+#ifdef BB_COV_HITCOUNT
+  // also makes the link fail for targets built without -bbcov-hitcount
+  if (__bb_cov_hitcount_mode != 1) {
+    std::cerr << "[bb_cov] Unexpected hit-count mode marker." << std::endl;
+    exit(1);
   }
+#endif
 
-  // Hack to reduce lock contention
-  if (bb_cov_arr[bb_id] == 1) {
+#ifdef BB_COV_COUNTS
+  // also makes the link fail for targets built without -bbcov-counts
+  if (__bb_cov_counts_mode != 1) {
+    std::cerr << "[bb_cov] Unexpected counting mode marker." << std::endl;
+    exit(1);
+  }
+#endif
+
+  __init_output_format();
+
+  // afl-fuzz gives the input in argv itself, the arguments are left alone
+  if (__init_afl(*argc_ptr, argv)) {
+#ifndef WRITE_COV_PER_BB
+    __install_emergency_writer();
+#endif
     return;
   }
 
-  {
-    static std::mutex bb_cov_mutex;
-    std::lock_guard<std::mutex> guard(bb_cov_mutex);
-    if (bb_cov_arr[bb_id] == 1) {
-      return;
+  // bbcov-run replays the inputs, the arguments are left alone
+  if (is_forkserver_requested()) {
+    for (uint32_t mod_idx = 0; mod_idx < num_cov_modules; mod_idx++) {
+      cov_modules[mod_idx]->bb_cov_arr = cov_modules[mod_idx]->cov_arr;
     }
-    bb_cov_arr[bb_id] = 1;
+
+    const int32_t argc = *argc_ptr;
+    run_at_init_point(is_init_deferred(DEFER_INIT), argc, argv,
+                      [argc, argv]() { __serve_bbcov_run(argc, argv); });
+    return;
   }
 
-  uint8_t file_hash = bb_cov_simple_hash(file_name);
-  uint8_t func_hash = bb_cov_simple_hash(func_name);
-  uint8_t bb_hash = bb_cov_simple_hash(bb_name);
+  const char *env_output_fn = getenv(OUTPUT_FN);
 
-  const CFileEntry *file_entry = __file_func_map[file_hash];
-  // skip nullptr checks for speed, entry pointers should not be nullptr
+  if (env_output_fn != nullptr) {
+    cov_output_fn = env_output_fn;
 
-  while (file_entry != nullptr) {
-    if (file_entry->filename == file_name) {
-      break;
+    std::cout << "[bb_cov] Found environment variable " << OUTPUT_FN
+              << ", setting coverage output file to " << cov_output_fn
+              << std::endl;
+
+    __set_output_fns();
+    for (uint32_t mod_idx = 0; mod_idx < num_cov_modules; mod_idx++) {
+      __open_module(*cov_modules[mod_idx]);
     }
-    file_entry = file_entry->next;
-  }
+#ifndef WRITE_COV_PER_BB
+    __install_emergency_writer();
+#endif
 
-  if (file_entry == nullptr) {
-    std::cerr << "[bb_cov] Failed to find file entry for " << file_name
-              << ", hash: " << (uint32_t)file_hash << std::endl;
+    __print_num_bbs();
     return;
   }
 
-  const CFuncEntry *func_entry = file_entry->funcs[func_hash];
-  while (func_entry != nullptr) {
-    if (func_entry->func_name == func_name) {
-      break;
-    }
-    func_entry = func_entry->next;
+  int32_t argc = *argc_ptr;
+
+  if (argc < 2) {
+    std::cout << "[bb_cov] Usage : " << argv[0]
+              << " <args ...> [cov_output_fn] [inputs_dir] [cov_output_dir] \n";
+    std::cout << "  <args ...> : arguments for the target program\n";
+    std::cout
+        << "  if @@ placeholder is NOT in <args ...>, it is considered as a "
+           "normal execution with coverage instrumentation, and generates "
+           "coverage report output file to [cov_output_fn].\n\n";
+    std::cout << "  if @@ placeholder is in <args ...>, it is considered as "
+                 "replaying all inputs in <inputs_dir> and generating coverage "
+                 "reports to [cov_output_dir].\n";
+    exit(1);
   }
 
-  CBBEntry *bb_entry = func_entry->bbs[bb_hash];
-  while (bb_entry != nullptr) {
-    if (bb_entry->bb_name == bb_name) {
-      break;
+  const int32_t placeholder_idx = find_placeholder(argc, argv);
+
+  if (placeholder_idx == -1) {
+    // normal execution with one input file
+    int32_t new_argc = argc - 1;
+    cov_output_fn = argv[new_argc];
+    argv[new_argc] = nullptr;
+    *argc_ptr = new_argc;
+    __print_num_bbs();
+    std::cout << "[bb_cov] Coverage output file: " << cov_output_fn
+              << std::endl;
+    __set_output_fns();
+    for (uint32_t mod_idx = 0; mod_idx < num_cov_modules; mod_idx++) {
+      __open_module(*cov_modules[mod_idx]);
     }
-    bb_entry = bb_entry->next;
+#ifndef WRITE_COV_PER_BB
+    __install_emergency_writer();
+#endif
+    return;
   }
-  bb_entry->is_covered = 1;
 
-#ifdef WRITE_COV_PER_BB
-  __write_cov();
-#endif
+  std::cout << "[bb_cov] Replaying all inputs in directory mode." << std::endl;
 
-  return;
+  *argc_ptr = argc - 2;
+  const char *inputs_dir = argv[argc - 2];
+  const char *outputs_dir = argv[argc - 1];
+  argv[argc - 2] = nullptr;
+  argv[argc - 1] = nullptr;
+
+  fs::path dir_path(inputs_dir);
+
+  if (!fs::exists(dir_path) || !fs::is_directory(dir_path)) {
+    std::cerr
+        << "[bb_cov] Inputs directory does not exist or is not a directory."
+        << std::endl;
+    exit(1);
+  }
+
+  // the initialization of the target before the fork point is covered too
+  for (uint32_t mod_idx = 0; mod_idx < num_cov_modules; mod_idx++) {
+    cov_modules[mod_idx]->bb_cov_arr = cov_modules[mod_idx]->cov_arr;
+  }
+
+  run_at_init_point(
+      is_init_deferred(DEFER_INIT), *argc_ptr, argv,
+      [argv, placeholder_idx, dir_path, outputs_dir]() {
+        __replay_inputs(argv, placeholder_idx, dir_path, outputs_dir);
+      });
 }
 
-static void __write_cov() {
-  if (cov_output_fn == nullptr) {
-    std::cerr << "[bb_cov] No coverage information collected." << std::endl;
+void __record_bb_cov(const uint32_t bb_id) {
+  CovModule *mod = __find_module(bb_id);
+  if (mod == nullptr) {
     return;
   }
 
-  static std::mutex write_mutex;
-  std::lock_guard<std::mutex> guard(write_mutex);
-
-  std::ofstream cov_file_out(cov_output_fn, std::ios::out);
-  if (!cov_file_out.is_open()) {
-    std::cerr << "[bb_cov] Failed to open coverage output file." << std::endl;
+  char *bb_cov_arr = __atomic_load_n(&mod->bb_cov_arr, __ATOMIC_ACQUIRE);
+  if (bb_cov_arr == nullptr) {
     return;
   }
 
-  const int hash_map_size = sizeof(uint8_t) * 256;
-  for (size_t file_idx = 0; file_idx < hash_map_size; file_idx++) {
-    const CFileEntry *file_entry = __file_func_map[file_idx];
-    while (file_entry != nullptr) {
-      const char *file_name = file_entry->filename;
-      cov_file_out << "File " << file_name << "\n";
+  const uint32_t mod_bb_id = bb_id - mod->id_base;
 
-      // to merge with previous coverage info, fetch previous coverage
-      const std::map<std::string, std::set<std::string>> *prev_file_cov =
-          nullptr;
-      auto search = prev_cov.find(file_name);
-      if (search != prev_cov.end()) {
-        prev_file_cov = &(search->second);
-      }
+  // Plain load first, so already covered blocks do not write the cache line
+  if (__atomic_load_n(&bb_cov_arr[mod_bb_id], __ATOMIC_RELAXED) != 0) {
+    return;
+  }
 
-      for (size_t func_idx = 0; func_idx < hash_map_size; func_idx++) {
-        const CFuncEntry *func_entry = file_entry->funcs[func_idx];
-        while (func_entry != nullptr) {
-          const char *func_name = func_entry->func_name;
-          cov_file_out << "F " << func_name << " ";
-
-          // merge with previous coverage info
-          const std::set<std::string> *prev_func_cov = nullptr;
-          if (prev_file_cov != nullptr) {
-            auto search2 = prev_file_cov->find(func_name);
-            if (search2 != prev_file_cov->end()) {
-              prev_func_cov = &(search2->second);
-            }
-          }
-
-          std::stringstream bb_ss;
-
-          bool is_func_covered = false;
-          for (size_t bb_idx = 0; bb_idx < hash_map_size; bb_idx++) {
-            const CBBEntry *bb_entry = func_entry->bbs[bb_idx];
-            while (bb_entry != nullptr) {
-              const char *bb_name = bb_entry->bb_name;
-              bool is_bb_covered = (bb_entry->is_covered != 0);
-              if (!is_bb_covered && prev_func_cov != nullptr &&
-                  prev_func_cov->find(bb_name) != prev_func_cov->end()) {
-                is_bb_covered = true;
-              }
-              is_func_covered = is_func_covered || is_bb_covered;
-
-              bb_ss << "B " << bb_name << " " << (is_bb_covered ? "1" : "0")
-                    << "\n";
-
-              bb_entry = bb_entry->next;
-            }
-          }
-
-          cov_file_out << (is_func_covered ? "1" : "0") << "\n";
-
-          cov_file_out << bb_ss.str();
-
-          func_entry = func_entry->next;
-        }
-      }
+  // Exactly one thread wins the first hit
+  if (__atomic_exchange_n(&bb_cov_arr[mod_bb_id], 1, __ATOMIC_RELAXED) != 0) {
+    return;
+  }
 
-      file_entry = file_entry->next;
-    }
+#ifdef WRITE_COV_PER_BB
+  // the store above already reached the mapped sidecar
+  if (write_cov_file && !mod->sidecar_mapped) {
+    __write_cov(*mod);
+  }
+#else
+  if (mod->dirty_pages != nullptr) {
+    mod->dirty_pages[mod_bb_id / BB_COV_PAGE_SIZE] = 1;
   }
+#endif
 
-  cov_file_out.close();
   return;
 }
 
-static void __cov_read_prev_cov() {
-  if (cov_output_fn == nullptr) {
+#ifndef WRITE_COV_PER_BB
+// Emergency writer for fatal signals and quick_exit, which skip __cov_fini.
+// The report is formatted in advance with the previous coverage merged, so
+// the writer only flips digits (or bits) in place and calls write(2). Every
+// module gets its own report.
+static struct sigaction prev_sigactions[NSIG];
+
+static const int emergency_signals[] = {SIGSEGV, SIGBUS,  SIGABRT,
+                                        SIGFPE,  SIGILL, SIGTERM};
+
+// Async-signal-safe
+static void __write_module_emergency(CovModule &mod) {
+  if (mod.emergency_buf == nullptr) {
     return;
   }
 
-  static std::mutex read_prev_cov_mutex;
-  std::lock_guard<std::mutex> guard(read_prev_cov_mutex);
+  __fill_emergency_cov(mod);
 
-  if (prev_cov.size() != 0) {
+  int fd = open(mod.output_fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
     return;
   }
 
-  std::ifstream cov_file_in(cov_output_fn, std::ios::in);
-  if (!cov_file_in.is_open()) {
+  write_all(fd, mod.emergency_buf, mod.emergency_size);
+  close(fd);
+}
+
+// Async-signal-safe
+static void __write_cov_emergency() {
+  const uint32_t num_modules =
+      __atomic_load_n(&num_cov_modules, __ATOMIC_ACQUIRE);
+  if (num_modules == 0 || cov_modules[0]->bb_cov_arr == nullptr) {
     return;
   }
 
-  std::cout << "[bb_cov] Found existing coverage file, reading ...\n";
-  std::string type;
-  std::string name;
-  bool is_covered = false;
-  std::string cur_func = "";
-  std::string line;
-
-  std::map<std::string, std::set<std::string>> *cur_file_map = nullptr;
-  std::set<std::string> *cur_func_map = nullptr;
-
-  bool found_error = false;
+  // __cov_fini or another thread got here first
+  if (__atomic_exchange_n(&cov_flushed, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
 
-  while (getline(cov_file_in, line)) {
-    if (line.length() == 0) {
+  for (uint32_t mod_idx = 0; mod_idx < num_modules; mod_idx++) {
+    CovModule &mod = *cov_modules[mod_idx];
+    if (mod.bb_cov_arr == nullptr) {
+      // unloaded and written already
       continue;
     }
 
-    auto pos1 = line.find(" ");
+    __collect_cov(mod);
 
-    if (pos1 == std::string::npos) {
-      found_error = true;
-      break;
+    // the parent of a replay child only collects the executable
+    if (mod_idx == 0 && replay_slot != nullptr) {
+      __write_replay_slot(mod);
+    }
+    if (afl_area != nullptr) {
+      __write_afl_area(mod);
     }
 
-    auto pos2 = line.find_last_of(" ");
+    __write_module_emergency(mod);
+  }
+}
 
-    if (pos2 == std::string::npos) {
-      found_error = true;
-      break;
-    }
+static void __emergency_signal_handler(int sig) {
+  __write_cov_emergency();
 
-    type = line.substr(0, pos1);
-    name = line.substr(pos1 + 1, pos2 - pos1 - 1);
-    is_covered = line.substr(pos2 + 1) == "1";
+  // deliver the signal again to the previous handler (or the default action)
+  // once this handler returns
+  sigaction(sig, &prev_sigactions[sig], nullptr);
+  raise(sig);
+}
 
-    if (type == "File") {
-      cur_file_map =
-          &prev_cov
-               .try_emplace(name,
-                            std::map<std::string, std::set<std::string>>())
-               .first->second;
-      continue;
-    }
+static void __emergency_quick_exit_handler() { __write_cov_emergency(); }
+
+static void __install_emergency_writer() {
+  // handle stack overflows too
+  static char emergency_stack[1 << 16];
+  stack_t cur_stack;
+  if (sigaltstack(nullptr, &cur_stack) == 0 &&
+      (cur_stack.ss_flags & SS_DISABLE) != 0) {
+    stack_t new_stack = {};
+    new_stack.ss_sp = emergency_stack;
+    new_stack.ss_size = sizeof(emergency_stack);
+    sigaltstack(&new_stack, nullptr);
+  }
 
-    if (!is_covered) {
+  struct sigaction action = {};
+  action.sa_handler = __emergency_signal_handler;
+  action.sa_flags = SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+  for (const int sig : emergency_signals) {
+    sigaction(sig, &action, &prev_sigactions[sig]);
+  }
+
+  // exit() from code that is not instrumented, e.g. shared libraries
+  atexit(__cov_fini);
+  at_quick_exit(__emergency_quick_exit_handler);
+}
+#endif
+
+void __cov_fini() {
+  const uint32_t num_modules =
+      __atomic_load_n(&num_cov_modules, __ATOMIC_ACQUIRE);
+  if (num_modules == 0 || cov_modules[0]->bb_cov_arr == nullptr) {
+    return;
+  }
+
+  // the process that should have forked, it has no input of its own
+  if (is_init_point_missed()) {
+    return;
+  }
+
+  // the emergency writer got here first
+  if (__atomic_exchange_n(&cov_flushed, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+
+  for (uint32_t mod_idx = 0; mod_idx < num_modules; mod_idx++) {
+    CovModule &mod = *cov_modules[mod_idx];
+    if (mod.bb_cov_arr == nullptr) {
+      // unloaded and written already
       continue;
     }
 
-    if (type == "F") {
-      if (cur_file_map == nullptr) {
-        found_error = true;
-        continue;
-      }
+    __collect_cov(mod);
 
-      cur_func_map = &(*cur_file_map)
-                          .try_emplace(name, std::set<std::string>())
-                          .first->second;
-      continue;
+    // the parent of a replay child only collects the executable
+    if (mod_idx == 0 && replay_slot != nullptr) {
+      __write_replay_slot(mod);
+    }
+    if (afl_area != nullptr) {
+      __write_afl_area(mod);
     }
 
-    if (cur_func_map == nullptr) {
-      found_error = true;
+    // the replay parent has no output file for the shared libraries
+    if (!write_cov_file || (mod_idx != 0 && mod.output_fn.empty())) {
+      mod.bb_cov_arr = nullptr;
       continue;
     }
 
-    cur_func_map->insert(name);
-  }
-  cov_file_in.close();
+    // previous coverage collected from existing coverage files
+    __cov_read_prev_cov(mod);
 
-  if (found_error) {
-    std::cout << "Error reading existing coverage file, coverage may be not "
-                 "accurate"
-              << std::endl;
-  }
-  return;
-}
-
-void __cov_fini() {
-  if (bb_cov_arr == nullptr) {
-    return;
-  }
+    if (mod_idx == 0) {
+      std::cout << "[bb_cov] Writing coverage info to files..." << std::endl;
+    }
+    const bool is_written = __write_cov(mod);
 
-  // previous coverage collected from existing coverage files
-#ifndef WRITE_COV_PER_BB
-  __cov_read_prev_cov();
+#ifdef WRITE_COV_PER_BB
+    // the output file now holds everything the sidecar had
+    if (is_written && mod.sidecar_mapped) {
+      unlink((mod.output_fn + BB_COV_SIDECAR_SUFFIX).c_str());
+    }
+#else
+    (void)is_written;
 #endif
 
-  std::cout << "[bb_cov] Writing coverage info to files..." << std::endl;
-  __write_cov();
-
-  free(bb_cov_arr);
-  bb_cov_arr = nullptr;
+    mod.bb_cov_arr = nullptr;
+  }
   return;
 }
 
@@ -1,154 +1,108 @@
 #include "bb/bb_map.hpp"
 
-#include <string.h>
-
-#include "utils/hash.hpp"
-
 #pragma clang attribute push(__attribute__((annotate("probe_function"))),      \
                              apply_to = function)
 
-GFuncEntry *insert_FileFuncEntry(GFileEntry **file_map,
-                                 const std::string &filename,
-                                 llvm::GlobalVariable *file_gvar,
-                                 const std::string &func_name,
-                                 llvm::GlobalVariable *func_gvar) {
-  GFileEntry *file_entry = insert_FileEntry(file_map, filename, file_gvar);
-
-  uint8_t func_name_hash = bb_cov_simple_hash(func_name);
-
-  if (file_entry->funcs[func_name_hash] == nullptr) {
-    GFuncEntry *new_entry = new GFuncEntry();
-    memset(new_entry, 0, sizeof(GFuncEntry));
-    new_entry->func_gvar = func_gvar;
-    file_entry->funcs[func_name_hash] = new_entry;
-    return new_entry;
+uint32_t GStrTab::get_offset(const std::string &str) {
+  auto search = offsets.find(str);
+  if (search != offsets.end()) {
+    return search->second;
   }
 
-  GFuncEntry *cur = file_entry->funcs[func_name_hash];
-  GFuncEntry *prev = NULL;
-  while (cur != NULL) {
-    if (cur->func_gvar == func_gvar) {
-      return cur;
-    }
-    prev = cur;
-    cur = cur->next;
-  }
-
-  GFuncEntry *new_entry = new GFuncEntry();
-  memset(new_entry, 0, sizeof(GFuncEntry));
-  new_entry->func_gvar = func_gvar;
-  prev->next = new_entry;
-
-  return new_entry;
+  const uint32_t offset = data.size();
+  data.append(str);
+  data.push_back('\0');
+  offsets.insert(std::make_pair(str, offset));
+  return offset;
 }
 
-GFileEntry *insert_FileEntry(GFileEntry **file_map, const std::string &filename,
-                             llvm::GlobalVariable *file_gvar) {
-  uint8_t filename_hash = bb_cov_simple_hash(filename);
-
-  llvm::outs() << "Inserting file entry for file: " << filename
-               << " with hash: " << (uint32_t)filename_hash << "\n";
+const std::string &GStrTab::get_data() const {
+  return data;
+}
 
-  if (file_map[filename_hash] == nullptr) {
-    GFileEntry *new_entry = new GFileEntry();
+uint32_t GBBMap::insert_bb(const std::string &filename,
+                           const std::string &func_name,
+                           const std::string &bb_name) {
+  const uint32_t file_off = strtab.get_offset(filename);
+  const uint32_t func_off = strtab.get_offset(func_name);
+  const uint32_t bb_off = strtab.get_offset(bb_name);
+
+  auto file_search = file_indices.find(file_off);
+  if (file_search == file_indices.end()) {
+    file_search =
+        file_indices.insert(std::make_pair(file_off, file_groups.size())).first;
+    file_groups.push_back(std::make_pair(file_off, std::vector<uint32_t>()));
+  }
 
-    memset(new_entry, 0, sizeof(GFileEntry));
-    new_entry->file_gvar = file_gvar;
-    file_map[filename_hash] = new_entry;
-    return new_entry;
+  const std::pair<uint32_t, uint32_t> func_key = {file_off, func_off};
+  auto func_search = func_indices.find(func_key);
+  if (func_search == func_indices.end()) {
+    func_search =
+        func_indices.insert(std::make_pair(func_key, func_groups.size())).first;
+    file_groups[file_search->second].second.push_back(func_groups.size());
+    func_groups.push_back(FuncGroup{file_off, func_off, {}, {}});
   }
 
-  GFileEntry *cur = file_map[filename_hash];
-  GFileEntry *prev = NULL;
-  while (cur != NULL) {
-    if (cur->file_gvar == file_gvar) {
-      return cur;
-    }
-    prev = cur;
-    cur = cur->next;
+  const uint32_t func_group_idx = func_search->second;
+  FuncGroup     &func_group = func_groups[func_group_idx];
+
+  auto bb_search = func_group.bb_indices.find(bb_off);
+  if (bb_search == func_group.bb_indices.end()) {
+    const uint32_t bb_idx = func_group.bb_name_offs.size();
+    bb_search =
+        func_group.bb_indices.insert(std::make_pair(bb_off, bb_idx)).first;
+    func_group.bb_name_offs.push_back(bb_off);
   }
 
-  GFileEntry *new_entry = new GFileEntry();
-  memset(new_entry, 0, sizeof(GFileEntry));
-  new_entry->file_gvar = file_gvar;
-  prev->next = new_entry;
-  return new_entry;
+  keys.push_back(std::make_pair(func_group_idx, bb_search->second));
+  return keys.size() - 1;
 }
 
-GBBEntry *insert_BBEntry(GFuncEntry *func_entry, const std::string &bb_name,
-                         llvm::GlobalVariable *bb_gvar) {
-  uint8_t bb_name_hash = bb_cov_simple_hash(bb_name);
+void GBBMap::assign_ids() {
+  func_first_bb.assign(func_groups.size(), 0);
+  funcs.clear();
+  bbs.clear();
 
-  if (func_entry->bbs[bb_name_hash] == nullptr) {
-    GBBEntry *new_entry = new GBBEntry();
-    memset(new_entry, 0, sizeof(GBBEntry));
-    new_entry->bb_gvar = bb_gvar;
-    func_entry->bbs[bb_name_hash] = new_entry;
-    return new_entry;
-  }
+  // bb_id 0 is not used
+  bbs.push_back(GBBEntry{0, 0});
 
-  GBBEntry *cur = func_entry->bbs[bb_name_hash];
-  GBBEntry *prev = NULL;
-  while (cur != NULL) {
-    if (cur->bb_gvar == bb_gvar) {
-      return cur;
-    }
-    prev = cur;
-    cur = cur->next;
-  }
+  for (const auto &file_group : file_groups) {
+    for (uint32_t func_group_idx : file_group.second) {
+      const FuncGroup &func_group = func_groups[func_group_idx];
+      const uint32_t   func_idx = funcs.size();
 
-  GBBEntry *new_entry = new GBBEntry();
-  memset(new_entry, 0, sizeof(GBBEntry));
-  new_entry->bb_gvar = bb_gvar;
-  prev->next = new_entry;
+      func_first_bb[func_group_idx] = bbs.size();
+      funcs.push_back(GFuncEntry{func_group.file_off, func_group.name_off,
+                                 (uint32_t)bbs.size(),
+                                 (uint32_t)func_group.bb_name_offs.size()});
 
-  return new_entry;
+      for (uint32_t bb_name_off : func_group.bb_name_offs) {
+        bbs.push_back(GBBEntry{func_idx, bb_name_off});
+      }
+    }
+  }
+  return;
 }
 
-void free_bb_map(GFileEntry **file_map) {
-  const uint32_t hash_map_size = sizeof(uint8_t) * 256;
+uint32_t GBBMap::get_bb_id(uint32_t key) const {
+  const std::pair<uint32_t, uint32_t> &bb_key = keys[key];
+  return func_first_bb[bb_key.first] + bb_key.second;
+}
 
-  for (size_t idx = 0; idx < hash_map_size; idx++) {
-    GFileEntry *file_entry = file_map[idx];
-    if (file_entry == NULL) {
-      continue;
-    }
+uint32_t GBBMap::get_num_bbs() const {
+  return bbs.size() - 1;
+}
 
-    while (file_entry != NULL) {
-      for (size_t func_idx = 0; func_idx < hash_map_size; func_idx++) {
-        GFuncEntry *func_entry = file_entry->funcs[func_idx];
-        if (func_entry == NULL) {
-          continue;
-        }
-
-        while (func_entry != NULL) {
-          for (size_t bb_idx = 0; bb_idx < hash_map_size; bb_idx++) {
-            GBBEntry *bb_entry = func_entry->bbs[bb_idx];
-            if (bb_entry == NULL) {
-              continue;
-            }
-
-            while (bb_entry != NULL) {
-              GBBEntry *next_bb_entry = bb_entry->next;
-              delete bb_entry;
-              bb_entry = next_bb_entry;
-            }
-          }
-
-          GFuncEntry *next_func_entry = func_entry->next;
-          delete func_entry;
-          func_entry = next_func_entry;
-        }
-      }
+const GStrTab &GBBMap::get_strtab() const {
+  return strtab;
+}
 
-      GFileEntry *next_file_entry = file_entry->next;
-      delete file_entry;
-      file_entry = next_file_entry;
-    }
-  }
+const std::vector<GFuncEntry> &GBBMap::get_funcs() const {
+  return funcs;
+}
 
-  memset(file_map, 0, sizeof(GFileEntry *) * hash_map_size);
-  return;
+const std::vector<GBBEntry> &GBBMap::get_bbs() const {
+  return bbs;
 }
 
-#pragma clang attribute pop
\ No newline at end of file
+#pragma clang attribute pop
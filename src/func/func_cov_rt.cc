@@ -14,9 +14,13 @@
 #include <map>
 #include <mutex>
 #include <set>
+#include <vector>
 
+#include "utils/forkserver.hpp"
 #include "utils/hash.hpp"
+#include "utils/init_point.hpp"
 #include "utils/progress_bar.hpp"
+#include "utils/replay.hpp"
 
 static const char *cov_output_fn = nullptr;
 
@@ -32,7 +36,111 @@ static std::map<std::string, std::set<std::string>> prev_cov;
 
 extern "C" {
 
+// Serves bbcov-run, returns in every child with its output file set
+static void __serve_bbcov_run(int32_t argc, char **argv) {
+  cov_output_fn = run_forkserver(argc, argv);
+#ifdef WRITE_COV_PER_BB
+  __cov_read_prev_cov();
+#endif
+}
+
+// Directory mode: replays every input of dir_path in a forked child, which
+// returns to run the target. The parent exits once all inputs are done.
+static void __replay_inputs(char **argv, int32_t placeholder_idx,
+                            const fs::path &dir_path,
+                            const char *outputs_dir) {
+  fs::path out_dir_path(outputs_dir);
+  if (!fs::exists(out_dir_path)) {
+    fs::create_directory(out_dir_path);
+  }
+
+  std::vector<fs::path> input_paths;
+  for (const auto &entry : fs::directory_iterator(dir_path)) {
+    if (!entry.is_regular_file()) {
+      continue;
+    }
+
+    std::string basename = entry.path().filename().string();
+    if (basename.rfind("id:", 0) != 0) { // starts with "id:"
+      continue;
+    }
+
+    input_paths.push_back(entry.path());
+  }
+
+  const uint32_t num_inputs = input_paths.size();
+  const uint32_t num_jobs = get_replay_jobs(REPLAY_JOBS);
+  std::cout << "Found " << num_inputs << " inputs to process with "
+            << num_jobs << " jobs." << std::endl;
+
+  ReplayPool replay_pool(num_jobs, num_inputs);
+
+  for (const fs::path &input : input_paths) {
+    replay_pool.wait_for_slot();
+
+    // do not let the children inherit unflushed output
+    std::cout.flush();
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+      std::cerr << "[bb_cov] Fork failed." << std::endl;
+      exit(1);
+    }
+
+    if (pid == 0) {
+      // child process
+
+      redirect_to_devnull();
+
+      set_placeholder(argv, placeholder_idx, input.string().c_str());
+
+      std::string output_path =
+          get_replay_output_path(input.string(), outputs_dir);
+      size_t path_size = output_path.length() + 1;
+
+      char *output_path_cstr = new char[path_size];
+      strncpy(output_path_cstr, output_path.c_str(),
+              path_size); // memory leak ...
+      cov_output_fn = output_path_cstr;
+
+#ifdef WRITE_COV_PER_BB
+      __cov_read_prev_cov();
+#endif
+
+      return;
+    }
+
+    replay_pool.add_child(pid);
+  }
+
+  replay_pool.wait_all();
+
+  PROGRESS_BAR_END();
+
+  std::cout << "\n[bb_cov] All " << replay_pool.get_num_done()
+            << " inputs processed." << std::endl;
+  exit(0);
+}
+
 void __handle_init(int32_t *argc_ptr, char **argv) {
+  // bbcov-run replays the inputs, the arguments are left alone
+  if (is_forkserver_requested()) {
+    func_cov_arr = (char *)malloc(__num_funcs);
+    if (func_cov_arr == nullptr) {
+      std::cerr << "[func_cov] Failed to allocate memory for coverage array."
+                << std::endl;
+      exit(1);
+    }
+
+    memset(func_cov_arr, 0, __num_funcs);
+
+    const int32_t argc = *argc_ptr;
+    run_at_init_point(is_init_deferred(DEFER_INIT), argc, argv,
+                      [argc, argv]() { __serve_bbcov_run(argc, argv); });
+    return;
+  }
+
   const char *env_output_fn = getenv(OUTPUT_FN);
 
   if (env_output_fn != nullptr) {
@@ -73,13 +181,7 @@ void __handle_init(int32_t *argc_ptr, char **argv) {
     exit(1);
   }
 
-  uint32_t placeholder_idx = -1;
-  for (uint32_t idx = 1; idx < (uint32_t)argc; idx++) {
-    if (strncmp(argv[idx], "@@", 3) == 0) {
-      placeholder_idx = idx;
-      break;
-    }
-  }
+  const int32_t placeholder_idx = find_placeholder(argc, argv);
 
   // Initialize func_cov_arr
   func_cov_arr = (char *)malloc(__num_funcs);
@@ -125,84 +227,11 @@ void __handle_init(int32_t *argc_ptr, char **argv) {
     exit(1);
   }
 
-  fs::path out_dir_path(outputs_dir);
-  if (!fs::exists(out_dir_path)) {
-    fs::create_directory(out_dir_path);
-  }
-
-  auto dir_iter = fs::directory_iterator(dir_path);
-  const uint32_t num_inputs = std::distance(dir_iter, fs::directory_iterator{});
-  std::cout << "Found " << num_inputs << " inputs to process." << std::endl;
-
-  dir_iter = fs::directory_iterator(dir_path); // reset iterator
-
-  uint32_t input_idx = 0;
-  auto start_time = std::chrono::steady_clock::now();
-
-  for (const auto &entry : dir_iter) {
-    std::string basename = entry.path().filename().string();
-    if (!entry.is_regular_file()) {
-      continue;
-    }
-
-    basename = entry.path().filename().string();
-    if (basename.rfind("id:", 0) != 0) { // starts with "id:"
-      continue;
-    }
-
-    pid_t pid = fork();
-
-    if (pid < 0) {
-      std::cerr << "[bb_cov] Fork failed." << std::endl;
-      exit(1);
-    }
-
-    if (pid == 0) {
-      // child process
-
-      // devnull
-      int devnull_fd = open("/dev/null", O_RDWR);
-      dup2(devnull_fd, STDOUT_FILENO);
-      dup2(devnull_fd, STDERR_FILENO);
-      close(devnull_fd);
-
-      std::string input_path = entry.path().string();
-      size_t path_size = input_path.length() + 1;
-      char *input_path_cstr = new char[path_size];
-      strncpy(input_path_cstr, input_path.c_str(), path_size);
-      argv[placeholder_idx] = input_path_cstr; // memory leak ...
-
-      size_t pos = basename.find(',');
-      if (pos != std::string::npos) {
-        basename = basename.substr(0, pos);
-      }
-      std::string output_path = std::string(outputs_dir) + "/" + basename;
-      path_size = output_path.length() + 1;
-
-      char *output_path_cstr = new char[path_size];
-      strncpy(output_path_cstr, output_path.c_str(),
-              path_size); // memory leak ...
-      cov_output_fn = output_path_cstr;
-
-#ifdef WRITE_COV_PER_BB
-      __cov_read_prev_cov();
-#endif
-
-      return;
-    }
-
-    int32_t status = 0;
-    waitpid(pid, &status, 0);
-
-    input_idx++;
-    show_progress(input_idx, num_inputs, start_time);
-  }
-
-  PROGRESS_BAR_END();
-
-  std::cout << "\n[bb_cov] All " << input_idx << " inputs processed."
-            << std::endl;
-  exit(0);
+  run_at_init_point(
+      is_init_deferred(DEFER_INIT), *argc_ptr, argv,
+      [argv, placeholder_idx, dir_path, outputs_dir]() {
+        __replay_inputs(argv, placeholder_idx, dir_path, outputs_dir);
+      });
 }
 
 void __record_func_cov(const char *file_name, const char *func_name,
@@ -211,18 +240,14 @@ void __record_func_cov(const char *file_name, const char *func_name,
     return;
   }
 
-  // Hack to reduce lock contention
-  if (func_cov_arr[func_id] == 1) {
+  // Plain load first, so already covered functions do not write the cache line
+  if (__atomic_load_n(&func_cov_arr[func_id], __ATOMIC_RELAXED) != 0) {
     return;
   }
 
-  {
-    static std::mutex func_cov_mutex;
-    std::lock_guard<std::mutex> guard(func_cov_mutex);
-    if (func_cov_arr[func_id] == 1) {
-      return;
-    }
-    func_cov_arr[func_id] = 1;
+  // Exactly one thread wins the first hit
+  if (__atomic_exchange_n(&func_cov_arr[func_id], 1, __ATOMIC_RELAXED) != 0) {
+    return;
   }
 
   uint8_t file_hash = bb_cov_simple_hash(file_name);
@@ -396,6 +421,11 @@ void __cov_fini() {
     return;
   }
 
+  // the process that should have forked, it has no input of its own
+  if (is_init_point_missed()) {
+    return;
+  }
+
   // previous coverage collected from existing coverage files
 #ifndef WRITE_COV_PER_FUNC
   __cov_read_prev_cov();
@@ -11,9 +11,13 @@
 #include <fstream>
 #include <iostream>
 #include <mutex>
+#include <vector>
 
+#include "utils/forkserver.hpp"
 #include "utils/hash.hpp"
+#include "utils/init_point.hpp"
 #include "utils/progress_bar.hpp"
+#include "utils/replay.hpp"
 
 static std::ofstream seq_output_f;
 static std::mutex    cov_mutex;
@@ -22,15 +26,87 @@ static std::mutex    cov_mutex;
 
 namespace fs = std::filesystem;
 
-#define FORKSRV_READ_FD 198
-#define FORKSRV_WRITE_FD (FORKSRV_READ_FD + 1)
-
 #pragma clang attribute push(__attribute__((annotate("probe_function"))), \
                              apply_to = function)
 
 extern "C" {
 
+// Directory mode: replays every input of dir_path in a forked child, which
+// returns to run the target. The parent exits once all inputs are done.
+static void __replay_inputs(char **argv, int32_t placeholder_idx,
+                            const fs::path &dir_path,
+                            const char *outputs_dir) {
+  fs::path out_dir_path(outputs_dir);
+  if (!fs::exists(out_dir_path)) { fs::create_directory(out_dir_path); }
+
+  std::vector<fs::path> input_paths;
+  for (const auto &entry : fs::directory_iterator(dir_path)) {
+    if (!entry.is_regular_file()) { continue; }
+
+    std::string basename = entry.path().filename().string();
+    if (basename.rfind("id:", 0) != 0) {  // starts with "id:"
+      continue;
+    }
+
+    input_paths.push_back(entry.path());
+  }
+
+  const uint32_t num_inputs = input_paths.size();
+  const uint32_t num_jobs = get_replay_jobs(REPLAY_JOBS);
+  std::cout << "Found " << num_inputs << " inputs to process with "
+            << num_jobs << " jobs.\n";
+
+  ReplayPool replay_pool(num_jobs, num_inputs);
+
+  for (const fs::path &input : input_paths) {
+    replay_pool.wait_for_slot();
+
+    // do not let the children inherit unflushed output
+    std::cout.flush();
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+      std::cerr << "[func_seq] Fork failed." << std::endl;
+      exit(1);
+    }
+
+    if (pid == 0) {
+      // child process
+
+      redirect_to_devnull();
+
+      set_placeholder(argv, placeholder_idx, input.string().c_str());
+
+      std::string output_path =
+          get_replay_output_path(input.string(), outputs_dir);
+      seq_output_f.open(output_path);
+
+      return;
+    }
+
+    replay_pool.add_child(pid);
+  }
+
+  replay_pool.wait_all();
+
+  PROGRESS_BAR_END();
+
+  std::cout << "\n[func_seq] All " << replay_pool.get_num_done()
+            << " inputs processed.\n";
+  exit(0);
+}
+
 void __handle_init(int32_t *argc_ptr, char **argv) {
+  // bbcov-run replays the inputs, the arguments are left alone
+  if (is_forkserver_requested()) {
+    const int32_t argc = *argc_ptr;
+    run_at_init_point(is_init_deferred(DEFER_INIT), argc, argv, [argc, argv]() {
+      seq_output_f.open(run_forkserver(argc, argv));
+    });
+    return;
+  }
+
   const char *env_output_fn = getenv(OUTPUT_FN);
 
   if (env_output_fn != nullptr) {
@@ -63,13 +139,7 @@ void __handle_init(int32_t *argc_ptr, char **argv) {
     exit(1);
   }
 
-  uint32_t placeholder_idx = -1;
-  for (uint32_t idx = 1; idx < (uint32_t)argc; idx++) {
-    if (strncmp(argv[idx], "@@", 3) == 0) {
-      placeholder_idx = idx;
-      break;
-    }
-  }
+  const int32_t placeholder_idx = find_placeholder(argc, argv);
 
   if (placeholder_idx == -1) {
     // normal execution with one input file
@@ -100,69 +170,11 @@ void __handle_init(int32_t *argc_ptr, char **argv) {
     exit(1);
   }
 
-  fs::path out_dir_path(outputs_dir);
-  if (!fs::exists(out_dir_path)) { fs::create_directory(out_dir_path); }
-
-  auto           dir_iter = fs::directory_iterator(dir_path);
-  const uint32_t num_inputs = std::distance(dir_iter, fs::directory_iterator{});
-  std::cout << "Found " << num_inputs << " inputs to process.\n";
-
-  dir_iter = fs::directory_iterator(dir_path);  // reset iterator
-
-  uint32_t input_idx = 0;
-  auto     start_time = std::chrono::steady_clock::now();
-
-  for (const auto &entry : dir_iter) {
-    std::string basename = entry.path().filename().string();
-
-    if (!entry.is_regular_file()) { continue; }
-
-    basename = entry.path().filename().string();
-    if (basename.rfind("id:", 0) != 0) {  // starts with "id:"
-      continue;
-    }
-
-    pid_t pid = fork();
-
-    if (pid < 0) {
-      std::cerr << "[func_seq] Fork failed." << std::endl;
-      exit(1);
-    }
-
-    if (pid == 0) {
-      // child process
-
-      // devnull
-      int devnull_fd = open("/dev/null", O_RDWR);
-      dup2(devnull_fd, STDOUT_FILENO);
-      dup2(devnull_fd, STDERR_FILENO);
-      close(devnull_fd);
-
-      std::string input_path = entry.path().string();
-      size_t      path_size = input_path.length() + 1;
-      char       *input_path_cstr = new char[path_size];
-      strncpy(input_path_cstr, input_path.c_str(), path_size);
-      argv[placeholder_idx] = input_path_cstr;  // memory leak ...
-
-      size_t pos = basename.find(',');
-      if (pos != std::string::npos) { basename = basename.substr(0, pos); }
-      std::string output_path = std::string(outputs_dir) + "/" + basename;
-      seq_output_f.open(output_path);
-
-      return;
-    }
-
-    int32_t status = 0;
-    waitpid(pid, &status, 0);
-
-    input_idx++;
-    show_progress(input_idx, num_inputs, start_time);
-  }
-
-  PROGRESS_BAR_END();
-
-  std::cout << "\n[func_seq] All " << input_idx << " inputs processed.\n";
-  exit(0);
+  run_at_init_point(
+      is_init_deferred(DEFER_INIT), *argc_ptr, argv,
+      [argv, placeholder_idx, dir_path, outputs_dir]() {
+        __replay_inputs(argv, placeholder_idx, dir_path, outputs_dir);
+      });
 }
 
 void __record_func_entry(const char *file_name, const char *func_name) {
@@ -190,6 +202,9 @@ void __record_func_ret(const char *file_name, const char *func_name) {
 }
 
 void __cov_fini() {
+  // the process that should have forked, it has no input of its own
+  if (is_init_point_missed()) { return; }
+
   std::lock_guard<std::mutex> guard(cov_mutex);
   seq_output_f.close();
   return;
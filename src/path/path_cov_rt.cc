@@ -1,6 +1,9 @@
 #include "path/path_cov_rt.hpp"
 
+#include "utils/forkserver.hpp"
+#include "utils/init_point.hpp"
 #include "utils/progress_bar.hpp"
+#include "utils/replay.hpp"
 #include <string.h>
 
 #include <fcntl.h>
@@ -24,82 +27,19 @@ namespace fs = std::filesystem;
 
 extern "C" {
 
-void __get_output_fn(int *argc_ptr, char **argv) {
-  int argc = *argc_ptr;
-
-  if (argc < 2) {
-    std::cout << "[path_cov] Usage : " << argv[0]
-              << " <args ...> [inputs_dir] <cov_output_fn>\n";
-    std::cout
-        << "  if @@ placeholder is NOT in <args ...>, it is considered as a "
-           "normal execution with coverage instrumentation, and generates "
-           "coverage output file to [cov_output_fn].\n\n";
-    std::cout << "  if @@ placeholder is in <args ...>, it is considered as "
-                 "replaying all inputs in <inputs_dir> and generating coverage "
-                 "reports to [cov_output_fn].\n";
-    std::cout << "  It assumes the input files are named in format id:xxx, and "
-                 "the id integer ranges from 0 to (num_inputs -1).";
-    std::cout << "  There should be no other files in the input directory.\n";
-    exit(1);
-  }
-
-  uint32_t placeholder_idx = -1;
-  for (uint32_t idx = 1; idx < (uint32_t)argc; idx++) {
-    if (strncmp(argv[idx], "@@", 3) == 0) {
-      placeholder_idx = idx;
-      break;
-    }
-  }
-
-  __path_hash_val = 1;
-
-  if (placeholder_idx == -1) {
-    // normal execution with one input file
-    cov_output_fn = argv[argc - 1];
-    argv[argc - 1] = nullptr;
-    *argc_ptr = argc - 1;
-    std::cout << "[path_cov] Found " << __num_bbs << " basic blocks to track."
-              << std::endl;
-    std::cout << "[path_cov] Coverage output file: " << cov_output_fn
-              << std::endl;
-    return;
-  }
-
-  if (argc < 3) {
-    std::cout << "[path_cov] Usage : " << argv[0]
-              << " <args ...> [inputs_dir] <cov_output_fn>\n";
-    std::cout
-        << "  if @@ placeholder is NOT in <args ...>, it is considered as a "
-           "normal execution with coverage instrumentation, and generates "
-           "coverage output file to [cov_output_fn].\n\n";
-    std::cout << "  if @@ placeholder is in <args ...>, it is considered as "
-                 "replaying all inputs in <inputs_dir> and generating coverage "
-                 "reports to [cov_output_fn].\n";
-    std::cout << "  It assumes the input files are named in format id:xxx, and "
-                 "the id integer ranges from 0 to (num_inputs -1).";
-    std::cout << "  There should be no other files in the input directory.\n";
-    exit(1);
-  }
-
-  *argc_ptr = argc - 2;
-  const char *inputs_dir = argv[argc - 2];
-  cov_output_fn = argv[argc - 1];
-  argv[argc - 2] = nullptr;
-  argv[argc - 1] = nullptr;
-
-  fs::path dir_path(inputs_dir);
-
-  if (!fs::exists(dir_path) || !fs::is_directory(dir_path)) {
-    std::cerr
-        << "[path_cov] Inputs directory does not exist or is not a directory."
-        << std::endl;
-    exit(1);
-  }
-
+// Directory mode: replays the inputs id:0 to id:<num_inputs - 1> of dir_path
+// in forked children, which return to run the target. The parent writes the
+// path hash of every input to cov_output_fn and exits.
+static void __replay_inputs(char **argv, int32_t placeholder_idx,
+                            const fs::path &dir_path,
+                            const char *inputs_dir) {
   auto dir_iter = fs::directory_iterator(dir_path);
   const uint32_t num_inputs = std::distance(dir_iter, fs::directory_iterator{});
   std::cout << "Found " << num_inputs << " inputs to process." << std::endl;
 
+  // the path up to the fork point, the parent overwrites it with the replies
+  const uint32_t init_hash_val = __path_hash_val;
+
   uint32_t *path_hash_values = (uint32_t *)calloc(num_inputs, sizeof(uint32_t));
 
   uint32_t input_idx = 0;
@@ -141,15 +81,11 @@ void __get_output_fn(int *argc_ptr, char **argv) {
       free(path_hash_values);
       close(path_hash_fd[0]);
 
-      // devnull
-      int devnull_fd = open("/dev/null", O_RDWR);
-      dup2(devnull_fd, STDOUT_FILENO);
-      dup2(devnull_fd, STDERR_FILENO);
-      close(devnull_fd);
+      redirect_to_devnull();
 
-      argv[placeholder_idx] = new_input_path;
+      set_placeholder(argv, placeholder_idx, new_input_path);
 
-      __path_hash_val = 1;
+      __path_hash_val = init_hash_val;
       cov_output_fn = nullptr;
 
 #ifdef WRITE_COV_PER_BB
@@ -211,12 +147,97 @@ void __get_output_fn(int *argc_ptr, char **argv) {
   std::cout << "\n[path_cov] All " << input_idx << " inputs processed."
             << std::endl;
   exit(0);
+}
 
-  free(path_hash_values);
-  return;
+void __get_output_fn(int *argc_ptr, char **argv) {
+  // bbcov-run replays the inputs, the arguments are left alone
+  if (is_forkserver_requested()) {
+    const int32_t argc = *argc_ptr;
+    __path_hash_val = 1;
+    run_at_init_point(is_init_deferred(DEFER_INIT), argc, argv, [argc, argv]() {
+      cov_output_fn = run_forkserver(argc, argv);
+    });
+    return;
+  }
+
+  int argc = *argc_ptr;
+
+  if (argc < 2) {
+    std::cout << "[path_cov] Usage : " << argv[0]
+              << " <args ...> [inputs_dir] <cov_output_fn>\n";
+    std::cout
+        << "  if @@ placeholder is NOT in <args ...>, it is considered as a "
+           "normal execution with coverage instrumentation, and generates "
+           "coverage output file to [cov_output_fn].\n\n";
+    std::cout << "  if @@ placeholder is in <args ...>, it is considered as "
+                 "replaying all inputs in <inputs_dir> and generating coverage "
+                 "reports to [cov_output_fn].\n";
+    std::cout << "  It assumes the input files are named in format id:xxx, and "
+                 "the id integer ranges from 0 to (num_inputs -1).";
+    std::cout << "  There should be no other files in the input directory.\n";
+    exit(1);
+  }
+
+  const int32_t placeholder_idx = find_placeholder(argc, argv);
+
+  __path_hash_val = 1;
+
+  if (placeholder_idx == -1) {
+    // normal execution with one input file
+    cov_output_fn = argv[argc - 1];
+    argv[argc - 1] = nullptr;
+    *argc_ptr = argc - 1;
+    std::cout << "[path_cov] Found " << __num_bbs << " basic blocks to track."
+              << std::endl;
+    std::cout << "[path_cov] Coverage output file: " << cov_output_fn
+              << std::endl;
+    return;
+  }
+
+  if (argc < 3) {
+    std::cout << "[path_cov] Usage : " << argv[0]
+              << " <args ...> [inputs_dir] <cov_output_fn>\n";
+    std::cout
+        << "  if @@ placeholder is NOT in <args ...>, it is considered as a "
+           "normal execution with coverage instrumentation, and generates "
+           "coverage output file to [cov_output_fn].\n\n";
+    std::cout << "  if @@ placeholder is in <args ...>, it is considered as "
+                 "replaying all inputs in <inputs_dir> and generating coverage "
+                 "reports to [cov_output_fn].\n";
+    std::cout << "  It assumes the input files are named in format id:xxx, and "
+                 "the id integer ranges from 0 to (num_inputs -1).";
+    std::cout << "  There should be no other files in the input directory.\n";
+    exit(1);
+  }
+
+  *argc_ptr = argc - 2;
+  const char *inputs_dir = argv[argc - 2];
+  cov_output_fn = argv[argc - 1];
+  argv[argc - 2] = nullptr;
+  argv[argc - 1] = nullptr;
+
+  fs::path dir_path(inputs_dir);
+
+  if (!fs::exists(dir_path) || !fs::is_directory(dir_path)) {
+    std::cerr
+        << "[path_cov] Inputs directory does not exist or is not a directory."
+        << std::endl;
+    exit(1);
+  }
+
+  run_at_init_point(
+      is_init_deferred(DEFER_INIT), *argc_ptr, argv,
+      [argv, placeholder_idx, dir_path, inputs_dir]() {
+        __replay_inputs(argv, placeholder_idx, dir_path, inputs_dir);
+      });
 }
 
 void __cov_fini() {
+  // the process that should have forked, it has no input of its own
+  if (is_init_point_missed()) {
+    return;
+  }
+
   if (cov_output_fn == nullptr) {
     if (path_hash_fd[1] != 0) {
       write(path_hash_fd[1], &__path_hash_val, sizeof(__path_hash_val));
@@ -0,0 +1,379 @@
+// bbcov-run: replays a directory of inputs on an instrumented target through
+// the forkserver of its runtime (see utils/forkserver.hpp). The target is
+// started once per job with its original arguments, and the driver owns the
+// input enumeration, the scheduling, the timeouts and the output paths.
+
+#include "utils/forkserver.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "utils/fd_io.hpp"
+#include "utils/progress_bar.hpp"
+#include "utils/replay.hpp"
+
+namespace fs = std::filesystem;
+
+// time a target gets to answer the hello, from __handle_init or, with
+// deferred initialization, from __bb_cov_init_point()
+#define HELLO_TIMEOUT_MILLISECONDS 60000
+
+// One forkserver, i.e. one running copy of the target
+struct Server {
+  pid_t pid = -1;
+  int ctl_fd = -1;
+  int status_fd = -1;
+  // input being replayed, -1 if idle
+  int32_t input_idx = -1;
+  // child of the current input, -1 until the server replied it
+  pid_t child_pid = -1;
+  bool timed_out = false;
+  std::chrono::steady_clock::time_point deadline;
+};
+
+struct Options {
+  fs::path inputs_dir;
+  fs::path outputs_dir;
+  std::string prefix;
+  uint32_t num_jobs = 1;
+  uint32_t timeout_ms = 0;
+  char **target_argv = nullptr;
+};
+
+static void usage(const char *prog) {
+  std::cout
+      << "Usage : " << prog
+      << " [-j jobs] [-t timeout_ms] [-p prefix] -i <inputs_dir> "
+         "-o <cov_output_dir> -- <target.cov> <args ...>\n"
+      << "  Replays every input of <inputs_dir> on <target.cov> and writes one "
+         "coverage file per input to <cov_output_dir>.\n"
+      << "  The input replaces the @@ placeholder of <args ...>, or is given "
+         "on stdin if there is none.\n"
+      << "  -j : number of targets running at the same time, 0 uses one per "
+         "CPU (default 1)\n"
+      << "  -t : kill an input after timeout_ms milliseconds (default none)\n"
+      << "  -p : only replay inputs whose name starts with prefix, e.g. id:\n";
+  exit(1);
+}
+
+static void stop_server(Server &server) {
+  if (server.ctl_fd >= 0) {
+    // the server exits once the pipe is closed
+    close(server.ctl_fd);
+  }
+  if (server.status_fd >= 0) {
+    close(server.status_fd);
+  }
+  if (server.pid > 0) {
+    waitpid(server.pid, nullptr, 0);
+  }
+  server = Server();
+}
+
+// Starts the target and waits for the hello of its runtime
+static bool start_server(Server &server, char **target_argv) {
+  int ctl_pipe[2];
+  int status_pipe[2];
+  // the other servers must not inherit the pipes, or no EOF is ever seen
+  if (pipe2(ctl_pipe, O_CLOEXEC) != 0 ||
+      pipe2(status_pipe, O_CLOEXEC) != 0) {
+    std::cerr << "[bbcov-run] Pipe failed." << std::endl;
+    exit(1);
+  }
+
+  const pid_t pid = fork();
+  if (pid < 0) {
+    std::cerr << "[bbcov-run] Fork failed." << std::endl;
+    exit(1);
+  }
+
+  if (pid == 0) {
+    // dup2 clears O_CLOEXEC on the forkserver fds
+    dup2(ctl_pipe[0], FORKSRV_READ_FD);
+    dup2(status_pipe[1], FORKSRV_WRITE_FD);
+
+    // the startup messages of the runtime
+    int devnull_fd = open("/dev/null", O_RDWR);
+    dup2(devnull_fd, STDOUT_FILENO);
+    close(devnull_fd);
+
+    setenv(FORKSRV_ENV, "1", 1);
+    execvp(target_argv[0], target_argv);
+    std::cerr << "[bbcov-run] Failed to execute " << target_argv[0] << ": "
+              << strerror(errno) << std::endl;
+    _exit(127);
+  }
+
+  close(ctl_pipe[0]);
+  close(status_pipe[1]);
+  server.pid = pid;
+  server.ctl_fd = ctl_pipe[1];
+  server.status_fd = status_pipe[0];
+
+  struct pollfd pfd;
+  pfd.fd = server.status_fd;
+  pfd.events = POLLIN;
+
+  uint32_t hello = 0;
+  if (poll(&pfd, 1, HELLO_TIMEOUT_MILLISECONDS) <= 0 ||
+      !read_all(server.status_fd, &hello, sizeof(hello)) ||
+      hello != FORKSRV_HELLO) {
+    kill(pid, SIGKILL);
+    stop_server(server);
+    return false;
+  }
+
+  return true;
+}
+
+static bool send_request(Server &server, const std::string &input_path,
+                         const std::string &output_path) {
+  const uint32_t path_lens[2] = {(uint32_t)input_path.size(),
+                                 (uint32_t)output_path.size()};
+  std::string request((const char *)path_lens, sizeof(path_lens));
+  request += input_path;
+  request += output_path;
+  return write_all(server.ctl_fd, request.data(), request.size());
+}
+
+static Options parse_options(int argc, char **argv) {
+  Options options;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "+i:o:j:t:p:h")) != -1) {
+    switch (opt) {
+    case 'i':
+      options.inputs_dir = optarg;
+      break;
+    case 'o':
+      options.outputs_dir = optarg;
+      break;
+    case 'j': {
+      const long num_jobs = strtol(optarg, nullptr, 10);
+      if (num_jobs < 0) {
+        usage(argv[0]);
+      }
+      options.num_jobs = num_jobs;
+      if (num_jobs == 0) {
+        const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        options.num_jobs = num_cpus > 0 ? num_cpus : 1;
+      }
+      break;
+    }
+    case 't':
+      options.timeout_ms = strtoul(optarg, nullptr, 10);
+      break;
+    case 'p':
+      options.prefix = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (options.inputs_dir.empty() || options.outputs_dir.empty() ||
+      optind >= argc) {
+    usage(argv[0]);
+  }
+  options.target_argv = argv + optind;
+
+  return options;
+}
+
+int main(int argc, char **argv) {
+  const Options options = parse_options(argc, argv);
+
+  if (!fs::is_directory(options.inputs_dir)) {
+    std::cerr
+        << "[bbcov-run] Inputs directory does not exist or is not a directory."
+        << std::endl;
+    return 1;
+  }
+  fs::create_directories(options.outputs_dir);
+
+  std::vector<fs::path> input_paths;
+  for (const auto &entry : fs::directory_iterator(options.inputs_dir)) {
+    if (!entry.is_regular_file()) {
+      continue;
+    }
+
+    const std::string basename = entry.path().filename().string();
+    if (basename[0] == '.' || basename.rfind(options.prefix, 0) != 0) {
+      continue;
+    }
+
+    input_paths.push_back(entry.path());
+  }
+  std::sort(input_paths.begin(), input_paths.end());
+
+  const uint32_t num_inputs = input_paths.size();
+  const uint32_t num_jobs = std::max(
+      (uint32_t)1, std::min(options.num_jobs, std::max(num_inputs, 1U)));
+  std::cout << "[bbcov-run] Found " << num_inputs
+            << " inputs to process with " << num_jobs << " jobs." << std::endl;
+
+  // a dead server shows up as a failed write
+  signal(SIGPIPE, SIG_IGN);
+
+  std::vector<Server> servers(num_jobs);
+  for (Server &server : servers) {
+    if (!start_server(server, options.target_argv)) {
+      std::cerr << "[bbcov-run] " << options.target_argv[0]
+                << " did not start a forkserver, is it linked with a "
+                   "coverage runtime?"
+                << std::endl;
+      for (Server &started : servers) {
+        stop_server(started);
+      }
+      return 1;
+    }
+  }
+
+  uint32_t next_input = 0;
+  uint32_t num_done = 0;
+  uint32_t num_crashed = 0;
+  uint32_t num_nonzero = 0;
+  uint32_t num_timed_out = 0;
+  uint32_t num_lost = 0;
+  const auto start_time = std::chrono::steady_clock::now();
+
+  auto finish_input = [&](Server &server, bool is_lost, int32_t status) {
+    if (server.timed_out) {
+      num_timed_out++;
+    } else if (is_lost) {
+      num_lost++;
+    } else if (WIFSIGNALED(status)) {
+      num_crashed++;
+    } else if (WEXITSTATUS(status) != 0) {
+      num_nonzero++;
+    }
+
+    server.input_idx = -1;
+    server.child_pid = -1;
+    server.timed_out = false;
+    num_done++;
+    show_progress(num_done, num_inputs, start_time);
+  };
+
+  std::vector<struct pollfd> pfds(num_jobs);
+
+  while (num_done < num_inputs) {
+    for (Server &server : servers) {
+      if (server.input_idx != -1 || next_input == num_inputs) {
+        continue;
+      }
+
+      const fs::path &input = input_paths[next_input];
+      const std::string output_path =
+          get_replay_output_path(input.string(), options.outputs_dir.string());
+
+      server.input_idx = next_input++;
+      if (!send_request(server, input.string(), output_path)) {
+        finish_input(server, true, 0);
+        stop_server(server);
+        if (!start_server(server, options.target_argv)) {
+          std::cerr << "[bbcov-run] Failed to restart the target."
+                    << std::endl;
+          exit(1);
+        }
+      }
+    }
+
+    // wait for a reply, or for the nearest deadline
+    int poll_timeout = -1;
+    const auto now = std::chrono::steady_clock::now();
+    for (uint32_t job_idx = 0; job_idx < num_jobs; job_idx++) {
+      Server &server = servers[job_idx];
+      pfds[job_idx].fd = server.input_idx != -1 ? server.status_fd : -1;
+      pfds[job_idx].events = POLLIN;
+      pfds[job_idx].revents = 0;
+
+      if (server.child_pid == -1 || options.timeout_ms == 0 ||
+          server.timed_out) {
+        continue;
+      }
+      const auto remaining =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              server.deadline - now)
+              .count();
+      const int server_timeout = remaining > 0 ? remaining : 0;
+      if (poll_timeout == -1 || server_timeout < poll_timeout) {
+        poll_timeout = server_timeout;
+      }
+    }
+
+    if (poll(pfds.data(), num_jobs, poll_timeout) < 0 && errno != EINTR) {
+      std::cerr << "[bbcov-run] Poll failed." << std::endl;
+      exit(1);
+    }
+
+    for (uint32_t job_idx = 0; job_idx < num_jobs; job_idx++) {
+      Server &server = servers[job_idx];
+      if (server.input_idx == -1) {
+        continue;
+      }
+
+      if (pfds[job_idx].revents != 0) {
+        int32_t reply = 0;
+        if (!read_all(server.status_fd, &reply, sizeof(reply))) {
+          // the server itself died, e.g. killed from outside
+          finish_input(server, true, 0);
+          stop_server(server);
+          if (!start_server(server, options.target_argv)) {
+            std::cerr << "[bbcov-run] Failed to restart the target."
+                      << std::endl;
+            exit(1);
+          }
+          continue;
+        }
+
+        if (server.child_pid == -1) {
+          server.child_pid = reply;
+          server.deadline = std::chrono::steady_clock::now() +
+                            std::chrono::milliseconds(options.timeout_ms);
+        } else {
+          finish_input(server, false, reply);
+        }
+        continue;
+      }
+
+      if (server.child_pid != -1 && options.timeout_ms != 0 &&
+          !server.timed_out &&
+          std::chrono::steady_clock::now() >= server.deadline) {
+        // the server still reaps it and replies the status
+        kill(server.child_pid, SIGKILL);
+        server.timed_out = true;
+      }
+    }
+  }
+
+  for (Server &server : servers) {
+    stop_server(server);
+  }
+
+  PROGRESS_BAR_END();
+
+  std::cout << "[bbcov-run] All " << num_done << " inputs processed: "
+            << num_crashed << " crashed, " << num_nonzero
+            << " exited with a non-zero status, " << num_timed_out
+            << " timed out";
+  if (num_lost != 0) {
+    std::cout << ", " << num_lost << " lost to a dead target";
+  }
+  std::cout << "." << std::endl;
+  return 0;
+}
@@ -0,0 +1,36 @@
+#include "utils/fd_io.hpp"
+
+#include <errno.h>
+#include <unistd.h>
+
+bool read_all(int fd, void *buf, size_t size) {
+  char *ptr = (char *)buf;
+  while (size > 0) {
+    const ssize_t num_read = read(fd, ptr, size);
+    if (num_read < 0 && errno == EINTR) {
+      continue;
+    }
+    if (num_read <= 0) {
+      return false;
+    }
+    ptr += num_read;
+    size -= num_read;
+  }
+  return true;
+}
+
+bool write_all(int fd, const void *buf, size_t size) {
+  const char *ptr = (const char *)buf;
+  while (size > 0) {
+    const ssize_t num_written = write(fd, ptr, size);
+    if (num_written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (num_written <= 0) {
+      return false;
+    }
+    ptr += num_written;
+    size -= num_written;
+  }
+  return true;
+}
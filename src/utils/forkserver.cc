@@ -0,0 +1,94 @@
+#include "utils/forkserver.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "utils/fd_io.hpp"
+#include "utils/init_point.hpp"
+#include "utils/replay.hpp"
+
+bool is_forkserver_requested() { return getenv(FORKSRV_ENV) != nullptr; }
+
+const char *run_forkserver(int32_t argc, char **argv) {
+  // the target may run itself, only this process serves
+  unsetenv(FORKSRV_ENV);
+
+  const uint32_t hello = FORKSRV_HELLO;
+  if (!write_all(FORKSRV_WRITE_FD, &hello, sizeof(hello))) {
+    std::cerr << "[forkserver] " << FORKSRV_ENV
+              << " is set, but bbcov-run is not listening." << std::endl;
+    exit(1);
+  }
+
+  const int32_t placeholder_idx = find_placeholder(argc, argv);
+
+  // every child keeps the paths of its own request
+  char *input_path = new char[FORKSRV_MAX_PATH + 1];
+  char *output_path = new char[FORKSRV_MAX_PATH + 1];
+
+  while (true) {
+    uint32_t path_lens[2];
+    if (!read_all(FORKSRV_READ_FD, path_lens, sizeof(path_lens))) {
+      // bbcov-run is done
+      exit(0);
+    }
+
+    if (path_lens[0] > FORKSRV_MAX_PATH || path_lens[1] > FORKSRV_MAX_PATH ||
+        !read_all(FORKSRV_READ_FD, input_path, path_lens[0]) ||
+        !read_all(FORKSRV_READ_FD, output_path, path_lens[1])) {
+      std::cerr << "[forkserver] Malformed request." << std::endl;
+      exit(1);
+    }
+    input_path[path_lens[0]] = '\0';
+    output_path[path_lens[1]] = '\0';
+
+    // do not let the children inherit unflushed output
+    std::cout.flush();
+    fflush(stdout);
+
+    const pid_t pid = fork();
+    if (pid < 0) {
+      std::cerr << "[forkserver] Fork failed." << std::endl;
+      exit(1);
+    }
+
+    if (pid == 0) {
+      close(FORKSRV_READ_FD);
+      close(FORKSRV_WRITE_FD);
+
+      redirect_to_devnull();
+
+      if (placeholder_idx != -1) {
+        set_placeholder(argv, placeholder_idx, input_path);
+      } else {
+        int input_fd = open(input_path, O_RDONLY);
+        if (input_fd >= 0) {
+          dup2(input_fd, STDIN_FILENO);
+          close(input_fd);
+        }
+      }
+
+      return output_path;
+    }
+
+    int32_t status = 0;
+    if (!write_all(FORKSRV_WRITE_FD, &pid, sizeof(pid))) {
+      exit(1);
+    }
+    while (waitpid(pid, &status, 0) < 0) {
+      if (errno != EINTR) {
+        exit(1);
+      }
+    }
+    if (!write_all(FORKSRV_WRITE_FD, &status, sizeof(status))) {
+      exit(1);
+    }
+  }
+}
@@ -15,4 +15,13 @@ uint8_t bb_cov_simple_hash(const char *str) {
 
 uint8_t bb_cov_simple_hash(const std::string &str) {
   return bb_cov_simple_hash(str.c_str());
-}
\ No newline at end of file
+}
+
+uint64_t bb_cov_fnv1a_hash(const void *data, size_t len, uint64_t hash) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  for (size_t idx = 0; idx < len; idx++) {
+    hash ^= bytes[idx];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
@@ -0,0 +1,74 @@
+#include "utils/init_point.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+
+#include "utils/forkserver.hpp"
+#include "utils/replay.hpp"
+
+static std::function<void()> deferred_fork_loop;
+// replaces the @@ argument in deferred mode
+static char *placeholder_buf = nullptr;
+
+bool is_init_deferred(const char *env_name) {
+  const char *env_defer = getenv(env_name);
+  return env_defer != nullptr && strcmp(env_defer, "0") != 0;
+}
+
+void run_at_init_point(bool is_deferred, int32_t argc, char **argv,
+                       std::function<void()> fork_loop) {
+  if (!is_deferred) {
+    fork_loop();
+    return;
+  }
+
+  const int32_t placeholder_idx = find_placeholder(argc, argv);
+  if (placeholder_idx != -1) {
+    placeholder_buf = new char[FORKSRV_MAX_PATH + 1];
+    strcpy(placeholder_buf, "@@");
+    argv[placeholder_idx] = placeholder_buf;
+  }
+
+  deferred_fork_loop = fork_loop;
+}
+
+void set_placeholder(char **argv, int32_t placeholder_idx,
+                     const char *input_path) {
+  const size_t path_size = strlen(input_path) + 1;
+  if (argv[placeholder_idx] == placeholder_buf &&
+      path_size <= FORKSRV_MAX_PATH + 1) {
+    memcpy(placeholder_buf, input_path, path_size);
+    return;
+  }
+
+  char *input_path_cstr = new char[path_size];
+  memcpy(input_path_cstr, input_path, path_size);
+  argv[placeholder_idx] = input_path_cstr; // memory leak ...
+}
+
+bool is_init_point_missed() {
+  if (!deferred_fork_loop) {
+    return false;
+  }
+
+  std::cerr << "[init_point] The target exited before calling "
+               "__bb_cov_init_point(), no input was replayed."
+            << std::endl;
+  return true;
+}
+
+extern "C" {
+
+void __bb_cov_init_point() {
+  if (!deferred_fork_loop) {
+    return;
+  }
+
+  // returns in the children only
+  std::function<void()> fork_loop = std::move(deferred_fork_loop);
+  deferred_fork_loop = nullptr;
+  fork_loop();
+}
+}
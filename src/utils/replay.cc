@@ -0,0 +1,108 @@
+#include "utils/replay.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <iostream>
+
+#include "utils/progress_bar.hpp"
+
+uint32_t get_replay_jobs(const char *env_name) {
+  const char *env_jobs = getenv(env_name);
+  if (env_jobs == nullptr) {
+    return 1;
+  }
+
+  char *end = nullptr;
+  const long jobs = strtol(env_jobs, &end, 10);
+  if (end == env_jobs || *end != '\0' || jobs < 0) {
+    std::cerr << "[replay] Invalid " << env_name << " \"" << env_jobs
+              << "\", using 1 job." << std::endl;
+    return 1;
+  }
+
+  if (jobs == 0) {
+    const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return num_cpus > 0 ? num_cpus : 1;
+  }
+
+  return jobs;
+}
+
+int32_t find_placeholder(int32_t argc, char **argv) {
+  for (int32_t idx = 1; idx < argc; idx++) {
+    if (strncmp(argv[idx], "@@", 3) == 0) {
+      return idx;
+    }
+  }
+  return -1;
+}
+
+std::string get_replay_output_path(const std::string &input_path,
+                                   const std::string &outputs_dir) {
+  std::string basename = std::filesystem::path(input_path).filename().string();
+  size_t pos = basename.find(',');
+  if (pos != std::string::npos) {
+    basename = basename.substr(0, pos);
+  }
+  return outputs_dir + "/" + basename;
+}
+
+void redirect_to_devnull() {
+  int devnull_fd = open("/dev/null", O_RDWR);
+  dup2(devnull_fd, STDOUT_FILENO);
+  dup2(devnull_fd, STDERR_FILENO);
+  close(devnull_fd);
+}
+
+ReplayPool::ReplayPool(uint32_t max_jobs, uint32_t num_inputs)
+    : max_jobs(max_jobs == 0 ? 1 : max_jobs), num_inputs(num_inputs),
+      start_time(std::chrono::steady_clock::now()) {}
+
+void ReplayPool::wait_for_slot() {
+  while (children.size() >= max_jobs) {
+    reap_one();
+  }
+}
+
+void ReplayPool::wait_all() {
+  while (!children.empty()) {
+    reap_one();
+  }
+}
+
+void ReplayPool::reap_one() {
+  int32_t status = 0;
+  const pid_t pid = waitpid(-1, &status, 0);
+  if (pid < 0) {
+    if (errno == EINTR) {
+      return;
+    }
+
+    // ECHILD, nothing left to wait for
+    children.clear();
+    return;
+  }
+
+  // a child of the target, e.g. started by its initialization before
+  // __bb_cov_init_point()
+  if (children.erase(pid) == 0) {
+    return;
+  }
+
+  num_done++;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    num_failed++;
+  }
+
+  if (on_exit) {
+    on_exit(pid, status);
+  }
+
+  show_progress(num_done, num_inputs, start_time);
+}
@@ -0,0 +1,84 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Stand-in for afl-fuzz: starts the target with the forkserver pipes on fds
+// 198/199 and a shared memory map in __AFL_SHM_ID, asks the forkserver for
+// a few runs, and prints how many map entries each run set. Fails if no
+// forkserver answers or a run does not exit normally.
+
+#define MAP_SIZE 65536
+#define FORKSRV_FD 198
+#define NUM_RUNS 3
+
+static int run_forkserver(int ctl_fd, int st_fd, uint8_t *map) {
+  uint32_t hello = 0;
+  if (read(st_fd, &hello, sizeof(hello)) != sizeof(hello)) {
+    printf("No forkserver.\n");
+    return 1;
+  }
+
+  for (int run = 0; run < NUM_RUNS; run++) {
+    memset(map, 0, MAP_SIZE);
+
+    uint32_t was_killed = 0;
+    int32_t pid = 0;
+    int32_t status = 0;
+    if (write(ctl_fd, &was_killed, sizeof(was_killed)) != sizeof(was_killed) ||
+        read(st_fd, &pid, sizeof(pid)) != sizeof(pid) ||
+        read(st_fd, &status, sizeof(status)) != sizeof(status)) {
+      printf("Forkserver stopped.\n");
+      return 1;
+    }
+    if (!WIFEXITED(status)) { return 1; }
+
+    size_t num_set = 0;
+    for (size_t idx = 0; idx < MAP_SIZE; idx++) {
+      if (map[idx] != 0) { num_set++; }
+    }
+    printf("%zu\n", num_set);
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) { return 1; }
+
+  int shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | 0600);
+  if (shm_id < 0) { return 1; }
+  uint8_t *map = shmat(shm_id, NULL, 0);
+  char shm_id_str[16];
+  snprintf(shm_id_str, sizeof(shm_id_str), "%d", shm_id);
+  setenv("__AFL_SHM_ID", shm_id_str, 1);
+
+  int ctl_pipe[2];
+  int st_pipe[2];
+  if (pipe(ctl_pipe) != 0 || pipe(st_pipe) != 0) { return 1; }
+
+  pid_t server = fork();
+  if (server == 0) {
+    dup2(ctl_pipe[0], FORKSRV_FD);
+    dup2(st_pipe[1], FORKSRV_FD + 1);
+    close(ctl_pipe[0]);
+    close(ctl_pipe[1]);
+    close(st_pipe[0]);
+    close(st_pipe[1]);
+    execv(argv[1], argv + 1);
+    _exit(127);
+  }
+  close(ctl_pipe[0]);
+  close(st_pipe[1]);
+
+  int failed = server < 0 || run_forkserver(ctl_pipe[1], st_pipe[0], map);
+
+  // the forkserver exits once the control pipe is closed
+  close(ctl_pipe[1]);
+  waitpid(server, NULL, 0);
+  shmdt(map);
+  shmctl(shm_id, IPC_RMID, NULL);
+  return failed;
+}
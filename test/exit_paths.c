@@ -0,0 +1,25 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Ends the way given as argument after the loop of main.cc: with abort(),
+// SIGTERM or quick_exit(), which all skip the normal termination.
+
+static void end_abort(void) { abort(); }
+
+static void end_term(void) { raise(SIGTERM); }
+
+static void end_quick_exit(void) { quick_exit(0); }
+
+int main(int argc, char *argv[]) {
+  int b = 0;
+  for (int a = 0; a < 20; a++) {
+    b += a;
+  }
+
+  if (argc < 2) { return 1; }
+  if (strcmp(argv[1], "abort") == 0) { end_abort(); }
+  if (strcmp(argv[1], "term") == 0) { end_term(); }
+  if (strcmp(argv[1], "quick_exit") == 0) { end_quick_exit(); }
+  return 0;
+}
@@ -0,0 +1,20 @@
+#include <stdint.h>
+#include <stdio.h>
+
+// Runs LLVMFuzzerTestOneInput on the file given as argument, like the main
+// that a libFuzzer target is linked with to replay its corpus.
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) { return 1; }
+
+  uint8_t data[256];
+  FILE *input = fopen(argv[1], "rb");
+  if (input == NULL) { return 1; }
+  size_t size = fread(data, 1, sizeof(data), input);
+  fclose(input);
+
+  LLVMFuzzerTestOneInput(data, size);
+  return 0;
+}
@@ -0,0 +1,21 @@
+#include <stddef.h>
+#include <stdint.h>
+
+static int parse_digit(uint8_t c) {
+  if (c < '0' || c > '9') { return -1; }
+  return c - '0';
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (size == 0) { return 0; }
+
+  int sum = 0;
+  for (size_t i = 0; i < size; i++) {
+    int digit = parse_digit(data[i]);
+    if (digit < 0) { return 0; }
+    sum += digit;
+  }
+
+  if (sum > 10) { return 1; }
+  return 0;
+}
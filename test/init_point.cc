@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+// Does its startup work, then calls the weak __bb_cov_init_point(), where
+// the replay children are forked with BB_COV_DEFER_INIT=1. The input path is
+// kept from argv before that point. Every startup appends a line to the
+// file in STARTUP_LOG, and SKIP_INIT_POINT exits before the init point.
+
+extern "C" __attribute__((weak)) void __bb_cov_init_point();
+
+static int table[256];
+
+static void init_table(void) {
+  for (int i = 0; i < 256; i++) { table[i] = i % 3; }
+
+  const char *log_path = getenv("STARTUP_LOG");
+  if (log_path == NULL) { return; }
+  FILE *log = fopen(log_path, "a");
+  if (log == NULL) { return; }
+  fputs("startup\n", log);
+  fclose(log);
+}
+
+static int classify(int c) {
+  if (table[c] == 0) { return 0; }
+  if (table[c] == 1) { return 1; }
+  return 2;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) { return 1; }
+  const char *input_path = argv[1];
+
+  init_table();
+  if (getenv("SKIP_INIT_POINT") != NULL) { return 0; }
+  if (__bb_cov_init_point) { __bb_cov_init_point(); }
+
+  FILE *input = fopen(input_path, "rb");
+  if (input == NULL) { return 1; }
+  int c = fgetc(input);
+  fclose(input);
+  if (c == EOF) { return 0; }
+
+  printf("%d\n", classify(c));
+  return 0;
+}
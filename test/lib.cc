@@ -0,0 +1,11 @@
+int lib_sum(int n) {
+  int sum = 0;
+  for (int i = 0; i < n; i++) {
+    if (i % 2 == 0) { sum += i; }
+  }
+  return sum;
+}
+
+int lib_unused(int n) {
+  return n * 2;
+}
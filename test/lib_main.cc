@@ -0,0 +1,9 @@
+int lib_sum(int n);
+
+// volatile, so that an optimized build can not fold the call away
+static volatile int num = 10;
+
+int main(void) {
+  if (lib_sum(num) != 20) { return 1; }
+  return 0;
+}
@@ -3,7 +3,18 @@ set -e
 
 cd "$(dirname "$0")"
 
-rm -f out void_main crash *.bc *.cov *.path *.bb *.func
+rm -f out void_main crash func funcseq fuzz_input afl_host afl_host.out *.bc *.o *.cov *.path *.bb *.func *.bytemap .bbcov.*.map
+rm -f liblib.so lib_so.cov.liblib.so union.cov.inputs timeout.path.cov.txt startup.log startup_deferred.log init_point.bb_cov init_point.func_cov init_point.func_seq init_point.path_cov init_path_cov_out init_path_cov_deferred_out init_path_cov_missed_out
+rm -rf bbcov_run_inputs bbcov_run_out bbcov_run_hitcount_out fuzz_inputs fuzz_fork_out fuzz_persistent_out replay_jobs_out replay_crash_out union_out tmp_inputs init_inputs init_*_out
+
+# The reports of the other modes must match the report of the default mode,
+# main.cc.cov, once their values are turned into 0|1 and their edges dropped
+same_as_default() {
+  grep -v "^E " "$1" | sed 's/ [1-9][0-9]*$/ 1/' | diff - main.cc.cov > /dev/null || {
+    echo "$1 differs from main.cc.cov."
+    exit 1
+  }
+}
 
 clang++ -g -c -emit-llvm main.cc -o main.bc
 clang++ -g -c -emit-llvm void_main.cc -o void_main.bc
@@ -64,22 +75,63 @@ clang++ crash.bb.bc -O0 -o crash.bb -L../build -l:bb_cov_rt.a
 
 set +e
 
+# crash.cc crashes in the entry of f1, after every basic block of main
+check_crash_cov() {
+  grep -A1 "^F f1" "$1" | grep -q "^B .* 1$" &&
+    awk '/^F /{ in_main = $2 == "main" } in_main && /^B /' "$1" | grep -q . &&
+    ! awk '/^F /{ in_main = $2 == "main" } in_main && /^B .* 0$/' "$1" |
+      grep -q . || {
+    echo "$1 misses the coverage up to the crash."
+    exit 1
+  }
+}
+
+rm -f crash.cov
 time ./crash.bb crash.cov
 
 echo ""
 echo "Coverage result for crash program (using normal runtime):"
 cat crash.cov
 echo ""
+check_crash_cov crash.cov
+
+# abort(), SIGTERM and quick_exit() skip the normal termination too
+clang -g -c -emit-llvm exit_paths.c -o exit_paths.bc
+opt -load-pass-plugin=../build/bb_cov_pass.so -passes=bbcov exit_paths.bc \
+  -o exit_paths.bb.bc
+clang++ exit_paths.bb.bc -O0 -o exit_paths.bb -L../build -l:bb_cov_rt.a
+for how in abort term quick_exit; do
+  rm -f exit_$how.cov
+  ./exit_paths.bb $how exit_$how.cov
+  grep -q "^F end_$how 1$" exit_$how.cov &&
+    grep -A1 "^F main " exit_$how.cov | grep -q "^B .* 1$" || {
+    echo "No coverage written on $how."
+    exit 1
+  }
+done
 
 
 clang++ crash.bb.bc -O0 -o crash.bb -L../build -l:bb_cov_instant_rt.a
 
+rm -f crash.cov crash.cov.bytemap
 time ./crash.bb crash.cov
 
+# the crash leaves the mapped sidecar instead of the report
+[ -e crash.cov.bytemap ] || { echo "No crash.cov.bytemap after the crash."; exit 1; }
+python3 ../scripts/bbcov_bin_to_text.py crash.cov.bytemap crash.instant.cov
+
 echo ""
 echo "Coverage result for crash program:"
-cat crash.cov
+cat crash.instant.cov
 echo ""
+check_crash_cov crash.instant.cov
+
+# at normal termination the report is written and the sidecar removed
+clang++ bbout.bc -O0 -o main.instant.bb -L../build -l:bb_cov_instant_rt.a
+rm -f main.instant.cov
+./main.instant.bb main.instant.cov
+cmp main.instant.cov main.cc.cov || exit 1
+[ ! -e main.instant.cov.bytemap ] || { echo "The sidecar was left."; exit 1; }
 
 
 opt -load-pass-plugin=../build/path_cov_pass.so -passes=pathcov timeout.bc -o timeout.path.bc
@@ -93,4 +145,343 @@ done
 
 time ./timeout.path ./tmp_inputs timeout.path.cov.txt
 
-cat timeout.path.cov.txt
\ No newline at end of file
+cat timeout.path.cov.txt
+
+
+echo ""
+echo "libFuzzer counters (-bbcov-sancov):"
+clang++ -g -c -emit-llvm fuzz_target.cc -o fuzz_target.bc
+clang -g -c -emit-llvm sancov_driver.c -o sancov_driver.bc
+printf "123" > fuzz_input
+
+# per translation unit, the driver stands in for libFuzzer's main, which is
+# not instrumented, so the runtime is never set up by __handle_init
+opt -load-pass-plugin=../build/bb_cov_pass.so -passes=bbcov -bbcov-per-tu \
+  -bbcov-sancov fuzz_target.bc -o fuzz_target.sancov.bc
+clang -c sancov_driver.c -o sancov_driver.o
+clang++ fuzz_target.sancov.bc sancov_driver.o -O0 -o sancov.bb -L../build -l:bb_cov_rt.a
+rm -f sancov.cov
+BB_COV_OUTPUT_FN=sancov.cov ./sancov.bb fuzz_input || exit 1
+grep -q "^B .* 1$" sancov.cov || { echo "No coverage written at exit."; exit 1; }
+
+# whole program, with the driver instrumented too
+llvm-link fuzz_target.bc sancov_driver.bc -o sancov_wp.bc
+opt -load-pass-plugin=../build/bb_cov_pass.so -passes=bbcov -bbcov-sancov \
+  sancov_wp.bc -o sancov_wp.bb.bc
+clang++ sancov_wp.bb.bc -O0 -o sancov_wp.bb -L../build -l:bb_cov_rt.a
+rm -f sancov_wp.cov
+BB_COV_OUTPUT_FN=sancov_wp.cov ./sancov_wp.bb fuzz_input || exit 1
+grep -q "^B .* 1$" sancov_wp.cov || { echo "No coverage written at exit."; exit 1; }
+
+
+echo ""
+echo "Hit counts (-bbcov-hitcount):"
+opt -load-pass-plugin=../build/bb_cov_pass.so -passes=bbcov -bbcov-hitcount \
+  main.bc -o main.hitcount.bc
+clang++ main.hitcount.bc -O0 -o main.hitcount.bb -L../build -l:bb_cov_hitcount_rt.a
+./main.hitcount.bb main.hitcount.cov
+cat main.hitcount.cov
+same_as_default main.hitcount.cov
+# the loop runs 20 times, bucket 16-31 is bit 5
+grep -q "^B .* 32$" main.hitcount.cov || { echo "No bucket for the loop."; exit 1; }
+
+echo ""
+echo "Edges (-bbcov-edges):"
+opt -load-pass-plugin=../build/bb_cov_pass.so -passes=bbcov -bbcov-edges \
+  main.bc -o main.edges.bc
+clang++ main.edges.bc -O0 -o main.edges.bb -L../build -l:bb_cov_rt.a
+./main.edges.bb main.edges.cov
+cat main.edges.cov
+same_as_default main.edges.cov
+grep -q "^E .* 1$" main.edges.cov || { echo "No covered edge."; exit 1; }
+
+echo ""
+echo "Pruned probes (-bbcov-prune):"
+opt -load-pass-plugin=../build/bb_cov_pass.so -passes=bbcov -bbcov-prune \
+  main.bc -o main.prune.bc
+clang++ main.prune.bc -O0 -o main.prune.bb -L../build -l:bb_cov_rt.a
+./main.prune.bb main.prune.cov
+# the blocks whose probes were pruned are still reported
+cmp main.prune.cov main.cc.cov || exit 1
+
+echo ""
+echo "Exact counts (-bbcov-counts):"
+opt -load-pass-plugin=../build/bb_cov_pass.so -passes=bbcov -bbcov-counts \
+  main.bc -o main.counts.bc
+clang++ main.counts.bc -O0 -o main.counts.bb -L../build -l:bb_cov_counts_rt.a
+./main.counts.bb main.counts.cov
+cat main.counts.cov
+same_as_default main.counts.cov
+grep -q "^B .* 21$" main.counts.cov || { echo "Wrong loop count."; exit 1; }
+grep -q "^B .* 20$" main.counts.cov || { echo "Wrong loop count."; exit 1; }
+
+echo ""
+echo "Per translation unit (-bbcov-per-tu):"
+opt -load-pass-plugin=../build/bb_cov_pass.so -passes=bbcov -bbcov-per-tu \
+  main.bc -o main.tu.bc
+clang++ main.tu.bc -O0 -o main.tu.bb -L../build -l:bb_cov_rt.a
+./main.tu.bb main.tu.cov
+cmp main.tu.cov main.cc.cov || exit 1
+
+# two translation units linked without llvm-link report what the whole
+# program reports
+clang++ -g -c -emit-llvm lib.cc -o lib.bc
+clang++ -g -c -emit-llvm lib_main.cc -o lib_main.bc
+llvm-link lib.bc lib_main.bc -o lib_wp.bc
+opt -load-pass-plugin=../build/bb_cov_pass.so -passes=bbcov lib_wp.bc \
+  -o lib_wp.bb.bc
+clang++ lib_wp.bb.bc -O0 -o lib_wp.bb -L../build -l:bb_cov_rt.a
+./lib_wp.bb lib_wp.cov
+cat lib_wp.cov
+for tu in lib lib_main; do
+  opt -load-pass-plugin=../build/bb_cov_pass.so -passes=bbcov -bbcov-per-tu \
+    $tu.bc -o $tu.tu.bc
+done
+clang++ lib.tu.bc lib_main.tu.bc -O0 -o lib_tu.bb -L../build -l:bb_cov_rt.a
+./lib_tu.bb lib_tu.cov
+diff <(sort lib_tu.cov) <(sort lib_wp.cov) || exit 1
+
+echo ""
+echo "Shared library (-bbcov-per-tu):"
+# lib.cc is a shared library of lib_main.cc, its report is
+# <output_fn>.liblib.so
+clang++ -shared -fPIC lib.tu.bc -o liblib.so
+clang++ lib_main.tu.bc -O0 -o lib_so.bb -L. -llib -Wl,-rpath,'$ORIGIN' \
+  -L../build -l:bb_cov_rt.a
+rm -f lib_so.cov lib_so.cov.liblib.so
+./lib_so.bb lib_so.cov
+cat lib_so.cov.liblib.so
+diff <(cat lib_so.cov lib_so.cov.liblib.so | sort) <(sort lib_wp.cov) || exit 1
+
+echo ""
+echo "Split module (-bbcov-split):"
+opt -load-pass-plugin=../build/bb_cov_pass.so -passes=bbcov -bbcov-split=2 \
+  lib_wp.bc -o lib_split.bb.bc
+clang++ lib_split.bb.bc -O0 -o lib_split.bb -L../build -l:bb_cov_rt.a
+./lib_split.bb lib_split.cov
+diff <(sort lib_split.cov) <(sort lib_wp.cov) || exit 1
+
+echo ""
+echo "AFL++ forkserver:"
+clang afl_host.c -o afl_host
+AFL_DUMP_MAP_SIZE=1 ./bbout.cov
+# every run sets one map entry per covered basic block
+./afl_host ./bbout.cov > afl_host.out || { echo "Forkserver failed."; exit 1; }
+cat afl_host.out
+[ "$(uniq afl_host.out)" = "$(grep -c "^B .* 1$" main.cc.cov)" ] || exit 1
+
+echo ""
+echo "bbcov-run:"
+rm -rf bbcov_run_inputs bbcov_run_out bbcov_run_hitcount_out
+mkdir bbcov_run_inputs
+for id in 0 1 2; do
+  echo "$id" > "bbcov_run_inputs/id:00000$id,orig:seed$id"
+done
+# main.cc ignores its input, so every input gets the report of a plain run
+../build/bbcov-run -j 2 -i bbcov_run_inputs -o bbcov_run_out -- ./bbout.cov @@
+../build/bbcov-run -i bbcov_run_inputs -o bbcov_run_hitcount_out \
+  -- ./main.hitcount.bb
+for id in 0 1 2; do
+  cmp bbcov_run_out/id:00000$id main.cc.cov || exit 1
+  cmp bbcov_run_hitcount_out/id:00000$id main.hitcount.cov || exit 1
+done
+
+echo ""
+echo "Directory replay with 2 jobs (BB_COV_JOBS):"
+rm -rf replay_jobs_out
+BB_COV_JOBS=2 ./bbout.cov @@ bbcov_run_inputs replay_jobs_out
+for id in 0 1 2; do
+  cmp replay_jobs_out/id:00000$id main.cc.cov || exit 1
+done
+# every child crashes and leaves its emergency report
+clang++ crash.bb.bc -O0 -o crash_jobs.bb -L../build -l:bb_cov_rt.a
+rm -rf replay_crash_out
+BB_COV_JOBS=2 ./crash_jobs.bb @@ bbcov_run_inputs replay_crash_out
+for id in 0 1 2; do
+  check_crash_cov replay_crash_out/id:00000$id
+done
+
+echo ""
+echo "Union of the inputs (BB_COV_UNION_OUTPUT_FN):"
+rm -rf union_out union.cov union.cov.inputs
+BB_COV_JOBS=2 BB_COV_UNION_OUTPUT_FN=union.cov ./bbout.cov @@ \
+  bbcov_run_inputs union_out
+cat union.cov.inputs
+cmp union.cov main.cc.cov || exit 1
+[ "$(grep -vc "^#" union.cov.inputs)" = 3 ] || exit 1
+for id in 0 1 2; do
+  cmp union_out/id:00000$id main.cc.cov || exit 1
+done
+# only the union and the statistics
+rm -rf union_out union.cov union.cov.inputs
+BB_COV_PER_INPUT_OUTPUT=0 BB_COV_UNION_OUTPUT_FN=union.cov ./bbout.cov @@ \
+  bbcov_run_inputs union_out
+cmp union.cov main.cc.cov || exit 1
+[ "$(grep -vc "^#" union.cov.inputs)" = 3 ] || exit 1
+[ ! -e union_out/id:000000 ] || exit 1
+
+echo ""
+echo "Persistent mode (BB_COV_PERSISTENT):"
+clang -g -c -emit-llvm fuzz_main.c -o fuzz_main.bc
+llvm-link fuzz_target.bc fuzz_main.bc -o fuzz_wp.bc
+rm -rf fuzz_inputs
+mkdir fuzz_inputs
+printf "" > fuzz_inputs/empty
+printf "123" > fuzz_inputs/small_sum
+printf "99999" > fuzz_inputs/large_sum
+printf "12a" > fuzz_inputs/not_digit
+
+# main is not called per input, so only the fuzz_target.cc part of the
+# reports is the same as with a child per input
+fuzz_target_part() {
+  awk '/^File /{ keep = /fuzz_target.cc$/ } keep' "$1"
+}
+
+check_persistent() {
+  opt -load-pass-plugin=../build/bb_cov_pass.so -passes=bbcov $1 fuzz_wp.bc \
+    -o fuzz_wp.bb.bc
+  clang++ fuzz_wp.bb.bc -O0 -o fuzz_wp.bb -L../build -l:$2
+  rm -rf fuzz_fork_out fuzz_persistent_out
+  ./fuzz_wp.bb @@ fuzz_inputs fuzz_fork_out
+  # a worker per 3 inputs, so the second one starts from a reset state too
+  BB_COV_PERSISTENT=3 ./fuzz_wp.bb @@ fuzz_inputs fuzz_persistent_out
+  for input in fuzz_inputs/*; do
+    name=$(basename "$input")
+    fuzz_target_part fuzz_fork_out/$name | grep -q "^B .* [1-9][0-9]*$" || {
+      echo "No coverage of fuzz_target.cc for $name."
+      exit 1
+    }
+    diff <(fuzz_target_part fuzz_fork_out/$name) \
+      <(fuzz_target_part fuzz_persistent_out/$name) || exit 1
+  done
+}
+check_persistent "" bb_cov_rt.a
+check_persistent -bbcov-hitcount bb_cov_hitcount_rt.a
+
+echo ""
+echo "Binary reports (BB_COV_OUTPUT_FORMAT=binary):"
+rm -f main.bin.cov
+BB_COV_OUTPUT_FORMAT=binary ./bbout.cov main.bin.cov
+python3 ../scripts/bbcov_bin_to_text.py main.bin.cov main.bin.txt.cov
+cmp main.bin.txt.cov main.cc.cov || exit 1
+# the second run reads the first report back and merges into it
+BB_COV_OUTPUT_FORMAT=binary ./bbout.cov main.bin.cov
+python3 ../scripts/bbcov_bin_to_text.py main.bin.cov main.bin.txt.cov
+cmp main.bin.txt.cov main.cc.cov || exit 1
+
+echo ""
+echo "Sparse reports (BB_COV_OUTPUT_FORMAT=sparse):"
+rm -f main.sparse.cov
+BB_COV_OUTPUT_FORMAT=sparse ./bbout.cov main.sparse.cov
+cat main.sparse.cov
+# the blocks that are not listed come back from .bbcov.<hash>.map
+python3 ../scripts/bbcov_bin_to_text.py main.sparse.cov main.sparse.txt.cov
+cmp main.sparse.txt.cov main.cc.cov || exit 1
+BB_COV_OUTPUT_FORMAT=sparse ./bbout.cov main.sparse.cov
+python3 ../scripts/bbcov_bin_to_text.py main.sparse.cov main.sparse.txt.cov
+cmp main.sparse.txt.cov main.cc.cov || exit 1
+
+echo ""
+echo "Deferred initialization (__bb_cov_init_point):"
+clang++ -g -c -emit-llvm init_point.cc -o init_point.bc
+rm -rf init_inputs
+mkdir init_inputs
+for id in 0 1 2; do
+  echo "$id" > init_inputs/id:$id
+done
+
+# check_deferred <runtime> <pass> <prefix of the DEFER_INIT variable>
+check_deferred() {
+  opt -load-pass-plugin=../build/$1_pass.so -passes=$2 init_point.bc \
+    -o init_point.$1.bc
+  clang++ init_point.$1.bc -O0 -o init_point.$1 -L../build -l:$1_rt.a
+  rm -rf init_$1_out init_$1_deferred_out init_$1_missed_out
+  rm -f startup.log startup_deferred.log
+  STARTUP_LOG=startup.log ./init_point.$1 @@ init_inputs init_$1_out
+  STARTUP_LOG=startup_deferred.log env "$3_DEFER_INIT=1" \
+    ./init_point.$1 @@ init_inputs init_$1_deferred_out
+
+  # the startup runs once per input, or once with the fork point deferred
+  [ "$(wc -l < startup.log)" = 3 ] || exit 1
+  [ "$(wc -l < startup_deferred.log)" = 1 ] || {
+    echo "$1 did not fork at the init point."
+    exit 1
+  }
+
+  if [ $1 = path_cov ]; then
+    # one path hash per input, the inputs take different paths
+    [ "$(sort -u init_$1_out | wc -l)" = 3 ] || exit 1
+    cmp init_$1_out init_$1_deferred_out || exit 1
+  elif [ $1 = func_seq ]; then
+    # the traces start at the fork point
+    for id in 0 1 2; do
+      tail -n "$(wc -l < init_$1_deferred_out/id:$id)" init_$1_out/id:$id |
+        cmp - init_$1_deferred_out/id:$id || exit 1
+    done
+  else
+    for id in 0 1 2; do
+      cmp init_$1_out/id:$id init_$1_deferred_out/id:$id || exit 1
+    done
+  fi
+
+  # a target that exits before the init point replays nothing
+  SKIP_INIT_POINT=1 env "$3_DEFER_INIT=1" \
+    ./init_point.$1 @@ init_inputs init_$1_missed_out 2>&1 |
+    grep -q "before calling __bb_cov_init_point" || exit 1
+}
+check_deferred bb_cov bbcov BB_COV
+check_deferred func_cov funccov FUNC_COV
+check_deferred func_seq funcseq FUNC_SEQ
+check_deferred path_cov pathcov PATH_COV
+
+echo ""
+echo "Optimized bitcode (-O2 -g):"
+clang++ -O2 -g -c -emit-llvm lib.cc -o lib.O2.bc
+clang++ -O2 -g -c -emit-llvm lib_main.cc -o lib_main.O2.bc
+llvm-link lib.O2.bc lib_main.O2.bc -o lib_O2.bc
+# lib_sum is inlined into main across the two files, and the basic blocks
+# lose their names as with a release build of clang
+opt -O2 -discard-value-names lib_O2.bc -o lib_O2.inlined.bc
+llvm-dis lib_O2.inlined.bc -o - | awk '/^define .*@main\(/,/^}/' |
+  grep -q "call .*lib_sum" && { echo "lib_sum was not inlined."; exit 1; }
+opt -load-pass-plugin=../build/bb_cov_pass.so -passes=bbcov \
+  lib_O2.inlined.bc -o lib_O2.bb.bc
+clang++ lib_O2.bb.bc -o lib_O2.bb -L../build -l:bb_cov_rt.a
+./lib_O2.bb lib_O2.cov
+cat lib_O2.cov
+# the inlined code is still reported under lib_sum in lib.cc
+awk '/^File /{ keep = /lib.cc$/ } keep' lib_O2.cov > lib_O2.lib.cov
+grep -q "^F lib_sum(int) 1$" lib_O2.lib.cov &&
+  awk '/^F /{ fn = $2 } fn == "lib_sum(int)" && /^B .* 1$/' \
+    lib_O2.lib.cov | grep -q . || {
+  echo "No coverage of lib.cc in the optimized build."
+  exit 1
+}
+
+echo ""
+echo "Store probes (-bbcov-store-probe):"
+opt -load-pass-plugin=../build/bb_cov_pass.so -passes=bbcov -bbcov-store-probe \
+  main.bc -o main.store.bc
+clang++ main.store.bc -O0 -o main.store.bb -L../build -l:bb_cov_rt.a
+./main.store.bb main.store.cov
+same_as_default main.store.cov
+# optimized after bbcov, the stores may be moved but are still executed
+clang++ main.store.bc -O2 -o main.store.O2.bb -L../build -l:bb_cov_rt.a
+./main.store.O2.bb main.store.O2.cov
+same_as_default main.store.O2.cov
+
+echo ""
+echo "Optimized before bbcov (-passes=bbcov-O2):"
+opt -load-pass-plugin=../build/bb_cov_pass.so -passes=bbcov-O2 main.bc \
+  -o main.bbcov-O2.bc
+clang++ main.bbcov-O2.bc -o main.bbcov-O2.bb -L../build -l:bb_cov_rt.a
+./main.bbcov-O2.bb main.bbcov-O2.cov
+cat main.bbcov-O2.cov
+# -O2 folds most of main.cc away, so the report is the one of the same
+# pipeline run in two steps
+opt -O2 main.bc -o main.O2.bc
+opt -load-pass-plugin=../build/bb_cov_pass.so -passes=bbcov main.O2.bc \
+  -o main.O2.bb.bc
+clang++ main.O2.bb.bc -o main.O2.bb -L../build -l:bb_cov_rt.a
+./main.O2.bb main.O2.cov
+cmp main.bbcov-O2.cov main.O2.cov || exit 1
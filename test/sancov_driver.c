@@ -0,0 +1,42 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Stand-in for libFuzzer: keeps the counters registered by -bbcov-sancov,
+// clears them before the input like libFuzzer does, and fails if the input
+// set none of them.
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static char *counters_start = NULL;
+static char *counters_stop = NULL;
+
+void __sanitizer_cov_8bit_counters_init(char *start, char *stop) {
+  counters_start = start;
+  counters_stop = stop;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || counters_start == counters_stop) {
+    printf("No counters registered.\n");
+    return 1;
+  }
+
+  uint8_t data[256];
+  FILE *input = fopen(argv[1], "rb");
+  if (input == NULL) { return 1; }
+  size_t size = fread(data, 1, sizeof(data), input);
+  fclose(input);
+
+  memset(counters_start, 0, counters_stop - counters_start);
+  LLVMFuzzerTestOneInput(data, size);
+
+  size_t num_set = 0;
+  for (char *counter = counters_start; counter < counters_stop; counter++) {
+    if (*counter != 0) { num_set++; }
+  }
+  printf("%zu of %zu counters set.\n", num_set,
+         (size_t)(counters_stop - counters_start));
+  exit(num_set == 0);
+}